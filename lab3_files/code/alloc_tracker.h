@@ -0,0 +1,318 @@
+#ifndef ALLOC_TRACKER_H
+#define ALLOC_TRACKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Heap accounting through the global operator new / delete. Every
+// allocation is charged to the current layer, phase and subsystem tag:
+// count, bytes, peak live bytes, and whatever is still live at exit. Layer
+// and phase are process wide and set by the driving thread, like the
+// profiler's layer; the tag belongs to the allocating thread. Tags and phase
+// names must be string literals.
+//
+// Everything is compiled out unless MLARCH_TRACK_ALLOC is defined. The
+// replacement operators are not inline, so only one translation unit of a
+// program may include this with the define (every tool here is a single
+// one). The report goes to stderr at exit, or to MLARCH_ALLOC_OUTPUT.
+struct Alloc_record {
+    int layer;                  // -1 outside any layer
+    const char *phase;
+    const char *tag;
+    long long allocations;
+    long long frees;            // of blocks allocated under this record
+    long long bytes;            // total requested
+    long long live_count;
+    long long live_bytes;
+    long long peak_bytes;       // highest live_bytes
+};
+
+class Alloc_tracker {
+public:
+    static Alloc_tracker &instance();
+
+    void *allocate(size_t bytes, size_t alignment);
+    void release(void *p);
+
+    // allocations and bytes requested since start, over every record
+    long long getAllocations() const;
+    long long getAllocated_bytes() const;
+    std::vector<Alloc_record> records() const;
+    void report() const;
+    // on by default; a program that checks the counts itself turns it off
+    void setReport_at_exit(bool report_at_exit);
+
+    int getCurrent_layer() const;
+    void setCurrent_layer(int current_layer);
+    const char *getCurrent_phase() const;
+    void setCurrent_phase(const char *current_phase);
+    static const char *&current_tag();
+
+private:
+    Alloc_tracker();
+    int record_index(int layer, const char *phase, const char *tag);
+
+    // sits right before every block handed out
+    struct Header {
+        uint64_t bytes;
+        int32_t record;
+        int32_t offset;         // from the malloc'd pointer to the block
+    };
+
+    // fixed storage: the bookkeeping itself must never call operator new
+    static const int MAX_RECORDS = 1024;
+    Alloc_record table[MAX_RECORDS];
+    int record_count;
+    long long allocations;
+    long long allocated_bytes;
+    int current_layer;
+    const char *current_phase;
+    bool report_at_exit;
+    mutable std::mutex lock;
+};
+
+// sets the thread's tag (or the process' phase) for the enclosing scope
+class Alloc_tag_scope {
+public:
+    Alloc_tag_scope(const char *tag) : previous(Alloc_tracker::current_tag()) { Alloc_tracker::current_tag() = tag; }
+    ~Alloc_tag_scope() { Alloc_tracker::current_tag() = previous; }
+private:
+    const char *previous;
+};
+
+class Alloc_phase_scope {
+public:
+    Alloc_phase_scope(const char *phase) : previous(Alloc_tracker::instance().getCurrent_phase()) {
+        Alloc_tracker::instance().setCurrent_phase(phase);
+    }
+    ~Alloc_phase_scope() { Alloc_tracker::instance().setCurrent_phase(previous); }
+private:
+    const char *previous;
+};
+
+inline Alloc_tracker &Alloc_tracker::instance() {
+    // a function-local static, not new: operator new calls this
+    static Alloc_tracker tracker;
+    return tracker;
+}
+
+inline Alloc_tracker::Alloc_tracker() {
+    record_count = 0;
+    allocations = 0;
+    allocated_bytes = 0;
+    current_layer = -1;
+    current_phase = "none";
+    report_at_exit = true;
+    std::atexit([]() {
+        if (Alloc_tracker::instance().report_at_exit) Alloc_tracker::instance().report();
+    });
+}
+
+inline const char *&Alloc_tracker::current_tag() {
+    static thread_local const char *tag = "untagged";
+    return tag;
+}
+
+inline int Alloc_tracker::record_index(int layer, const char *phase, const char *tag) {
+    for (int i = record_count - 1; i >= 0; i--) {
+        const Alloc_record &record = table[i];
+        if (record.layer == layer && (record.phase == phase || strcmp(record.phase, phase) == 0) &&
+            (record.tag == tag || strcmp(record.tag, tag) == 0))
+            return i;
+    }
+    // a full table charges the rest to the last record
+    if (record_count == MAX_RECORDS) return MAX_RECORDS - 1;
+    Alloc_record &record = table[record_count];
+    memset(&record, 0, sizeof(record));
+    record.layer = layer;
+    record.phase = phase;
+    record.tag = tag;
+    return record_count++;
+}
+
+inline void *Alloc_tracker::allocate(size_t bytes, size_t alignment) {
+    if (alignment < alignof(std::max_align_t)) alignment = alignof(std::max_align_t);
+    // room for the header in front of an aligned block
+    size_t front = (sizeof(Header) + alignment - 1) / alignment * alignment;
+    char *raw = static_cast<char *>(malloc(bytes + front + alignment));
+    if (!raw) return NULL;
+    uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + front + alignment - 1) / alignment * alignment;
+    char *block = reinterpret_cast<char *>(start);
+    Header *header = reinterpret_cast<Header *>(block) - 1;
+    header->bytes = bytes;
+    header->offset = block - raw;
+
+    const char *tag = current_tag();
+    std::lock_guard<std::mutex> guard(lock);
+    int index = record_index(current_layer, current_phase, tag);
+    Alloc_record &record = table[index];
+    record.allocations++;
+    record.bytes += bytes;
+    record.live_count++;
+    record.live_bytes += bytes;
+    if (record.live_bytes > record.peak_bytes) record.peak_bytes = record.live_bytes;
+    allocations++;
+    allocated_bytes += bytes;
+    header->record = index;
+    return block;
+}
+
+inline void Alloc_tracker::release(void *p) {
+    if (!p) return;
+    Header *header = static_cast<Header *>(p) - 1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Alloc_record &record = table[header->record];
+        record.frees++;
+        record.live_count--;
+        record.live_bytes -= header->bytes;
+    }
+    free(static_cast<char *>(p) - header->offset);
+}
+
+inline long long Alloc_tracker::getAllocations() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return allocations;
+}
+
+inline long long Alloc_tracker::getAllocated_bytes() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return allocated_bytes;
+}
+
+inline std::vector<Alloc_record> Alloc_tracker::records() const {
+    // reserved before locking: growing the vector under the lock would deadlock
+    std::vector<Alloc_record> copy;
+    copy.reserve(MAX_RECORDS);
+    std::lock_guard<std::mutex> guard(lock);
+    copy.assign(table, table + record_count);
+    return copy;
+}
+
+// live blocks at exit include what static objects still hold, so a small
+// "live" figure outside any layer is expected; inside a layer it is a leak
+inline void Alloc_tracker::report() const {
+    std::lock_guard<std::mutex> guard(lock);
+    if (record_count == 0) return;
+
+    const char *output = std::getenv("MLARCH_ALLOC_OUTPUT");
+    FILE *out = output ? fopen(output, "w") : stderr;
+    if (!out) {
+        printf("cannot open allocation output %s\n", output);
+        out = stderr;
+    }
+    fprintf(out, "%-6s %-16s %-16s %12s %14s %14s %10s %14s\n", "layer", "phase", "tag", "allocs", "bytes",
+            "peak", "live", "live_bytes");
+    for (int i = 0; i < record_count; i++) {
+        const Alloc_record &record = table[i];
+        char layer[16];
+        if (record.layer < 0)
+            snprintf(layer, sizeof(layer), "net");
+        else
+            snprintf(layer, sizeof(layer), "%d", record.layer);
+        fprintf(out, "%-6s %-16s %-16s %12lld %14lld %14lld %10lld %14lld\n", layer, record.phase, record.tag,
+                record.allocations, record.bytes, record.peak_bytes, record.live_count, record.live_bytes);
+    }
+    if (out != stderr) fclose(out);
+}
+
+inline void Alloc_tracker::setReport_at_exit(bool report_at_exit) {
+    Alloc_tracker::report_at_exit = report_at_exit;
+}
+
+inline int Alloc_tracker::getCurrent_layer() const {
+    return current_layer;
+}
+
+inline void Alloc_tracker::setCurrent_layer(int current_layer) {
+    std::lock_guard<std::mutex> guard(lock);
+    Alloc_tracker::current_layer = current_layer;
+}
+
+inline const char *Alloc_tracker::getCurrent_phase() const {
+    return current_phase;
+}
+
+inline void Alloc_tracker::setCurrent_phase(const char *current_phase) {
+    std::lock_guard<std::mutex> guard(lock);
+    Alloc_tracker::current_phase = current_phase;
+}
+
+#define ALLOC_CONCAT_INNER(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_INNER(a, b)
+
+#ifdef MLARCH_TRACK_ALLOC
+#define ALLOC_TAG(tag) Alloc_tag_scope ALLOC_CONCAT(alloc_tag_, __LINE__)(tag)
+#define ALLOC_PHASE(phase) Alloc_phase_scope ALLOC_CONCAT(alloc_phase_, __LINE__)(phase)
+#define ALLOC_LAYER(layer_id) Alloc_tracker::instance().setCurrent_layer(layer_id)
+
+void *operator new(size_t bytes) {
+    void *p = Alloc_tracker::instance().allocate(bytes, 0);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t bytes) {
+    void *p = Alloc_tracker::instance().allocate(bytes, 0);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t bytes, std::align_val_t alignment) {
+    void *p = Alloc_tracker::instance().allocate(bytes, (size_t)alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t bytes, std::align_val_t alignment) {
+    void *p = Alloc_tracker::instance().allocate(bytes, (size_t)alignment);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t bytes, const std::nothrow_t &) noexcept {
+    return Alloc_tracker::instance().allocate(bytes, 0);
+}
+
+void *operator new[](size_t bytes, const std::nothrow_t &) noexcept {
+    return Alloc_tracker::instance().allocate(bytes, 0);
+}
+
+void *operator new(size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Alloc_tracker::instance().allocate(bytes, (size_t)alignment);
+}
+
+void *operator new[](size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Alloc_tracker::instance().allocate(bytes, (size_t)alignment);
+}
+
+// the header knows how the block was made, so every delete is the same
+void operator delete(void *p) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete[](void *p) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete(void *p, size_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete[](void *p, size_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete(void *p, std::align_val_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { Alloc_tracker::instance().release(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    Alloc_tracker::instance().release(p);
+}
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    Alloc_tracker::instance().release(p);
+}
+#else
+#define ALLOC_TAG(tag) ((void)0)
+#define ALLOC_PHASE(phase) ((void)0)
+#define ALLOC_LAYER(layer_id) ((void)0)
+#endif
+
+#endif //ALLOC_TRACKER_H
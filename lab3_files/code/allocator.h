@@ -0,0 +1,296 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "huge_pages.h"
+
+// Memory source for Array*D and Stream<T>. Containers capture the calling
+// thread's current allocator when they allocate and give memory back to that
+// same allocator, so an Allocator_scope only has to be open while they grow.
+class Allocator {
+public:
+    virtual ~Allocator() {}
+    virtual void *allocate(size_t bytes, size_t alignment) = 0;
+    virtual void deallocate(void *p, size_t bytes) = 0;
+    // releases everything at once; only valid when no container still uses it
+    virtual void reset() {}
+};
+
+class Heap_allocator : public Allocator {
+public:
+    void *allocate(size_t bytes, size_t alignment) override;
+    void deallocate(void *p, size_t bytes) override;
+};
+
+// Bump-pointer arena. deallocate is a no-op and reset rewinds it; after a
+// reset the chunks are merged so a steady workload runs out of one block.
+// With huge_pages the chunks are whole 2 MB pages (see huge_pages.h).
+class Arena_allocator : public Allocator {
+public:
+    Arena_allocator(size_t chunk_size = 1 << 20, Huge_page_mode huge_pages = HUGE_PAGES_OFF);
+    ~Arena_allocator();
+    void *allocate(size_t bytes, size_t alignment) override;
+    void deallocate(void *p, size_t bytes) override;
+    void reset() override;
+
+    size_t getBytes_reserved() const;
+    size_t getBytes_used() const;
+private:
+    struct Chunk {
+        char *data;
+        size_t size;
+    };
+    void add_chunk(size_t size);
+    void free_chunk(Chunk &chunk);
+
+    std::vector<Chunk> chunks;
+    size_t chunk_size;
+    Huge_page_mode huge_pages;
+    size_t offset;
+    size_t used;
+};
+
+// Size-class pool for the many small blocks Array*D and std::deque ask for.
+// Freed blocks go back on a per-class free list; blocks are carved from an
+// internal arena, and anything above the largest class comes straight from it.
+class Pool_allocator : public Allocator {
+public:
+    Pool_allocator(size_t chunk_size = 1 << 20, Huge_page_mode huge_pages = HUGE_PAGES_OFF);
+    void *allocate(size_t bytes, size_t alignment) override;
+    void deallocate(void *p, size_t bytes) override;
+    void reset() override;
+
+    size_t getBytes_reserved() const;
+private:
+    static const int CLASS_COUNT = 13;          // 16 B .. 64 KB
+    static const size_t MIN_CLASS_SIZE = 16;
+    static int size_class(size_t bytes);
+
+    struct Free_block {
+        Free_block *next;
+    };
+    Free_block *free_lists[CLASS_COUNT];
+    Arena_allocator arena;
+};
+
+Allocator *default_allocator();
+Allocator *&current_allocator();
+
+class Allocator_scope {
+public:
+    Allocator_scope(Allocator *allocator);
+    ~Allocator_scope();
+private:
+    Allocator *previous;
+};
+
+inline void *Heap_allocator::allocate(size_t bytes, size_t alignment) {
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        return operator new(bytes, std::align_val_t(alignment));
+    return operator new(bytes);
+}
+
+inline void Heap_allocator::deallocate(void *p, size_t bytes) {
+    // the alignment is not known here, so over-aligned blocks are never handed
+    // out by the containers; they only ask for alignof(T)
+    operator delete(p);
+}
+
+inline Arena_allocator::Arena_allocator(size_t chunk_size, Huge_page_mode huge_pages) {
+    this->chunk_size = huge_pages == HUGE_PAGES_OFF ? chunk_size : huge_page_round(chunk_size);
+    this->huge_pages = huge_pages;
+    offset = 0;
+    used = 0;
+}
+
+inline Arena_allocator::~Arena_allocator() {
+    for (Chunk &chunk : chunks)
+        free_chunk(chunk);
+}
+
+inline void Arena_allocator::add_chunk(size_t size) {
+    Chunk chunk;
+    chunk.size = size > chunk_size ? size : chunk_size;
+    if (huge_pages == HUGE_PAGES_OFF) {
+        chunk.data = static_cast<char *>(operator new[](chunk.size));
+    } else {
+        chunk.size = huge_page_round(chunk.size);
+        chunk.data = static_cast<char *>(huge_page_alloc(chunk.size, huge_pages));
+    }
+    chunks.push_back(chunk);
+    offset = 0;
+}
+
+inline void Arena_allocator::free_chunk(Chunk &chunk) {
+    if (huge_pages == HUGE_PAGES_OFF)
+        operator delete[](chunk.data);
+    else
+        huge_page_free(chunk.data, chunk.size);
+}
+
+inline void *Arena_allocator::allocate(size_t bytes, size_t alignment) {
+    if (bytes == 0) return NULL;
+    if (!chunks.empty()) {
+        Chunk &chunk = chunks.back();
+        uintptr_t base = reinterpret_cast<uintptr_t>(chunk.data);
+        size_t aligned = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+        if (aligned + bytes <= chunk.size) {
+            offset = aligned + bytes;
+            used += bytes;
+            return chunk.data + aligned;
+        }
+    }
+    add_chunk(bytes + alignment);
+    return allocate(bytes, alignment);
+}
+
+inline void Arena_allocator::deallocate(void *p, size_t bytes) {
+}
+
+inline void Arena_allocator::reset() {
+    if (chunks.size() > 1) {
+        size_t total = 0;
+        for (Chunk &chunk : chunks) {
+            total += chunk.size;
+            free_chunk(chunk);
+        }
+        chunks.clear();
+        add_chunk(total);
+    }
+    offset = 0;
+    used = 0;
+}
+
+inline size_t Arena_allocator::getBytes_reserved() const {
+    size_t total = 0;
+    for (const Chunk &chunk : chunks)
+        total += chunk.size;
+    return total;
+}
+
+inline size_t Arena_allocator::getBytes_used() const {
+    return used;
+}
+
+inline Pool_allocator::Pool_allocator(size_t chunk_size, Huge_page_mode huge_pages)
+    : arena(chunk_size, huge_pages) {
+    for (int i = 0; i < CLASS_COUNT; i++)
+        free_lists[i] = NULL;
+}
+
+inline int Pool_allocator::size_class(size_t bytes) {
+    int index = 0;
+    size_t size = MIN_CLASS_SIZE;
+    while (size < bytes && index < CLASS_COUNT) {
+        size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+inline void *Pool_allocator::allocate(size_t bytes, size_t alignment) {
+    if (bytes == 0) return NULL;
+    int index = size_class(bytes);
+    if (index >= CLASS_COUNT)
+        return arena.allocate(bytes, alignment);
+    // free-list blocks are only MIN_CLASS_SIZE aligned; take a fresh block,
+    // still of full class size since deallocate recycles it into the class
+    if (alignment > MIN_CLASS_SIZE)
+        return arena.allocate(MIN_CLASS_SIZE << index, alignment);
+
+    if (free_lists[index]) {
+        Free_block *block = free_lists[index];
+        free_lists[index] = block->next;
+        return block;
+    }
+    return arena.allocate(MIN_CLASS_SIZE << index, MIN_CLASS_SIZE);
+}
+
+inline void Pool_allocator::deallocate(void *p, size_t bytes) {
+    if (!p) return;
+    int index = size_class(bytes);
+    if (index >= CLASS_COUNT) return;
+    Free_block *block = static_cast<Free_block *>(p);
+    block->next = free_lists[index];
+    free_lists[index] = block;
+}
+
+inline void Pool_allocator::reset() {
+    for (int i = 0; i < CLASS_COUNT; i++)
+        free_lists[i] = NULL;
+    arena.reset();
+}
+
+inline size_t Pool_allocator::getBytes_reserved() const {
+    return arena.getBytes_reserved();
+}
+
+inline Allocator *default_allocator() {
+    static Heap_allocator heap;
+    return &heap;
+}
+
+inline Allocator *&current_allocator() {
+    thread_local Allocator *allocator = default_allocator();
+    return allocator;
+}
+
+inline Allocator_scope::Allocator_scope(Allocator *allocator) {
+    previous = current_allocator();
+    current_allocator() = allocator;
+}
+
+inline Allocator_scope::~Allocator_scope() {
+    current_allocator() = previous;
+}
+
+// new[]/delete[] equivalents on an Allocator; elements are default-initialised
+template <class U>
+U *allocate_array(Allocator *allocator, int count) {
+    if (count <= 0) return NULL;
+    void *memory = allocator->allocate((size_t)count * sizeof(U), alignof(U));
+    U *array = static_cast<U *>(memory);
+    for (int i = 0; i < count; i++)
+        new (array + i) U;
+    return array;
+}
+
+template <class U>
+void destroy_array(Allocator *allocator, U *array, int count) {
+    if (!array) return;
+    for (int i = 0; i < count; i++)
+        array[i].~U();
+    allocator->deallocate(array, (size_t)count * sizeof(U));
+}
+
+// std-compatible adapter, used for the queue inside Stream<T>
+template <class U>
+class Std_allocator {
+public:
+    typedef U value_type;
+
+    Std_allocator() : allocator(current_allocator()) {}
+    Std_allocator(Allocator *allocator) : allocator(allocator) {}
+    template <class V>
+    Std_allocator(const Std_allocator<V> &other) : allocator(other.allocator) {}
+
+    U *allocate(size_t n) {
+        return static_cast<U *>(allocator->allocate(n * sizeof(U), alignof(U)));
+    }
+    void deallocate(U *p, size_t n) {
+        allocator->deallocate(p, n * sizeof(U));
+    }
+
+    template <class V>
+    bool operator==(const Std_allocator<V> &other) const { return allocator == other.allocator; }
+    template <class V>
+    bool operator!=(const Std_allocator<V> &other) const { return allocator != other.allocator; }
+
+    Allocator *allocator;
+};
+
+#endif //ALLOCATOR_H
@@ -1,31 +1,36 @@
 #ifndef ARRAY_H
 #define ARRAY_H
 
+#include "allocator.h"
+
 template<class T>
 class Array1D {
 public:
     Array1D(int size_1d = 0);
     Array1D(const Array1D<T>& v);
-    ~Array1D() {delete [] element;}
+    ~Array1D() {destroy_array(allocator, element, size_1d);}
     T& operator[](int i) const;
     Array1D<T>& operator=(const Array1D<T>& v);
-    int Size_1d() {return size_1d;}
+    int Size_1d() const {return size_1d;}
     Array1D<T>& resize(int size_1d = 0);
 private:
     int size_1d;
     T *element;
+    Allocator *allocator;
 };
 
 template<class T>
 Array1D<T>::Array1D(int size_1d) {
     this->size_1d = size_1d;
-    element = new T[size_1d];
+    allocator = current_allocator();
+    element = allocate_array<T>(allocator, size_1d);
 }
 
 template<class T>
 Array1D<T>::Array1D(const Array1D<T>& v) {
     size_1d = v.Size_1d();
-    element = new T[size_1d];
+    allocator = current_allocator();
+    element = allocate_array<T>(allocator, size_1d);
     for (int i = 0; i < size_1d; i++)
         element[i] = v.element[i];
 }
@@ -39,9 +44,10 @@ template<class T>
 Array1D<T>& Array1D<T>::operator=(const Array1D<T>& v)
 {
     if (this != &v) {
+        destroy_array(allocator, element, size_1d);
         size_1d = v.Size_1d();
-        delete [] element;
-        element = new T[size_1d];
+        allocator = current_allocator();
+        element = allocate_array<T>(allocator, size_1d);
         for (int i = 0; i < size_1d; i++)
             element[i] = v.element[i];
     }
@@ -51,9 +57,10 @@ Array1D<T>& Array1D<T>::operator=(const Array1D<T>& v)
 template<class T>
 Array1D<T>& Array1D<T>::resize(int size_1d) {
     if (size_1d < 0) return *this;
-    delete [] element;
+    destroy_array(allocator, element, this->size_1d);
     this->size_1d = size_1d;
-    element = new T [size_1d];
+    allocator = current_allocator();
+    element = allocate_array<T>(allocator, size_1d);
     return *this;
 }
 
@@ -8,7 +8,7 @@ class Array2D {
 public:
     Array2D(int size_2d = 0, int size_1d = 0);
     Array2D(const Array2D<T>& m);
-    ~Array2D() {delete [] element2d;}
+    ~Array2D() {destroy_array(allocator, element2d, size_2d);}
     int Size_2d() const {return size_2d;}
     int Size_1d() const {return size_1d;}
     Array1D<T>& operator[](int i) const;
@@ -17,6 +17,7 @@ public:
 private:
     int size_2d, size_1d;
     Array1D<T> *element2d;
+    Allocator *allocator;
 };
 
 template<class T>
@@ -24,7 +25,8 @@ Array2D<T>::Array2D(int size_2d, int size_1d) {
     this->size_1d = size_1d;
     this->size_2d = size_2d;
 
-    element2d = new Array1D<T> [size_2d];
+    allocator = current_allocator();
+    element2d = allocate_array<Array1D<T> >(allocator, size_2d);
 
     for (int i = 0; i < size_2d; i++)
         element2d[i].resize(size_1d);
@@ -39,10 +41,11 @@ template<class T>
 Array2D<T>& Array2D<T>::operator=(const Array2D<T>& m)
 {
     if (this != &m) {
-        delete [] element2d;
+        destroy_array(allocator, element2d, size_2d);
         size_2d = m.Size_2d();
         size_1d = m.Size_1d();
-        element2d = new Array1D<T> [size_2d];
+        allocator = current_allocator();
+        element2d = allocate_array<Array1D<T> >(allocator, size_2d);
 
         for (int i = 0; i < size_2d; i++)
             element2d[i] = m.element2d[i];
@@ -56,7 +59,8 @@ Array2D<T>::Array2D(const Array2D<T>& m) {
     size_2d = m.Size_2d();
     size_1d = m.Size_1d();
 
-    element2d = new Array1D<T> [size_2d];
+    allocator = current_allocator();
+    element2d = allocate_array<Array1D<T> >(allocator, size_2d);
 
     for (int i = 0; i < size_2d; i++)
         element2d[i] = m.element2d[i];
@@ -65,11 +69,12 @@ Array2D<T>::Array2D(const Array2D<T>& m) {
 template<class T>
 Array2D<T>& Array2D<T>::resize(int size_2d, int size_1d) {
     if (size_2d < 0 || size_1d < 0) return *this;
-    delete [] element2d;
+    destroy_array(allocator, element2d, this->size_2d);
     this->size_2d = size_2d;
     this->size_1d = size_1d;
 
-    element2d = new Array1D<T> [size_2d];
+    allocator = current_allocator();
+    element2d = allocate_array<Array1D<T> >(allocator, size_2d);
     for (int i = 0; i < size_2d; i++)
         element2d[i].resize(size_1d);
 
@@ -8,7 +8,7 @@ class Array3D {
 public:
     Array3D(int size_3d = 0, int size_2d = 0, int size_1d = 0);
     Array3D(const Array3D<T>& m);
-    ~Array3D() {delete [] element3d;}
+    ~Array3D() {destroy_array(allocator, element3d, size_3d);}
     int Size_3d() const {return size_3d;}
     int Size_2d() const {return size_2d;}
     int Size_1d() const {return size_1d;}
@@ -18,6 +18,7 @@ public:
 private:
     int size_3d, size_2d, size_1d;
     Array2D<T> *element3d;
+    Allocator *allocator;
 };
 
 template<class T>
@@ -26,7 +27,8 @@ Array3D<T>::Array3D(int size_3d, int size_2d, int size_1d) {
     this->size_2d = size_2d;
     this->size_1d = size_1d;
 
-    element3d = new Array2D<T> [size_3d];
+    allocator = current_allocator();
+    element3d = allocate_array<Array2D<T> >(allocator, size_3d);
 
     for (int i = 0; i < size_3d; i++)
         element3d[i].resize(size_2d, size_1d);
@@ -41,11 +43,12 @@ template<class T>
 Array3D<T>& Array3D<T>::operator=(const Array3D<T>& m)
 {
     if (this != &m) {
-        delete [] element3d;
+        destroy_array(allocator, element3d, size_3d);
         size_3d = m.Size_3d();
         size_2d = m.Size_2d();
         size_1d = m.Size_1d();
-        element3d = new Array2D<T> [size_3d];
+        allocator = current_allocator();
+        element3d = allocate_array<Array2D<T> >(allocator, size_3d);
 
         for (int i = 0; i < size_3d; i++)
             element3d[i] = m.element3d[i];
@@ -61,7 +64,8 @@ Array3D<T>::Array3D(const Array3D<T>& m) {
     size_2d = m.Size_2d();
     size_1d = m.Size_1d();
 
-    element3d = new Array2D<T> [size_3d];
+    allocator = current_allocator();
+    element3d = allocate_array<Array2D<T> >(allocator, size_3d);
 
     for (int i = 0; i < size_3d; i++)
         element3d[i] = m.element3d[i];
@@ -70,13 +74,14 @@ Array3D<T>::Array3D(const Array3D<T>& m) {
 template<class T>
 Array3D<T>& Array3D<T>::resize(int size_3d, int size_2d, int size_1d) {
     if (size_3d < 0 || size_2d < 0 || size_1d < 0) return *this;
-    delete [] element3d;
+    destroy_array(allocator, element3d, this->size_3d);
 
     this->size_3d = size_3d;
     this->size_2d = size_2d;
     this->size_1d = size_1d;
 
-    element3d = new Array2D<T> [size_3d];
+    allocator = current_allocator();
+    element3d = allocate_array<Array2D<T> >(allocator, size_3d);
     for (int i = 0; i < size_3d; i++)
         element3d[i].resize(size_2d, size_1d);
 
@@ -0,0 +1,406 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "alloc_tracker.h"
+
+// One whole-file read or write. data holds what was read, or what is being
+// written; status is 0 or a negative errno once done is set.
+struct Io_request {
+    std::string path;
+    std::string data;
+    bool write;
+    std::atomic<bool> done;
+    int status;
+
+    // backend state
+    int fd;
+    long long offset;
+    struct iovec iov;
+};
+
+typedef std::shared_ptr<Io_request> Io_handle;
+
+// Whole-file I/O that runs behind the caller's back. read/write only queue
+// the request; wait blocks until it has finished and returns its status.
+class Async_io {
+public:
+    virtual ~Async_io() {}
+    virtual Io_handle read(const std::string &path) = 0;
+    virtual Io_handle write(const std::string &path, std::string data) = 0;
+    virtual int wait(const Io_handle &request) = 0;
+    virtual const char *name() const = 0;
+
+protected:
+    static Io_handle make_request(const std::string &path, bool write, std::string data) {
+        Io_handle request = std::make_shared<Io_request>();
+        request->path = path;
+        request->data.swap(data);
+        request->write = write;
+        request->done = false;
+        request->status = 0;
+        request->fd = -1;
+        request->offset = 0;
+        return request;
+    }
+    // opens the file and sizes the read buffer; false when there is nothing left to do
+    static bool open_request(Io_request &request);
+    static void finish_request(Io_request &request, int status);
+    static void run_blocking(Io_request &request);
+};
+
+inline bool Async_io::open_request(Io_request &request) {
+    if (request.write)
+        request.fd = open(request.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    else
+        request.fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (request.fd < 0) {
+        finish_request(request, -errno);
+        return false;
+    }
+    if (!request.write) {
+        struct stat info;
+        if (fstat(request.fd, &info) != 0) {
+            finish_request(request, -errno);
+            return false;
+        }
+        request.data.resize(info.st_size);
+    }
+    if (request.data.empty()) {
+        finish_request(request, 0);
+        return false;
+    }
+    return true;
+}
+
+inline void Async_io::finish_request(Io_request &request, int status) {
+    if (request.fd >= 0) close(request.fd);
+    request.fd = -1;
+    if (!request.write && status == 0) request.data.resize(request.offset);
+    request.status = status;
+    request.done = true;
+}
+
+inline void Async_io::run_blocking(Io_request &request) {
+    if (!open_request(request)) return;
+    while (request.offset < (long long)request.data.size()) {
+        char *at = &request.data[request.offset];
+        size_t left = request.data.size() - request.offset;
+        ssize_t n = request.write ? pwrite(request.fd, at, left, request.offset)
+                                  : pread(request.fd, at, left, request.offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            finish_request(request, -errno);
+            return;
+        }
+        if (n == 0) break;
+        request.offset += n;
+    }
+    finish_request(request, 0);
+}
+
+// reference backend: everything happens inside read/write
+class Sync_io : public Async_io {
+public:
+    Io_handle read(const std::string &path) override {
+        Io_handle request = make_request(path, false, std::string());
+        run_blocking(*request);
+        return request;
+    }
+    Io_handle write(const std::string &path, std::string data) override {
+        Io_handle request = make_request(path, true, std::move(data));
+        run_blocking(*request);
+        return request;
+    }
+    int wait(const Io_handle &request) override { return request->status; }
+    const char *name() const override { return "sync"; }
+};
+
+// one I/O thread working through a FIFO of blocking requests
+class Thread_io : public Async_io {
+public:
+    Thread_io() : stopping(false) { worker = std::thread(&Thread_io::worker_loop, this); }
+    ~Thread_io() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        queued.notify_all();
+        worker.join();
+    }
+    Io_handle read(const std::string &path) override { return submit(make_request(path, false, std::string())); }
+    Io_handle write(const std::string &path, std::string data) override {
+        return submit(make_request(path, true, std::move(data)));
+    }
+    int wait(const Io_handle &request) override {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return request->done.load(); });
+        return request->status;
+    }
+    const char *name() const override { return "thread"; }
+
+private:
+    Io_handle submit(Io_handle request) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back(request);
+        }
+        queued.notify_one();
+        return request;
+    }
+    void worker_loop() {
+        ALLOC_TAG("io");
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            queued.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            Io_handle request = pending.front();
+            pending.pop_front();
+            guard.unlock();
+            run_blocking(*request);
+            guard.lock();
+            finished.notify_all();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable finished;
+    std::deque<Io_handle> pending;
+    bool stopping;
+    std::thread worker;
+};
+
+// io_uring through the raw syscalls (no liburing). Each request is one
+// READV/WRITEV at a time; short transfers are resubmitted from wait, which
+// is also where completions are reaped. If the ring itself fails, what is
+// in it fails with that error and later requests run blocking.
+class Uring_io : public Async_io {
+public:
+    Uring_io(unsigned entries = 64);
+    ~Uring_io();
+    bool isReady() const { return ring_fd >= 0; }
+
+    Io_handle read(const std::string &path) override { return submit(make_request(path, false, std::string())); }
+    Io_handle write(const std::string &path, std::string data) override {
+        return submit(make_request(path, true, std::move(data)));
+    }
+    int wait(const Io_handle &request) override;
+    const char *name() const override { return "io_uring"; }
+
+private:
+    Io_handle submit(Io_handle request);
+    bool queue_sqe(Io_request &request);
+    int reap(unsigned min_complete);
+    void abandon(int status);
+    unsigned unsubmitted() const;
+
+    int ring_fd;
+    int ring_error;
+    unsigned sq_entries;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    std::mutex lock;
+    std::map<Io_request *, Io_handle> in_flight;
+};
+
+inline Uring_io::Uring_io(unsigned entries) {
+    ring_fd = -1;
+    ring_error = 0;
+    sq_ring = cq_ring = MAP_FAILED;
+    sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return;
+
+    sq_entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring
+                          : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                 IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                       IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring_fd = fd;
+}
+
+inline Uring_io::~Uring_io() {
+    if (ring_fd >= 0) {
+        std::lock_guard<std::mutex> guard(lock);
+        while (!in_flight.empty() && ring_error == 0)
+            reap(1);
+    }
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+inline Io_handle Uring_io::submit(Io_handle request) {
+    std::lock_guard<std::mutex> guard(lock);
+    // once the ring has failed, requests fall back to blocking I/O
+    if (ring_error != 0) {
+        run_blocking(*request);
+        return request;
+    }
+    if (!open_request(*request)) return request;
+    in_flight[request.get()] = request;
+    queue_sqe(*request);
+    return request;
+}
+
+// caller holds lock; false when the ring failed while making room
+inline bool Uring_io::queue_sqe(Io_request &request) {
+    while (unsubmitted() >= sq_entries)
+        if (reap(1) != 0) return false;
+
+    request.iov.iov_base = &request.data[request.offset];
+    request.iov.iov_len = request.data.size() - request.offset;
+
+    unsigned tail = __atomic_load_n(sq_tail, __ATOMIC_RELAXED);
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = request.fd;
+    sqe->off = request.offset;
+    sqe->addr = (unsigned long)&request.iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)&request;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // if this enter fails the entry stays queued and the next one submits it
+    int submitted;
+    do {
+        submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted(), 0, 0, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+    return true;
+}
+
+inline unsigned Uring_io::unsubmitted() const {
+    return __atomic_load_n(sq_tail, __ATOMIC_RELAXED) - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+// caller holds lock; returns 0, or the negative errno the ring failed with
+inline int Uring_io::reap(unsigned min_complete) {
+    if (ring_error != 0) return ring_error;
+    int status;
+    do {
+        status = syscall(__NR_io_uring_enter, ring_fd, unsubmitted(), min_complete, IORING_ENTER_GETEVENTS, NULL,
+                         0);
+    } while (status < 0 && errno == EINTR);
+    // a full completion queue (EBUSY) clears by draining it; anything else
+    // with nothing to drain means the ring is no longer usable
+    if (status < 0 && __atomic_load_n(cq_head, __ATOMIC_RELAXED) == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        abandon(-errno);
+        return ring_error;
+    }
+
+    // a resubmission can reap recursively when the submission queue is full,
+    // so the head is read again for every entry
+    unsigned head;
+    while ((head = __atomic_load_n(cq_head, __ATOMIC_RELAXED)) != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        Io_request *request = (Io_request *)(unsigned long)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        bool queued = true;
+        if (result == -EINTR || result == -EAGAIN) {
+            queued = queue_sqe(*request);
+        } else if (result < 0) {
+            finish_request(*request, result);
+        } else {
+            request->offset += result;
+            if (result > 0 && request->offset < (long long)request->data.size())
+                queued = queue_sqe(*request);
+            else
+                finish_request(*request, 0);
+        }
+        if (!queued) return ring_error;
+        if (request->done) in_flight.erase(request);
+    }
+    return 0;
+}
+
+// the ring is unusable: every request still in it fails with status. The
+// handles stay in in_flight so the kernel never writes into a freed buffer.
+inline void Uring_io::abandon(int status) {
+    ring_error = status;
+    for (auto &entry : in_flight)
+        if (!entry.first->done) finish_request(*entry.first, status);
+}
+
+inline int Uring_io::wait(const Io_handle &request) {
+    std::lock_guard<std::mutex> guard(lock);
+    while (!request->done)
+        if (reap(1) != 0) break;
+    return request->status;
+}
+
+// MLARCH_IO=uring|thread|sync picks the backend; by default io_uring when the
+// kernel allows it, the I/O thread otherwise
+inline Async_io *create_async_io(std::string backend = "") {
+    if (backend.empty()) {
+        const char *env = std::getenv("MLARCH_IO");
+        backend = env ? env : "";
+    }
+    if (backend == "sync") return new Sync_io();
+    if (backend == "thread") return new Thread_io();
+
+    Uring_io *uring = new Uring_io();
+    if (uring->isReady()) return uring;
+    delete uring;
+    return new Thread_io();
+}
+
+#endif //ASYNC_IO_H
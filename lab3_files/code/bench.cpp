@@ -0,0 +1,416 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "array4d.h"
+#include "file_utils.h"
+#include "network.h"
+#include "perf_counter.h"
+#include "sparse_matrix.h"
+#include "stream_utils.h"
+
+// Microbenchmarks for the conversion kernels, the Array*D containers and
+// the text parser. Results go to stdout; use
+//   ./bench --benchmark_out=bench.json --benchmark_out_format=json
+// to get a machine-readable file that can be diffed between versions.
+
+// with MLARCH_TRACK_ALLOC the tracker owns the global operators (network.h
+// includes it), so the counters come from it instead
+#ifdef MLARCH_TRACK_ALLOC
+static long long allocations_so_far() {
+    return Alloc_tracker::instance().getAllocations();
+}
+
+static long long allocated_bytes_so_far() {
+    return Alloc_tracker::instance().getAllocated_bytes();
+}
+#else
+// the replaced operators pair malloc with free, which gcc cannot see through
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static std::atomic<long long> allocation_count(0);
+static std::atomic<long long> allocation_bytes(0);
+
+static long long allocations_so_far() {
+    return allocation_count.load();
+}
+
+static long long allocated_bytes_so_far() {
+    return allocation_bytes.load();
+}
+
+void *operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// per-iteration allocation counters, reported next to the throughput numbers
+class Allocation_counter {
+public:
+    Allocation_counter() {
+        start_count = allocations_so_far();
+        start_bytes = allocated_bytes_so_far();
+        excluded_count = 0;
+        excluded_bytes = 0;
+    }
+    // allocations between pause() and resume() (untimed setup) are not reported
+    void pause() {
+        pause_count = allocations_so_far();
+        pause_bytes = allocated_bytes_so_far();
+    }
+    void resume() {
+        excluded_count += allocations_so_far() - pause_count;
+        excluded_bytes += allocated_bytes_so_far() - pause_bytes;
+    }
+    void report(benchmark::State &state) {
+        double iterations = state.iterations() ? state.iterations() : 1;
+        state.counters["allocs_per_call"] = (allocations_so_far() - start_count - excluded_count) / iterations;
+        state.counters["alloc_bytes_per_call"] = (allocated_bytes_so_far() - start_bytes - excluded_bytes) / iterations;
+    }
+private:
+    long long start_count, start_bytes;
+    long long pause_count, pause_bytes;
+    long long excluded_count, excluded_bytes;
+};
+
+// per-iteration hardware events of the benchmark thread (cycles, instructions,
+// LLC and dTLB misses, plus ipc); events the machine does not expose are
+// simply not reported
+class Hardware_counter {
+public:
+    Hardware_counter() {
+        start = perf_counters().read();
+        for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            excluded[i] = 0;
+    }
+    void pause() {
+        paused = perf_counters().read();
+    }
+    void resume() {
+        Perf_sample delta = perf_delta(paused, perf_counters().read());
+        for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            if (delta.values[i] > 0) excluded[i] += delta.values[i];
+    }
+    void report(benchmark::State &state) {
+        double iterations = state.iterations() ? state.iterations() : 1;
+        Perf_sample delta = perf_delta(start, perf_counters().read());
+        for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            if (delta.values[i] >= 0)
+                state.counters[std::string(perf_event_name(i)) + "_per_call"] =
+                    (delta.values[i] - excluded[i]) / iterations;
+        long long cycles = delta.values[PERF_CYCLES] - excluded[PERF_CYCLES];
+        if (delta.values[PERF_CYCLES] >= 0 && delta.values[PERF_INSTRUCTIONS] >= 0 && cycles > 0)
+            state.counters["ipc"] =
+                (double)(delta.values[PERF_INSTRUCTIONS] - excluded[PERF_INSTRUCTIONS]) / cycles;
+    }
+private:
+    Perf_sample start, paused;
+    long long excluded[PERF_EVENT_COUNT];
+};
+
+template <class T>
+static void fill_input(Array3D<T> &input, int height, int width, int channel) {
+    input.resize(height, width, channel);
+    for (int h = 0; h < height; h++)
+        for (int w = 0; w < width; w++)
+            for (int c = 0; c < channel; c++)
+                input[h][w][c] = (T)((h * 7 + w * 3 + c) % 10);
+}
+
+template <class T>
+static void fill_kernel(Array4D<T> &kernel, int filters, int size, int channel) {
+    kernel.resize(filters, size, size, channel);
+    for (int f = 0; f < filters; f++)
+        for (int h = 0; h < size; h++)
+            for (int w = 0; w < size; w++)
+                for (int c = 0; c < channel; c++)
+                    kernel[f][h][w][c] = (T)((f + h * 5 + w + c) % 10);
+}
+
+// a one-layer network whose shape vectors are set directly instead of parsed
+template <class T>
+static void setup_network(Network<T> &network, int height, int width, int channel, int filters, int size,
+                          int padding, int stride) {
+    int out_h = (height + 2 * padding - size) / stride + 1;
+    int out_w = (width + 2 * padding - size) / stride + 1;
+    network.setLayer_number(1);
+    network.setInput_height(std::vector<int>(1, height));
+    network.setInput_width(std::vector<int>(1, width));
+    network.setInput_channel(std::vector<int>(1, channel));
+    network.setKernel_dimension(std::vector<int>(1, filters));
+    network.setKernel_size(std::vector<int>(1, size));
+    network.setKernel_channel(std::vector<int>(1, channel));
+    network.setOutput_height(std::vector<int>(1, out_h));
+    network.setOutput_width(std::vector<int>(1, out_w));
+    network.setOutput_channel(std::vector<int>(1, filters));
+}
+
+// args: height(=width), channel, kernel size, stride, same padding (0/1)
+template <class T>
+static void BM_conv_convert(benchmark::State &state) {
+    int hw = state.range(0), channel = state.range(1), size = state.range(2);
+    int stride = state.range(3), padding = state.range(4) ? size / 2 : 0;
+    int filters = 16;
+    Network<T> network("");
+    setup_network(network, hw, hw, channel, filters, size, padding, stride);
+
+    Array3D<T> input;
+    Array4D<T> kernel;
+    fill_input(input, hw, hw, channel);
+    fill_kernel(kernel, filters, size, channel);
+
+    int out = (hw + 2 * padding - size) / stride + 1;
+    long long elements = (long long)out * out * size * size * channel + (long long)size * size * channel * filters;
+    long long bytes = ((long long)hw * hw * channel + (long long)filters * size * size * channel + elements) * sizeof(T);
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        Array2D<T> input_matrix;
+        Array2D<T> kernel_matrix;
+        network.conv_convert(0, padding, stride, input, kernel, input_matrix, kernel_matrix);
+        benchmark::DoNotOptimize(input_matrix[0][0]);
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+template <class T>
+static void BM_conv_convert_stream(benchmark::State &state) {
+    int hw = state.range(0), channel = state.range(1), size = state.range(2);
+    int stride = state.range(3), padding = state.range(4) ? size / 2 : 0;
+    Network<T> network("");
+    setup_network(network, hw, hw, channel, 16, size, padding, stride);
+
+    int out = (hw + 2 * padding - size) / stride + 1;
+    long long elements = (long long)out * out * size * size * channel;
+    long long bytes = ((long long)hw * hw * channel + elements) * sizeof(T);
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        state.PauseTiming();
+        allocations.pause();
+        hardware.pause();
+        Stream<T> input;
+        Stream<T> output;
+        for (long long i = 0; i < (long long)hw * hw * channel; i++)
+            input.write((T)(i % 10));
+        allocations.resume();
+        hardware.resume();
+        state.ResumeTiming();
+
+        network.conv_convert_stream(0, padding, stride, input, output);
+
+        state.PauseTiming();
+        allocations.pause();
+        hardware.pause();
+        output.clear();
+        allocations.resume();
+        hardware.resume();
+        state.ResumeTiming();
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+// args: percent of nonzero weights, sparse (0/1). One 28x28 output, 3x3x32
+// window, 64 filters: the crossover sets SPARSE_DENSITY_THRESHOLD
+template <class T>
+static void BM_conv_gemm(benchmark::State &state) {
+    int density = state.range(0);
+    bool sparse = state.range(1);
+    int rows = 28 * 28, depth = 3 * 3 * 32, filters = 64;
+
+    std::vector<T> matrix((long long)rows * depth);
+    for (long long i = 0; i < (long long)matrix.size(); i++)
+        matrix[i] = (T)(i * 7 % 10);
+    std::vector<T> kernel((long long)depth * filters);
+    for (long long i = 0; i < (long long)kernel.size(); i++)
+        kernel[i] = (i * 2654435761u >> 7) % 100 < (unsigned)density ? (T)(i % 9 + 1) : (T)0;
+    Csr_matrix<T> csr;
+    csr.pack(kernel.data(), depth, filters);
+    std::vector<T> output((long long)rows * filters);
+
+    for (auto _ : state) {
+        if (sparse)
+            sparse_gemm_tile(matrix.data(), csr, output.data(), depth, filters, 0, rows, 0, filters);
+        else
+            gemm_tile(matrix.data(), kernel.data(), output.data(), depth, filters, 0, rows, 0, filters);
+        benchmark::DoNotOptimize(output[0]);
+    }
+    state.counters["density"] = csr.density();
+    state.SetItemsProcessed(state.iterations() * (long long)rows * depth * filters);
+}
+
+// args: height, width, channel
+template <class T>
+static void BM_array3d_resize(benchmark::State &state) {
+    int height = state.range(0), width = state.range(1), channel = state.range(2);
+    long long elements = (long long)height * width * channel;
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        Array3D<T> array(height, width, channel);
+        benchmark::DoNotOptimize(array[0][0][0]);
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * elements * sizeof(T));
+}
+
+template <class T>
+static void BM_array3d_copy(benchmark::State &state) {
+    int height = state.range(0), width = state.range(1), channel = state.range(2);
+    long long elements = (long long)height * width * channel;
+    Array3D<T> source;
+    fill_input(source, height, width, channel);
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        Array3D<T> copy(source);
+        benchmark::DoNotOptimize(copy[0][0][0]);
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * elements * sizeof(T) * 2);
+}
+
+template <class T>
+static void BM_array4d_traverse(benchmark::State &state) {
+    int filters = state.range(0), size = state.range(1), channel = state.range(2);
+    long long elements = (long long)filters * size * size * channel;
+    Array4D<T> kernel;
+    fill_kernel(kernel, filters, size, channel);
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        T sum = 0;
+        for (int f = 0; f < filters; f++)
+            for (int h = 0; h < size; h++)
+                for (int w = 0; w < size; w++)
+                    for (int c = 0; c < channel; c++)
+                        sum += kernel[f][h][w][c];
+        benchmark::DoNotOptimize(sum);
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * elements * sizeof(T));
+}
+
+// args: height(=width), channel
+template <class T>
+static void BM_file_utils_parse(benchmark::State &state) {
+    int hw = state.range(0), channel = state.range(1);
+    std::string file_name = "bench_input_" + std::to_string(hw) + "_" + std::to_string(channel) + ".tmp";
+    {
+        std::ofstream out(file_name, std::ofstream::trunc);
+        out << hw << " " << hw << " " << channel << " 1 1\n";
+        for (int h = 0; h < hw; h++) {
+            for (int i = 0; i < hw * channel; i++)
+                out << (h + i) % 10 << " ";
+            out << "\n";
+        }
+    }
+    std::ifstream size_probe(file_name, std::ifstream::ate | std::ifstream::binary);
+    long long file_bytes = size_probe.tellg();
+    long long elements = (long long)hw * hw * channel;
+
+    Allocation_counter allocations;
+    Hardware_counter hardware;
+    for (auto _ : state) {
+        File_utils<T> input_util(file_name);
+        input_util.parse_file();
+        Array3D<T> input;
+        int padding, step_size;
+        input_util.get_initial_input(input, padding, step_size);
+        benchmark::DoNotOptimize(input[0][0][0]);
+    }
+    allocations.report(state);
+    hardware.report(state);
+    state.SetItemsProcessed(state.iterations() * elements);
+    state.SetBytesProcessed(state.iterations() * file_bytes);
+    std::remove(file_name.c_str());
+}
+
+static void conv_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"hw", "c", "k", "s", "pad"});
+    b->ArgsProduct({{16, 56, 112}, {3, 32}, {1, 3, 5}, {1, 2}, {0, 1}});
+}
+
+static void gemm_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"density", "sparse"});
+    b->ArgsProduct({{5, 10, 20, 30, 40, 50, 70, 100}, {0, 1}});
+}
+
+static void array3d_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"h", "w", "c"});
+    b->ArgsProduct({{16, 56, 224}, {16, 56, 224}, {3, 64}});
+}
+
+static void array4d_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"f", "k", "c"});
+    b->ArgsProduct({{16, 64}, {1, 3, 5}, {3, 64}});
+}
+
+static void parse_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"hw", "c"});
+    b->ArgsProduct({{16, 56, 224}, {3, 8}});
+}
+
+BENCHMARK_TEMPLATE(BM_conv_convert, int)->Apply(conv_args);
+BENCHMARK_TEMPLATE(BM_conv_convert, float)->Apply(conv_args);
+BENCHMARK_TEMPLATE(BM_conv_convert_stream, int)->Apply(conv_args);
+BENCHMARK_TEMPLATE(BM_conv_convert_stream, float)->Apply(conv_args);
+BENCHMARK_TEMPLATE(BM_conv_gemm, int)->Apply(gemm_args);
+BENCHMARK_TEMPLATE(BM_conv_gemm, float)->Apply(gemm_args);
+BENCHMARK_TEMPLATE(BM_array3d_resize, int)->Apply(array3d_args);
+BENCHMARK_TEMPLATE(BM_array3d_resize, float)->Apply(array3d_args);
+BENCHMARK_TEMPLATE(BM_array3d_copy, int)->Apply(array3d_args);
+BENCHMARK_TEMPLATE(BM_array3d_copy, float)->Apply(array3d_args);
+BENCHMARK_TEMPLATE(BM_array4d_traverse, int)->Apply(array4d_args);
+BENCHMARK_TEMPLATE(BM_array4d_traverse, float)->Apply(array4d_args);
+BENCHMARK_TEMPLATE(BM_file_utils_parse, int)->Apply(parse_args);
+BENCHMARK_TEMPLATE(BM_file_utils_parse, float)->Apply(parse_args);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,441 @@
+#ifndef CFG_PARSER_H
+#define CFG_PARSER_H
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum Layer_type {
+    LAYER_CONVOLUTIONAL,
+    LAYER_MAXPOOL,
+    LAYER_AVGPOOL,
+    LAYER_ROUTE,
+    LAYER_SHORTCUT,
+    LAYER_UPSAMPLE,
+    LAYER_CONNECTED,
+    LAYER_DROPOUT,
+    LAYER_SOFTMAX,
+    LAYER_YOLO
+};
+
+// Geometry of one convolution: the kernel may be non-square, stride and
+// dilation are per axis (darknet's x is the width) and each side has its own
+// zero padding. The defaults are the square, undilated layout.
+struct Conv_params {
+    int size_h, size_w;
+    int stride_h, stride_w;
+    int dilation_h, dilation_w;
+    int pad_top, pad_bottom, pad_left, pad_right;
+
+    Conv_params(int size = 1, int stride = 1, int padding = 0)
+        : size_h(size), size_w(size), stride_h(stride), stride_w(stride), dilation_h(1), dilation_w(1),
+          pad_top(padding), pad_bottom(padding), pad_left(padding), pad_right(padding) {}
+
+    // input rows / columns one dilated window spans
+    int extent_h() const { return (size_h - 1) * dilation_h + 1; }
+    int extent_w() const { return (size_w - 1) * dilation_w + 1; }
+    // 0 when the padded input is smaller than one window
+    int output_height(int height) const {
+        int padded = height + pad_top + pad_bottom;
+        return padded < extent_h() ? 0 : (padded - extent_h()) / stride_h + 1;
+    }
+    int output_width(int width) const {
+        int padded = width + pad_left + pad_right;
+        return padded < extent_w() ? 0 : (padded - extent_w()) / stride_w + 1;
+    }
+    void set_padding(int padding) { pad_top = pad_bottom = pad_left = pad_right = padding; }
+    // one size, stride and padding for both axes and no dilation
+    bool is_square() const {
+        return size_h == size_w && stride_h == stride_w && dilation_h == 1 && dilation_w == 1 &&
+               pad_top == pad_bottom && pad_top == pad_left && pad_top == pad_right;
+    }
+};
+
+// One section of a darknet cfg after parsing. Every key is kept verbatim in
+// options; the fields below are the typed view the engines use.
+struct Layer_desc {
+    Layer_type type;
+    std::string section;
+    int line;
+    std::map<std::string, std::string> options;
+
+    // convolutional / pooling / connected; a conv's size, stride and padding
+    // are its height-axis values and conv holds the full geometry
+    int filters;
+    int size;
+    int stride;
+    int padding;
+    int groups;
+    bool batch_normalize;
+    std::string activation;
+    Conv_params conv;
+
+    // route / shortcut, as absolute layer indices
+    std::vector<int> inputs;
+
+    int input_height, input_width, input_channel;
+    int output_height, output_width, output_channel;
+};
+
+// Section/key parser for darknet cfgs. Keys may appear in any order,
+// '#' and ';' start comments, and errors carry the cfg line number.
+class Cfg_parser {
+public:
+    Cfg_parser();
+
+    int parse_file(const std::string &file_name);
+    int parse(const std::string &text);
+
+    const std::vector<Layer_desc> &getLayers() const;
+    const std::map<std::string, std::string> &getNet_options() const;
+    int getInput_height() const;
+    int getInput_width() const;
+    int getInput_channel() const;
+    const std::string &getError() const;
+
+private:
+    struct Section {
+        std::string name;
+        int line;
+        std::map<std::string, std::string> options;
+        std::map<std::string, int> option_lines;
+    };
+
+    int fail(int line, const std::string &message);
+    int read_int(const Section &section, const std::string &key, int default_value, int &value);
+    int build_layer(const Section &section, Layer_desc &layer);
+    int infer_shape(Layer_desc &layer);
+
+    std::string file_name;
+    std::string error;
+    std::vector<Layer_desc> layers;
+    std::map<std::string, std::string> net_options;
+    int input_height;
+    int input_width;
+    int input_channel;
+};
+
+inline Cfg_parser::Cfg_parser() {
+    input_height = 0;
+    input_width = 0;
+    input_channel = 0;
+}
+
+inline int Cfg_parser::fail(int line, const std::string &message) {
+    error = (file_name.empty() ? std::string("cfg") : file_name) + ":" + std::to_string(line) + ": " + message;
+    return -1;
+}
+
+inline int Cfg_parser::parse_file(const std::string &file_name) {
+    std::ifstream fin(file_name);
+    if (!fin) {
+        error = "cannot open " + file_name;
+        return -1;
+    }
+    std::stringstream buffer;
+    buffer << fin.rdbuf();
+    this->file_name = file_name;
+    return parse(buffer.str());
+}
+
+inline int Cfg_parser::parse(const std::string &text) {
+    layers.clear();
+    net_options.clear();
+    error.clear();
+
+    std::vector<Section> sections;
+    std::istringstream lines(text);
+    std::string raw;
+    int line_number = 0;
+
+    while (std::getline(lines, raw)) {
+        line_number++;
+        // darknet ignores all whitespace inside a line
+        std::string line;
+        for (char ch : raw)
+            if (ch != ' ' && ch != '\t' && ch != '\r') line += ch;
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+        if (line[0] == '[') {
+            if (line[line.size() - 1] != ']' || line.size() < 3)
+                return fail(line_number, "malformed section header '" + raw + "'");
+            Section section;
+            section.name = line.substr(1, line.size() - 2);
+            section.line = line_number;
+            sections.push_back(section);
+            continue;
+        }
+
+        size_t eq_pos = line.find('=');
+        if (eq_pos == std::string::npos || eq_pos == 0)
+            return fail(line_number, "expected key=value, got '" + raw + "'");
+        if (sections.empty())
+            return fail(line_number, "key outside of any section");
+
+        Section &section = sections.back();
+        std::string key = line.substr(0, eq_pos);
+        if (section.options.count(key))
+            return fail(line_number, "duplicate key '" + key + "' in [" + section.name + "] (first on line " +
+                                     std::to_string(section.option_lines[key]) + ")");
+        section.options[key] = line.substr(eq_pos + 1);
+        section.option_lines[key] = line_number;
+    }
+
+    if (sections.empty() || (sections[0].name != "net" && sections[0].name != "network"))
+        return fail(sections.empty() ? line_number : sections[0].line, "cfg must start with a [net] section");
+
+    const Section &net = sections[0];
+    net_options = net.options;
+    if (read_int(net, "height", 0, input_height) != 0) return -1;
+    if (read_int(net, "width", 0, input_width) != 0) return -1;
+    if (read_int(net, "channels", 0, input_channel) != 0) return -1;
+    if (input_height <= 0 || input_width <= 0 || input_channel <= 0)
+        return fail(net.line, "[net] needs positive height, width and channels");
+
+    for (size_t i = 1; i < sections.size(); i++) {
+        Layer_desc layer;
+        if (build_layer(sections[i], layer) != 0) return -1;
+        if (infer_shape(layer) != 0) return -1;
+        layers.push_back(layer);
+    }
+    return 0;
+}
+
+inline int Cfg_parser::read_int(const Section &section, const std::string &key, int default_value, int &value) {
+    auto option = section.options.find(key);
+    if (option == section.options.end()) {
+        value = default_value;
+        return 0;
+    }
+    const char *begin = option->second.c_str();
+    char *end = NULL;
+    long parsed = strtol(begin, &end, 10);
+    if (option->second.empty() || *end != '\0')
+        return fail(section.option_lines.at(key), "'" + key + "' must be an integer, got '" + option->second + "'");
+    value = (int)parsed;
+    return 0;
+}
+
+inline int Cfg_parser::build_layer(const Section &section, Layer_desc &layer) {
+    static const std::map<std::string, Layer_type> section_types = {
+        {"convolutional", LAYER_CONVOLUTIONAL}, {"conv", LAYER_CONVOLUTIONAL},
+        {"maxpool", LAYER_MAXPOOL}, {"max", LAYER_MAXPOOL},
+        {"avgpool", LAYER_AVGPOOL}, {"avg", LAYER_AVGPOOL},
+        {"route", LAYER_ROUTE}, {"shortcut", LAYER_SHORTCUT},
+        {"upsample", LAYER_UPSAMPLE},
+        {"connected", LAYER_CONNECTED},
+        {"dropout", LAYER_DROPOUT},
+        {"softmax", LAYER_SOFTMAX},
+        {"yolo", LAYER_YOLO}, {"region", LAYER_YOLO},
+    };
+    auto type = section_types.find(section.name);
+    if (type == section_types.end())
+        return fail(section.line, "unknown section [" + section.name + "]");
+
+    layer.type = type->second;
+    layer.section = section.name;
+    layer.line = section.line;
+    layer.options = section.options;
+
+    int pad = 0, batch_normalize = 0;
+    if (read_int(section, "filters", 1, layer.filters) != 0) return -1;
+    if (read_int(section, "size", 1, layer.size) != 0) return -1;
+    if (read_int(section, "stride", 1, layer.stride) != 0) return -1;
+    if (read_int(section, "padding", 0, layer.padding) != 0) return -1;
+    if (read_int(section, "pad", 0, pad) != 0) return -1;
+    if (read_int(section, "groups", 1, layer.groups) != 0) return -1;
+    if (read_int(section, "batch_normalize", 0, batch_normalize) != 0) return -1;
+    layer.batch_normalize = batch_normalize != 0;
+    auto activation = section.options.find("activation");
+    layer.activation = activation == section.options.end() ? "linear" : activation->second;
+
+    if (layer.type == LAYER_CONVOLUTIONAL) {
+        if (!section.options.count("filters"))
+            return fail(section.line, "[" + section.name + "] needs 'filters'");
+        // size_x/size_y, stride_x/stride_y, dilation_x/dilation_y and
+        // padding_top/bottom/left/right default to size, stride, dilation
+        // and padding
+        Conv_params &conv = layer.conv;
+        int dilation = 1;
+        if (read_int(section, "dilation", 1, dilation) != 0) return -1;
+        if (read_int(section, "size_y", layer.size, conv.size_h) != 0) return -1;
+        if (read_int(section, "size_x", layer.size, conv.size_w) != 0) return -1;
+        if (read_int(section, "stride_y", layer.stride, conv.stride_h) != 0) return -1;
+        if (read_int(section, "stride_x", layer.stride, conv.stride_w) != 0) return -1;
+        if (read_int(section, "dilation_y", dilation, conv.dilation_h) != 0) return -1;
+        if (read_int(section, "dilation_x", dilation, conv.dilation_w) != 0) return -1;
+        if (read_int(section, "padding_top", layer.padding, conv.pad_top) != 0) return -1;
+        if (read_int(section, "padding_bottom", layer.padding, conv.pad_bottom) != 0) return -1;
+        if (read_int(section, "padding_left", layer.padding, conv.pad_left) != 0) return -1;
+        if (read_int(section, "padding_right", layer.padding, conv.pad_right) != 0) return -1;
+        // pad=1 means "same" padding (size / 2 per side, over the dilated
+        // window), which overrides an explicit padding
+        if (pad) {
+            conv.pad_top = conv.pad_bottom = conv.extent_h() / 2;
+            conv.pad_left = conv.pad_right = conv.extent_w() / 2;
+        }
+        if (conv.size_h <= 0 || conv.size_w <= 0 || conv.stride_h <= 0 || conv.stride_w <= 0 ||
+            conv.dilation_h <= 0 || conv.dilation_w <= 0)
+            return fail(section.line, "[" + section.name + "] has a non-positive size, stride or dilation");
+        if (conv.pad_top < 0 || conv.pad_bottom < 0 || conv.pad_left < 0 || conv.pad_right < 0)
+            return fail(section.line, "[" + section.name + "] has a negative padding");
+        layer.size = conv.size_h;
+        layer.stride = conv.stride_h;
+        layer.padding = conv.pad_top;
+    }
+    if (layer.type == LAYER_MAXPOOL && !section.options.count("size"))
+        layer.size = layer.stride;
+    if (layer.type == LAYER_UPSAMPLE && !section.options.count("stride"))
+        layer.stride = 2;
+    if (layer.type == LAYER_CONNECTED && read_int(section, "output", 1, layer.filters) != 0)
+        return -1;
+
+    if (layer.size <= 0 || layer.stride <= 0 || layer.filters <= 0 || layer.padding < 0 || layer.groups <= 0)
+        return fail(section.line, "[" + section.name + "] has a non-positive size, stride, filters or groups");
+
+    // route layers=-1,-4 and shortcut from=-3 are relative to this layer
+    int index = layers.size();
+    std::string references;
+    if (layer.type == LAYER_ROUTE) {
+        if (!section.options.count("layers"))
+            return fail(section.line, "[route] needs 'layers'");
+        references = section.options.at("layers");
+    } else if (layer.type == LAYER_SHORTCUT) {
+        if (!section.options.count("from"))
+            return fail(section.line, "[shortcut] needs 'from'");
+        references = section.options.at("from");
+    }
+    if (layer.type == LAYER_ROUTE || layer.type == LAYER_SHORTCUT) {
+        const char *key = layer.type == LAYER_ROUTE ? "layers" : "from";
+        int reference_line = section.option_lines.at(key);
+        if (references.empty())
+            return fail(reference_line, "[" + section.name + "] has an empty '" + key + "'");
+        std::stringstream list(references);
+        std::string item;
+        while (std::getline(list, item, ',')) {
+            char *end = NULL;
+            long value = strtol(item.c_str(), &end, 10);
+            if (item.empty() || *end != '\0')
+                return fail(reference_line, "bad layer reference '" + item + "'");
+            int absolute = value < 0 ? index + (int)value : (int)value;
+            if (absolute < 0 || absolute >= index)
+                return fail(reference_line, "layer reference " + item + " is out of range");
+            layer.inputs.push_back(absolute);
+        }
+    }
+    return 0;
+}
+
+inline int Cfg_parser::infer_shape(Layer_desc &layer) {
+    if (layers.empty()) {
+        layer.input_height = input_height;
+        layer.input_width = input_width;
+        layer.input_channel = input_channel;
+    } else {
+        layer.input_height = layers.back().output_height;
+        layer.input_width = layers.back().output_width;
+        layer.input_channel = layers.back().output_channel;
+    }
+    int h = layer.input_height, w = layer.input_width, c = layer.input_channel;
+
+    switch (layer.type) {
+    case LAYER_CONVOLUTIONAL:
+        if (c % layer.groups != 0 || layer.filters % layer.groups != 0)
+            return fail(layer.line, "groups=" + std::to_string(layer.groups) + " does not divide " +
+                                    std::to_string(c) + " input channels and " + std::to_string(layer.filters) +
+                                    " filters");
+        layer.output_height = layer.conv.output_height(h);
+        layer.output_width = layer.conv.output_width(w);
+        layer.output_channel = layer.filters;
+        break;
+    case LAYER_MAXPOOL:
+        // padding here is the total over both sides, as in darknet; it
+        // defaults to 0 (darknet uses size-1) to match this project's shapes
+        layer.output_height = (h + layer.padding - layer.size) / layer.stride + 1;
+        layer.output_width = (w + layer.padding - layer.size) / layer.stride + 1;
+        layer.output_channel = c;
+        break;
+    case LAYER_AVGPOOL:
+        layer.output_height = 1;
+        layer.output_width = 1;
+        layer.output_channel = c;
+        break;
+    case LAYER_ROUTE:
+        layer.output_height = layers[layer.inputs[0]].output_height;
+        layer.output_width = layers[layer.inputs[0]].output_width;
+        layer.output_channel = 0;
+        for (int input : layer.inputs) {
+            const Layer_desc &from = layers[input];
+            if (from.output_height != layer.output_height || from.output_width != layer.output_width)
+                return fail(layer.line, "route inputs have different spatial sizes");
+            layer.output_channel += from.output_channel;
+        }
+        break;
+    case LAYER_SHORTCUT:
+        for (int input : layer.inputs) {
+            const Layer_desc &from = layers[input];
+            if (from.output_height != h || from.output_width != w || from.output_channel != c)
+                return fail(layer.line, "shortcut from layer " + std::to_string(input) + " has shape " +
+                                        std::to_string(from.output_height) + "x" + std::to_string(from.output_width) +
+                                        "x" + std::to_string(from.output_channel) + ", expected " +
+                                        std::to_string(h) + "x" + std::to_string(w) + "x" + std::to_string(c));
+        }
+        layer.output_height = h;
+        layer.output_width = w;
+        layer.output_channel = c;
+        break;
+    case LAYER_UPSAMPLE:
+        layer.output_height = h * layer.stride;
+        layer.output_width = w * layer.stride;
+        layer.output_channel = c;
+        break;
+    case LAYER_CONNECTED:
+        layer.output_height = 1;
+        layer.output_width = 1;
+        layer.output_channel = layer.filters;
+        break;
+    case LAYER_DROPOUT:
+    case LAYER_SOFTMAX:
+    case LAYER_YOLO:
+        layer.output_height = h;
+        layer.output_width = w;
+        layer.output_channel = c;
+        break;
+    }
+
+    if (layer.output_height <= 0 || layer.output_width <= 0 || layer.output_channel <= 0)
+        return fail(layer.line, "[" + layer.section + "] produces an empty " + std::to_string(layer.output_height) +
+                                "x" + std::to_string(layer.output_width) + "x" +
+                                std::to_string(layer.output_channel) + " output from " + std::to_string(h) + "x" +
+                                std::to_string(w) + "x" + std::to_string(c));
+    return 0;
+}
+
+inline const std::vector<Layer_desc> &Cfg_parser::getLayers() const {
+    return layers;
+}
+
+inline const std::map<std::string, std::string> &Cfg_parser::getNet_options() const {
+    return net_options;
+}
+
+inline int Cfg_parser::getInput_height() const {
+    return input_height;
+}
+
+inline int Cfg_parser::getInput_width() const {
+    return input_width;
+}
+
+inline int Cfg_parser::getInput_channel() const {
+    return input_channel;
+}
+
+inline const std::string &Cfg_parser::getError() const {
+    return error;
+}
+
+#endif //CFG_PARSER_H
@@ -1,2 +1,6 @@
 #!/bin/bash
-g++ -g -o main main.cpp
+# extra flags are passed through, e.g. ./compile.sh -DMLARCH_PROFILE or -DMLARCH_TRACK_ALLOC
+g++ -g "$@" -o main main.cpp
+g++ -O2 "$@" -o generate_model generate_model.cpp -lpthread
+g++ -O2 "$@" -o systolic_sim systolic_sim.cpp -lpthread
+g++ -O2 "$@" -o inference_server inference_server.cpp -lpthread
@@ -0,0 +1,3 @@
+#!/bin/bash
+# needs Google Benchmark; run e.g. ./bench --benchmark_out=bench.json --benchmark_out_format=json
+g++ -O3 -march=native -DNDEBUG "$@" -o bench bench.cpp -lbenchmark -lpthread
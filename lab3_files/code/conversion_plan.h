@@ -0,0 +1,165 @@
+#ifndef CONVERSION_PLAN_H
+#define CONVERSION_PLAN_H
+
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "alloc_tracker.h"
+#include "cfg_parser.h"
+#include "layer_kernels.h"
+
+// What a conversion plan depends on: the input shape, the groups and the
+// conv geometry. Equal keys give identical im2col matrices.
+struct Conversion_key {
+    int height, width, channel, groups;
+    Conv_params conv;
+
+    Conversion_key(int height = 0, int width = 0, int channel = 0, int groups = 1,
+                   const Conv_params &conv = Conv_params())
+        : height(height), width(width), channel(channel), groups(groups), conv(conv) {}
+
+    bool operator<(const Conversion_key &other) const {
+        const Conv_params &a = conv, &b = other.conv;
+        return std::tie(height, width, channel, groups, a.size_h, a.size_w, a.stride_h, a.stride_w, a.dilation_h,
+                        a.dilation_w, a.pad_top, a.pad_bottom, a.pad_left, a.pad_right) <
+               std::tie(other.height, other.width, other.channel, other.groups, b.size_h, b.size_w, b.stride_h,
+                        b.stride_w, b.dilation_h, b.dilation_w, b.pad_top, b.pad_bottom, b.pad_left, b.pad_right);
+    }
+};
+
+// The gather table of one im2col, built once per key. A window's input row
+// only depends on (h_out, kh) and its column on (w_out, kw), so the table is
+// two small arrays instead of one entry per matrix value: input_row(h_out)[kh]
+// and input_col(w_out)[kw] are the input coordinates, -1 where the window
+// reads padding. Output rows / columns whose whole window is inside the input
+// are flagged, and there an undilated kernel row is one contiguous copy.
+class Conversion_plan {
+public:
+    Conversion_plan() : output_height(0), output_width(0) {}
+
+    int build(const Conversion_key &key);
+
+    const Conversion_key &getKey() const { return key; }
+    int getOutput_height() const { return output_height; }
+    int getOutput_width() const { return output_width; }
+    int getRow_length() const { return key.conv.size_h * key.conv.size_w * key.channel; }
+    const int *input_row(int h_out) const { return rows.data() + (long long)h_out * key.conv.size_h; }
+    const int *input_col(int w_out) const { return cols.data() + (long long)w_out * key.conv.size_w; }
+    bool interior(int h_out, int w_out) const { return rows_inside[h_out] && cols_inside[w_out]; }
+
+    // im2col rows first..last-1 of a flat HWC input, the same matrix as
+    // im2col_rows(..., key.groups)
+    template <class T>
+    void execute(const T *input, long long first, long long last, T *matrix) const;
+
+private:
+    Conversion_key key;
+    int output_height, output_width;
+    std::vector<int> rows, cols;
+    std::vector<char> rows_inside, cols_inside;
+};
+
+inline int Conversion_plan::build(const Conversion_key &key) {
+    const Conv_params &conv = key.conv;
+    this->key = key;
+    output_height = conv.output_height(key.height);
+    output_width = conv.output_width(key.width);
+    if (output_height <= 0 || output_width <= 0 || key.channel <= 0 || key.groups <= 0 ||
+        key.channel % key.groups != 0) {
+        output_height = output_width = 0;
+        return -1;
+    }
+
+    rows.resize((long long)output_height * conv.size_h);
+    rows_inside.assign(output_height, 1);
+    for (int h_out = 0; h_out < output_height; h_out++) {
+        for (int kh = 0; kh < conv.size_h; kh++) {
+            int h_in = h_out * conv.stride_h + kh * conv.dilation_h - conv.pad_top;
+            bool inside = h_in >= 0 && h_in < key.height;
+            rows[(long long)h_out * conv.size_h + kh] = inside ? h_in : -1;
+            if (!inside) rows_inside[h_out] = 0;
+        }
+    }
+    cols.resize((long long)output_width * conv.size_w);
+    cols_inside.assign(output_width, 1);
+    for (int w_out = 0; w_out < output_width; w_out++) {
+        for (int kw = 0; kw < conv.size_w; kw++) {
+            int w_in = w_out * conv.stride_w + kw * conv.dilation_w - conv.pad_left;
+            bool inside = w_in >= 0 && w_in < key.width;
+            cols[(long long)w_out * conv.size_w + kw] = inside ? w_in : -1;
+            if (!inside) cols_inside[w_out] = 0;
+        }
+    }
+    return 0;
+}
+
+template <class T>
+void Conversion_plan::execute(const T *input, long long first, long long last, T *matrix) const {
+    const Conv_params &conv = key.conv;
+    int channel = key.channel, groups = key.groups;
+    int row_length = getRow_length();
+    int group_channel = channel / groups;
+    long long group_depth = (long long)conv.size_h * conv.size_w * group_channel;
+    long long line_length = (long long)key.width * channel;
+    // an ungrouped, undilated kernel row reads size_w * channel values in a row
+    bool runs = groups == 1 && conv.dilation_w == 1;
+    for (long long pixel = first; pixel < last; pixel++) {
+        int h_out = pixel / output_width, w_out = pixel % output_width;
+        T *row = matrix + pixel * row_length;
+        const int *in_rows = input_row(h_out);
+        const int *in_cols = input_col(w_out);
+        if (runs && interior(h_out, w_out)) {
+            int run = conv.size_w * channel;
+            const T *corner = input + (long long)in_cols[0] * channel;
+            for (int kh = 0; kh < conv.size_h; kh++) {
+                const T *from = corner + in_rows[kh] * line_length;
+                T *to = row + kh * run;
+                for (int i = 0; i < run; i++)
+                    to[i] = from[i];
+            }
+            continue;
+        }
+        for (int kh = 0; kh < conv.size_h; kh++) {
+            const T *line = in_rows[kh] < 0 ? NULL : input + in_rows[kh] * line_length;
+            for (int kw = 0; kw < conv.size_w; kw++) {
+                T *dst = row + (kh * conv.size_w + kw) * group_channel;
+                const T *src = !line || in_cols[kw] < 0 ? NULL : line + (long long)in_cols[kw] * channel;
+                if (groups != 1) {
+                    im2col_position(src, channel, groups, group_depth, dst);
+                } else if (!src) {
+                    for (int c = 0; c < channel; c++)
+                        dst[c] = 0;
+                } else {
+                    for (int c = 0; c < channel; c++)
+                        dst[c] = src[c];
+                }
+            }
+        }
+    }
+}
+
+// Plans by key, built on first use. Entries are never removed, so a plan
+// reference stays valid for the cache's lifetime. Not thread safe: like
+// Network::forward, one caller at a time.
+class Conversion_cache {
+public:
+    // NULL when the key gives an empty output
+    const Conversion_plan *find(const Conversion_key &key);
+    size_t size() const { return plans.size(); }
+    void clear() { plans.clear(); }
+
+private:
+    std::map<Conversion_key, Conversion_plan> plans;
+};
+
+inline const Conversion_plan *Conversion_cache::find(const Conversion_key &key) {
+    auto found = plans.find(key);
+    if (found != plans.end()) return &found->second;
+    ALLOC_TAG("conversion_plan");
+    Conversion_plan plan;
+    if (plan.build(key) != 0) return NULL;
+    return &plans.emplace(key, plan).first->second;
+}
+
+#endif //CONVERSION_PLAN_H
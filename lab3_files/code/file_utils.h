@@ -6,6 +6,8 @@
 #include <fstream>
 #include <iostream>
 #include <cstring>
+#include "alloc_tracker.h"
+#include "numeric_types.h"
 #include "stream_utils.h"
 
 #include "array4d.h"
@@ -17,6 +19,7 @@ public:
     File_utils(std::string file_name);
     ~File_utils();
     void parse_file();
+    void parse_buffer(const std::string &contents);
 
     const std::string &getFile_name() const;
     void setFile_name(const std::string &file_name);
@@ -28,14 +31,62 @@ public:
     int get_initial_input(Array3D<T>& input, int &padding, int &step_size);
     int get_initial_kernel(Array4D<T>& kernel);
     int get_stream_initial_input(Stream<T>& input, int &padding, int &step_size);
+
+    bool isBinary() const;
 private:
+    int parse_binary_buffer(const std::string &contents);
+    const T *binary_values() const;
+
     std::string file_name;
     std::vector<std::string> file_contents;
+
+    // binary tensor files: "MLAB", int32 header count, int32 header[count],
+    // int32 element size, int32 dtype (binary_dtype), then the raw values in
+    // the same order as the text format
+    bool binary;
+    std::vector<int> binary_header;
+    std::vector<char> binary_contents;
 };
 
+static const char BINARY_TENSOR_MAGIC[4] = {'M', 'L', 'A', 'B'};
+
+// element type of a binary tensor file; int and float have the same size,
+// and so do bf16 and fp16, so the size alone cannot tell them apart
+enum Binary_dtype {
+    DTYPE_UNKNOWN,
+    DTYPE_INT,
+    DTYPE_UINT,
+    DTYPE_FLOAT,
+    DTYPE_BF16,
+    DTYPE_FP16
+};
+
+template <class T>
+inline int binary_dtype() {
+    if (std::is_floating_point<T>::value) return DTYPE_FLOAT;
+    if (std::is_integral<T>::value) return std::is_signed<T>::value ? DTYPE_INT : DTYPE_UINT;
+    return DTYPE_UNKNOWN;
+}
+
+template <>
+inline int binary_dtype<bfloat16>() {
+    return DTYPE_BF16;
+}
+
+template <>
+inline int binary_dtype<float16>() {
+    return DTYPE_FP16;
+}
+
+inline const char *binary_dtype_name(int dtype) {
+    static const char *names[] = {"unknown", "int", "uint", "float", "bf16", "fp16"};
+    return dtype > DTYPE_UNKNOWN && dtype <= DTYPE_FP16 ? names[dtype] : names[0];
+}
+
 template <class T>
 File_utils<T>::File_utils(std::string file_name) {
     this->file_name = file_name;
+    binary = false;
 }
 
 template <class T>
@@ -46,7 +97,7 @@ File_utils<T>::~File_utils() {
 template <class T>
 void File_utils<T>::parse_file() {
     std::ifstream fin;
-    fin.open(file_name, std::ios::out | std::ios::in);
+    fin.open(file_name, std::ios::in | std::ios::binary);
 
     if(!fin)
     {
@@ -54,21 +105,113 @@ void File_utils<T>::parse_file() {
         exit(1);
     }
 
-    char line[1024];
+    std::string contents;
+    fin.seekg(0, std::ios::end);
+    std::streamoff size = fin.tellg();
+    fin.seekg(0);
+    if (size > 0) {
+        contents.resize(size);
+        fin.read(&contents[0], size);
+        contents.resize(fin.gcount());
+    }
+    fin.close();
+
+    parse_buffer(contents);
+}
+
+// same as parse_file on contents already in memory, e.g. from Async_io
+template <class T>
+void File_utils<T>::parse_buffer(const std::string &contents) {
+    ALLOC_TAG("file_utils");
+    file_contents.clear();
+    binary = false;
+
+    if (contents.size() >= sizeof(BINARY_TENSOR_MAGIC) &&
+        memcmp(contents.data(), BINARY_TENSOR_MAGIC, sizeof(BINARY_TENSOR_MAGIC)) == 0) {
+        if (parse_binary_buffer(contents) != 0) {
+            std::cout << "corrupt binary file " << file_name << std::endl;
+            exit(1);
+        }
+        return;
+    }
 
-    while(fin.getline(line, sizeof(line)))
+    // rows of production-sized inputs are far longer than a fixed line buffer
+    size_t start = 0;
+    while (start < contents.size())
     {
-        if (std::string(line).compare("") != 0) {
-            file_contents.push_back(line);
+        size_t end = contents.find('\n', start);
+        if (end == std::string::npos) end = contents.size();
+        size_t length = end - start;
+        if (length > 0 && contents[start + length - 1] == '\r')
+            length--;
+        if (length > 0) {
+            file_contents.push_back(contents.substr(start, length));
         }
+        start = end + 1;
     }
+}
 
-    fin.close();
+template <class T>
+int File_utils<T>::parse_binary_buffer(const std::string &contents) {
+    size_t position = sizeof(BINARY_TENSOR_MAGIC);
+    auto read_int = [&](int &value) {
+        if (position + sizeof(int) > contents.size()) return false;
+        memcpy(&value, contents.data() + position, sizeof(int));
+        position += sizeof(int);
+        return true;
+    };
+
+    int header_count = 0;
+    if (!read_int(header_count) || header_count <= 0 || header_count > 16) return -1;
+
+    binary_header.resize(header_count);
+    for (int i = 0; i < header_count; i++)
+        if (!read_int(binary_header[i])) return -1;
+
+    int element_size = 0, dtype = DTYPE_UNKNOWN;
+    if (!read_int(element_size) || !read_int(dtype)) return -1;
+    if (element_size != (int)sizeof(T) || dtype != binary_dtype<T>()) {
+        std::cout << "binary " << binary_dtype_name(dtype) << " (" << element_size << " bytes) does not match "
+                  << binary_dtype_name(binary_dtype<T>()) << " (" << sizeof(T) << " bytes)" << std::endl;
+        return -1;
+    }
+
+    binary_contents.assign(contents.begin() + position, contents.end());
+    binary = true;
+    return 0;
+}
+
+template <class T>
+const T *File_utils<T>::binary_values() const {
+    return reinterpret_cast<const T *>(binary_contents.data());
+}
+
+template <class T>
+bool File_utils<T>::isBinary() const {
+    return binary;
 }
 
 
 template <class T>
 int File_utils<T>::get_initial_input(Array3D<T>& input, int &padding, int &step_size) {
+    if (binary) {
+        if (binary_header.size() < 5) return -1;
+        int height = binary_header[0];
+        int width = binary_header[1];
+        int channel = binary_header[2];
+        padding = binary_header[3];
+        step_size = binary_header[4];
+        if ((long long)height * width * channel * (long long)sizeof(T) > (long long)binary_contents.size()) return -1;
+
+        input.resize(height, width, channel);
+        const T *values = binary_values();
+        for (int i = 0; i < height; i++)
+            for (int j = 0; j < width; j++)
+                for (int m = 0; m < channel; m++)
+                    input[i][j][m] = *values++;
+        return 0;
+    }
+
     std::vector<std::string> parameters = split(file_contents[0], std::string(" "));
 
     int height = stoi(parameters[0]);
@@ -84,7 +227,7 @@ int File_utils<T>::get_initial_input(Array3D<T>& input, int &padding, int &step_
         std::vector<std::string> contents = split(file_contents[i], std::string(" "));
         for (int j = 0; j < width; j++) {
             for (int m = 0; m < channel; m++) {
-                input[i-1][j][m] = stoi(contents[j * channel + m]);
+                input[i-1][j][m] = parse_value<T>(contents[j * channel + m]);
             }
         }
     }
@@ -94,6 +237,25 @@ int File_utils<T>::get_initial_input(Array3D<T>& input, int &padding, int &step_
 
 template <class T>
 int File_utils<T>::get_initial_kernel(Array4D<T> &kernel) {
+    if (binary) {
+        if (binary_header.size() < 4) return -1;
+        int dimension = binary_header[0];
+        int height = binary_header[1];
+        int width = binary_header[2];
+        int channel = binary_header[3];
+        if ((long long)dimension * height * width * channel * (long long)sizeof(T) > (long long)binary_contents.size())
+            return -1;
+
+        kernel.resize(dimension, height, width, channel);
+        const T *values = binary_values();
+        for (int i = 0; i < dimension; i++)
+            for (int j = 0; j < height; j++)
+                for (int m = 0; m < width; m++)
+                    for (int n = 0; n < channel; n++)
+                        kernel[i][j][m][n] = *values++;
+        return 0;
+    }
+
     std::vector<std::string> parameters = split(file_contents[0], std::string(" "));
 
     int dimension = stoi(parameters[0]);
@@ -108,7 +270,7 @@ int File_utils<T>::get_initial_kernel(Array4D<T> &kernel) {
         for (int j = 0; j < height; j++) {
             for (int m = 0; m < width; m++) {
                 for (int n = 0; n < channel; n++) {
-                    kernel[i-1][j][m][n] = stoi(contents[j * channel * width + m * channel + n]);
+                    kernel[i-1][j][m][n] = parse_value<T>(contents[j * channel * width + m * channel + n]);
                 }
             }
         }
@@ -119,6 +281,20 @@ int File_utils<T>::get_initial_kernel(Array4D<T> &kernel) {
 
 template <class T>
 int File_utils<T>::get_stream_initial_input(Stream<T>& input, int &padding, int &step_size) {
+    if (binary) {
+        if (binary_header.size() < 5) return -1;
+        long long count = (long long)binary_header[0] * binary_header[1] * binary_header[2];
+        padding = binary_header[3];
+        step_size = binary_header[4];
+        if (count * (long long)sizeof(T) > (long long)binary_contents.size()) return -1;
+
+        input.clear();
+        const T *values = binary_values();
+        for (long long i = 0; i < count; i++)
+            input.write(values[i]);
+        return 0;
+    }
+
     std::vector<std::string> parameters = split(file_contents[0], std::string(" "));
 
     int height = stoi(parameters[0]);
@@ -130,11 +306,12 @@ int File_utils<T>::get_stream_initial_input(Stream<T>& input, int &padding, int
 
     input.clear();
 
-    for (int i = 1; i < file_contents.size(); i++) {
+    // rows past the header's height are ignored, as Stream_reader does
+    for (int i = 1; i < file_contents.size() && i <= height; i++) {
         std::vector<std::string> contents = split(file_contents[i], std::string(" "));
         for (int j = 0; j < width; j++) {
             for (int m = 0; m < channel; m++) {
-                input.write(stoi(contents[j * channel + m]));
+                input.write(parse_value<T>(contents[j * channel + m]));
             }
         }
     }
@@ -165,22 +342,14 @@ void File_utils<T>::setFile_contents(const std::vector<std::string> &file_conten
 
 template <class T>
 std::vector<std::string> File_utils<T>::split(const std::string &str, const std::string &delim) {
+    // tokens are the runs of characters not in delim, as with strtok
     std::vector<std::string> res;
-    if(str == "") return res;
-
-    char *strs = new char[str.length() + 1];
-    strcpy(strs, str.c_str());
-
-    char *d = new char[delim.length() + 1];
-    strcpy(d, delim.c_str());
-
-    char *p = strtok(strs, d);
-    while(p) {
-        std::string s = p;
-        res.push_back(s);
-        p = strtok(NULL, d);
+    size_t start = str.find_first_not_of(delim);
+    while (start != std::string::npos) {
+        size_t end = str.find_first_of(delim, start);
+        res.push_back(str.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        start = end == std::string::npos ? end : str.find_first_not_of(delim, end);
     }
-
     return res;
 }
 
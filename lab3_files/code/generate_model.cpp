@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "model_generator.h"
+
+// Synthetic model generator for scaling tests, e.g.
+//   ./generate_model ./large_model/network_large --height 224 --width 224 --layers 10 --threads 8
+// writes network_large.cfg and the per-layer initial_input/initial_kernel
+// files that main and the benchmarks read.
+
+static void usage(const char *program) {
+    std::cout << "usage: " << program << " <model_path> [--height H] [--width W] [--channels C]"
+              << " [--layers N] [--seed S] [--threads N] [--binary]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string model_path = argv[1];
+    int height = 224;
+    int width = 224;
+    int channels = 3;
+    int layers = 10;
+    unsigned long long seed = 1;
+    int threads = std::thread::hardware_concurrency();
+    bool binary = false;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--height" && has_value) height = atoi(argv[++i]);
+        else if (arg == "--width" && has_value) width = atoi(argv[++i]);
+        else if (arg == "--channels" && has_value) channels = atoi(argv[++i]);
+        else if (arg == "--layers" && has_value) layers = atoi(argv[++i]);
+        else if (arg == "--seed" && has_value) seed = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--threads" && has_value) threads = atoi(argv[++i]);
+        else if (arg == "--binary") binary = true;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (height <= 0 || width <= 0 || channels <= 0 || layers <= 0) {
+        std::cout << "model dimensions must be positive" << std::endl;
+        return 1;
+    }
+
+    Model_generator<int> generator(model_path, height, width, channels);
+    generator.default_architecture(layers);
+    if (generator.generate(seed, threads, binary) != 0)
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,1595 @@
+// the steady-state checks count heap allocations, so the tracking operator
+// new is always compiled in here
+#ifndef MLARCH_TRACK_ALLOC
+#define MLARCH_TRACK_ALLOC
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "inference_server.h"
+#include "systolic_array.h"
+#include "test.h"
+
+// Golden-output regression and differential tests.
+//   golden_test <source_dir> <work_dir>
+// Every example model is copied into work_dir, run through the batch and
+// streaming paths, and compared byte for byte with its checked-in outputs.
+// The differential part runs random shapes through every conversion path
+// and compares each one against the reference conv_convert.
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond, message)                                                   \
+    do {                                                                       \
+        checks++;                                                              \
+        if (!(cond)) {                                                         \
+            failures++;                                                        \
+            std::cout << "FAIL " << __FILE__ << ":" << __LINE__ << ": "        \
+                      << message << std::endl;                                 \
+        }                                                                      \
+    } while (0)
+
+static bool read_file(const std::string &file_name, std::string &contents) {
+    std::ifstream fin(file_name, std::ios::in | std::ios::binary);
+    if (!fin) return false;
+    std::stringstream buffer;
+    buffer << fin.rdbuf();
+    contents = buffer.str();
+    return true;
+}
+
+static bool copy_file(const std::string &from, const std::string &to) {
+    std::string contents;
+    if (!read_file(from, contents)) return false;
+    std::ofstream fout(to, std::ios::out | std::ios::binary | std::ios::trunc);
+    fout << contents;
+    return (bool)fout;
+}
+
+static void make_dirs(const std::string &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/')
+            mkdir(path.substr(0, i).c_str(), 0755);
+    }
+}
+
+// 1-based line of the first difference, 0 if equal
+static int first_difference(const std::string &a, const std::string &b) {
+    if (a == b) return 0;
+    int line = 1;
+    for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+        if (a[i] != b[i]) return line;
+        if (a[i] == '\n') line++;
+    }
+    return line;
+}
+
+static void compare_with_golden(const std::string &output, const std::string &golden) {
+    std::string actual, expected;
+    bool has_actual = read_file(output, actual);
+    bool has_expected = read_file(golden, expected);
+    CHECK(has_expected, "missing golden " << golden);
+    CHECK(has_actual, "missing output " << output);
+    if (!has_actual || !has_expected) return;
+    int line = first_difference(actual, expected);
+    CHECK(line == 0, output << " differs from " << golden << " at line " << line);
+}
+
+struct Golden_model {
+    std::string directory;
+    std::string name;
+    int layers;
+};
+
+static void run_golden_model(const std::string &source_dir, const std::string &work_dir, const Golden_model &model) {
+    std::string golden_prefix = source_dir + "/" + model.directory + "/" + model.name;
+    std::string work_prefix = work_dir + "/" + model.directory + "/" + model.name;
+    make_dirs(work_dir + "/" + model.directory);
+
+    bool copied = copy_file(golden_prefix + ".cfg", work_prefix + ".cfg");
+    for (int i = 0; i < model.layers; i++) {
+        std::string layer = ".layer_" + std::to_string(i);
+        copied = copied && copy_file(golden_prefix + layer + ".initial_input", work_prefix + layer + ".initial_input");
+        copied = copied && copy_file(golden_prefix + layer + ".initial_kernel", work_prefix + layer + ".initial_kernel");
+    }
+    CHECK(copied, "could not copy inputs of " << golden_prefix);
+    if (!copied) return;
+
+    Test<int> test(work_prefix);
+    test.initialize();
+    test.generate_parameter_file();
+    CHECK(test.getNetwork()->getLayer_number() == model.layers,
+          model.name << " parsed " << test.getNetwork()->getLayer_number() << " layers");
+    test.generate_layer_file_paths();
+    test.generate_matrix();
+    test.generate_stream();
+
+    compare_with_golden(work_prefix + ".parameter", golden_prefix + ".parameter");
+    for (int i = 0; i < model.layers; i++) {
+        std::string layer = ".layer_" + std::to_string(i);
+        compare_with_golden(work_prefix + layer + ".input_matrix", golden_prefix + layer + ".input_matrix");
+        compare_with_golden(work_prefix + layer + ".kernel_matrix", golden_prefix + layer + ".kernel_matrix");
+        compare_with_golden(work_prefix + layer + ".input_matrix.stream",
+                            golden_prefix + layer + ".input_matrix.stream");
+    }
+}
+
+// one random layer for the differential tests
+struct Conv_case {
+    int height, width, channel;
+    int filters, groups;
+    Conv_params conv;
+    Array3D<int> input;
+    Array4D<int> kernel;
+};
+
+static void setup_network(Network<int> &network, const Conv_case &c) {
+    int out_h = c.conv.output_height(c.height);
+    int out_w = c.conv.output_width(c.width);
+    network.setLayer_number(1);
+    network.setInput_height(std::vector<int>(1, c.height));
+    network.setInput_width(std::vector<int>(1, c.width));
+    network.setInput_channel(std::vector<int>(1, c.channel));
+    network.setKernel_dimension(std::vector<int>(1, c.filters));
+    network.setKernel_size(std::vector<int>(1, c.conv.size_h));
+    network.setConv_params(std::vector<Conv_params>(1, c.conv));
+    network.setKernel_channel(std::vector<int>(1, c.channel / c.groups));
+    network.setOutput_height(std::vector<int>(1, out_h));
+    network.setOutput_width(std::vector<int>(1, out_w));
+    network.setOutput_channel(std::vector<int>(1, c.filters));
+}
+
+static std::string describe(const Conv_case &c) {
+    std::stringstream s;
+    const Conv_params &p = c.conv;
+    s << c.height << "x" << c.width << "x" << c.channel << " k" << p.size_h << "x" << p.size_w << " f" << c.filters
+      << " s" << p.stride_h << "x" << p.stride_w << " d" << p.dilation_h << "x" << p.dilation_w << " p"
+      << p.pad_top << "," << p.pad_bottom << "," << p.pad_left << "," << p.pad_right << " g" << c.groups;
+    return s.str();
+}
+
+// An alternative conversion path: given the case and the reference im2col
+// result, it returns true when its own output agrees.
+struct Conversion_path {
+    const char *name;
+    std::function<bool(Network<int> &, Conv_case &, Array2D<int> &, Array2D<int> &)> matches;
+};
+
+static bool stream_matches(Network<int> &network, Conv_case &c, Array2D<int> &input_matrix, Array2D<int> &) {
+    Stream<int> input;
+    Stream<int> output;
+    for (int h = 0; h < c.height; h++)
+        for (int w = 0; w < c.width; w++)
+            for (int ch = 0; ch < c.channel; ch++)
+                input.write(c.input[h][w][ch]);
+
+    network.conv_convert_stream(0, c.conv, input, output);
+    for (int i = 0; i < input_matrix.Size_2d(); i++) {
+        for (int j = 0; j < input_matrix.Size_1d(); j++) {
+            if (output.empty() || output.read() != input_matrix[i][j]) return false;
+        }
+    }
+    return output.empty();
+}
+
+// input_matrix times kernel_matrix, filter f of group g taking group g's
+// slice of the row
+static int grouped_product(Array2D<int> &input_matrix, Array2D<int> &kernel_matrix, int groups, int row, int f) {
+    int group_depth = kernel_matrix.Size_2d();
+    int g = f / (kernel_matrix.Size_1d() / groups);
+    int sum = 0;
+    for (int k = 0; k < group_depth; k++)
+        sum += input_matrix[row][g * group_depth + k] * kernel_matrix[k][f];
+    return sum;
+}
+
+// activations equal input_matrix * kernel_matrix (the cases are linear)
+static bool direct_matches(Network<int> &network, Conv_case &c, Array2D<int> &input_matrix,
+                           Array2D<int> &kernel_matrix) {
+    Stream<int> input;
+    Stream<int> output;
+    for (int h = 0; h < c.height; h++)
+        for (int w = 0; w < c.width; w++)
+            for (int ch = 0; ch < c.channel; ch++)
+                input.write(c.input[h][w][ch]);
+
+    if (network.conv_direct_stream(0, c.conv, input, c.kernel, output) != 0) return false;
+    for (int i = 0; i < input_matrix.Size_2d(); i++) {
+        for (int f = 0; f < c.filters; f++) {
+            int expected = grouped_product(input_matrix, kernel_matrix, c.groups, i, f);
+            if (output.empty() || output.read() != expected) return false;
+        }
+    }
+    return output.empty();
+}
+
+static Thread_pool &test_pool() {
+    static Thread_pool pool(4);
+    return pool;
+}
+
+static bool threaded_matches(Network<int> &network, Conv_case &c, Array2D<int> &input_matrix,
+                             Array2D<int> &kernel_matrix) {
+    Array2D<int> threaded_input, threaded_kernel;
+    network.setThread_pool(&test_pool());
+    int status = network.conv_convert(0, c.conv, c.input, c.kernel, threaded_input, threaded_kernel);
+    network.setThread_pool(NULL);
+    if (status != 0 || threaded_input.Size_2d() != input_matrix.Size_2d()) return false;
+    for (int i = 0; i < input_matrix.Size_2d(); i++)
+        for (int j = 0; j < input_matrix.Size_1d(); j++)
+            if (threaded_input[i][j] != input_matrix[i][j]) return false;
+    return true;
+}
+
+// the cached gather plan, executed on the flat input, and im2col_rows both
+// give conv_convert's rows
+static bool plan_matches(Network<int> &, Conv_case &c, Array2D<int> &input_matrix, Array2D<int> &) {
+    Conversion_plan plan;
+    if (plan.build(Conversion_key(c.height, c.width, c.channel, c.groups, c.conv)) != 0) return false;
+    std::vector<int> input;
+    for (int h = 0; h < c.height; h++)
+        for (int w = 0; w < c.width; w++)
+            for (int ch = 0; ch < c.channel; ch++)
+                input.push_back(c.input[h][w][ch]);
+    long long rows = input_matrix.Size_2d(), depth = input_matrix.Size_1d();
+    if (plan.getRow_length() != depth || (long long)plan.getOutput_height() * plan.getOutput_width() != rows)
+        return false;
+    std::vector<int> planned(rows * depth), direct(rows * depth);
+    plan.execute(input.data(), 0, rows, planned.data());
+    im2col_rows(input.data(), c.height, c.width, c.channel, c.conv, plan.getOutput_width(), 0, rows, direct.data(),
+                c.groups);
+    for (long long i = 0; i < rows; i++)
+        for (long long j = 0; j < depth; j++)
+            if (planned[i * depth + j] != input_matrix[i][j] || direct[i * depth + j] != input_matrix[i][j])
+                return false;
+    return true;
+}
+
+static std::vector<Conversion_path> conversion_paths() {
+    std::vector<Conversion_path> paths;
+    paths.push_back({"conv_convert_stream", stream_matches});
+    paths.push_back({"threaded conv_convert", threaded_matches});
+    paths.push_back({"conv_direct_stream", direct_matches});
+    paths.push_back({"conversion plan", plan_matches});
+    return paths;
+}
+
+// independent im2col definition the reference conv_convert is checked
+// against; a grouped row holds group 0's whole window, then group 1's, ...
+static bool reference_matches(const Conv_case &c, Array2D<int> &input_matrix, Array2D<int> &kernel_matrix) {
+    const Conv_params &p = c.conv;
+    int out_h = p.output_height(c.height);
+    int out_w = p.output_width(c.width);
+    int group_channel = c.channel / c.groups;
+    int group_depth = p.size_h * p.size_w * group_channel;
+    if (input_matrix.Size_2d() != out_h * out_w || input_matrix.Size_1d() != group_depth * c.groups) return false;
+    if (kernel_matrix.Size_2d() != group_depth || kernel_matrix.Size_1d() != c.filters) return false;
+
+    for (int oh = 0; oh < out_h; oh++) {
+        for (int ow = 0; ow < out_w; ow++) {
+            for (int kh = 0; kh < p.size_h; kh++) {
+                for (int kw = 0; kw < p.size_w; kw++) {
+                    for (int ch = 0; ch < c.channel; ch++) {
+                        int h = oh * p.stride_h + kh * p.dilation_h - p.pad_top;
+                        int w = ow * p.stride_w + kw * p.dilation_w - p.pad_left;
+                        int expected = (h < 0 || h >= c.height || w < 0 || w >= c.width) ? 0 : c.input[h][w][ch];
+                        int column = ch / group_channel * group_depth + (kh * p.size_w + kw) * group_channel +
+                                     ch % group_channel;
+                        if (input_matrix[oh * out_w + ow][column] != expected)
+                            return false;
+                    }
+                }
+            }
+        }
+    }
+    for (int f = 0; f < c.filters; f++)
+        for (int kh = 0; kh < p.size_h; kh++)
+            for (int kw = 0; kw < p.size_w; kw++)
+                for (int ch = 0; ch < group_channel; ch++)
+                    if (kernel_matrix[(kh * p.size_w + kw) * group_channel + ch][f] != c.kernel[f][kh][kw][ch])
+                        return false;
+    return true;
+}
+
+static void run_differential(int cases, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<Conversion_path> paths = conversion_paths();
+
+    for (int n = 0; n < cases; n++) {
+        Conv_case c;
+        c.height = 1 + rng() % 9;
+        c.width = 1 + rng() % 9;
+        c.channel = 1 + rng() % 4;
+        c.filters = 1 + rng() % 5;
+        c.conv.size_h = c.conv.size_w = 1 + rng() % 4;
+        c.conv.stride_h = c.conv.stride_w = 1 + rng() % 3;
+        c.conv.set_padding(rng() % 3);
+        // every fourth case has its own kernel width, stride, dilation and
+        // padding per axis and side
+        if (n % 4 == 1) {
+            c.conv.size_w = 1 + rng() % 4;
+            c.conv.stride_w = 1 + rng() % 3;
+            c.conv.dilation_h = 1 + rng() % 3;
+            c.conv.dilation_w = 1 + rng() % 3;
+            c.conv.pad_bottom = rng() % 3;
+            c.conv.pad_left = rng() % 3;
+            c.conv.pad_right = rng() % 4;
+        }
+        if (c.conv.output_height(c.height) == 0 || c.conv.output_width(c.width) == 0) continue;
+        // every third case is grouped, depthwise when groups == channel
+        c.groups = 1;
+        if (n % 3 == 0) {
+            c.channel = 2 + rng() % 5;
+            do {
+                c.groups = 1 + rng() % c.channel;
+            } while (c.channel % c.groups != 0);
+            c.filters = c.groups * (1 + rng() % 2);
+        }
+
+        c.input.resize(c.height, c.width, c.channel);
+        for (int h = 0; h < c.height; h++)
+            for (int w = 0; w < c.width; w++)
+                for (int ch = 0; ch < c.channel; ch++)
+                    c.input[h][w][ch] = (int)(rng() % 19) - 9;
+        c.kernel.resize(c.filters, c.conv.size_h, c.conv.size_w, c.channel / c.groups);
+        for (int f = 0; f < c.filters; f++)
+            for (int kh = 0; kh < c.conv.size_h; kh++)
+                for (int kw = 0; kw < c.conv.size_w; kw++)
+                    for (int ch = 0; ch < c.channel / c.groups; ch++)
+                        c.kernel[f][kh][kw][ch] = (int)(rng() % 19) - 9;
+
+        Network<int> network("");
+        setup_network(network, c);
+
+        Array2D<int> input_matrix;
+        Array2D<int> kernel_matrix;
+        int status = network.conv_convert(0, c.conv, c.input, c.kernel, input_matrix, kernel_matrix);
+        CHECK(status == 0, "conv_convert failed for " << describe(c));
+        if (status != 0) continue;
+        CHECK(reference_matches(c, input_matrix, kernel_matrix), "conv_convert is wrong for " << describe(c));
+
+        for (Conversion_path &path : paths)
+            CHECK(path.matches(network, c, input_matrix, kernel_matrix),
+                  path.name << " disagrees with conv_convert for " << describe(c));
+    }
+}
+
+// no two tensors that are live at the same step may share arena bytes
+static bool plan_is_valid(const Memory_plan &plan) {
+    const std::vector<Planned_tensor> &tensors = plan.getTensors();
+    for (size_t i = 0; i < tensors.size(); i++) {
+        if (tensors[i].offset + tensors[i].bytes > plan.getArena_size()) return false;
+        for (size_t j = i + 1; j < tensors.size(); j++) {
+            const Planned_tensor &a = tensors[i], &b = tensors[j];
+            bool live_together = a.first_use <= b.last_use && b.first_use <= a.last_use;
+            bool share_bytes = a.offset < b.offset + b.bytes && b.offset < a.offset + a.bytes;
+            if (live_together && share_bytes && a.bytes > 0 && b.bytes > 0) return false;
+        }
+    }
+    return true;
+}
+
+// layer-by-layer forward built only from conv_convert and Array*D, for
+// checking Network::forward on conv/maxpool chains
+static void reference_forward(Network<int> &network, Array3D<int> &input, std::vector<Array4D<int> > &kernels,
+                              Array3D<int> &output) {
+    Array3D<int> current(input);
+    int conv_id = 0;
+    for (const Layer_desc &layer : network.getLayers()) {
+        Array3D<int> next(layer.output_height, layer.output_width, layer.output_channel);
+        if (layer.type == LAYER_CONVOLUTIONAL) {
+            Array2D<int> input_matrix, kernel_matrix;
+            network.conv_convert(conv_id, layer.conv, current, kernels[conv_id], input_matrix, kernel_matrix);
+            for (int p = 0; p < input_matrix.Size_2d(); p++) {
+                for (int f = 0; f < layer.filters; f++) {
+                    int sum = grouped_product(input_matrix, kernel_matrix, layer.groups, p, f);
+                    if (layer.activation == "leaky" && sum < 0) sum = (int)(sum * 0.1);
+                    next[p / layer.output_width][p % layer.output_width][f] = sum;
+                }
+            }
+            conv_id++;
+        } else {
+            for (int h = 0; h < layer.output_height; h++)
+                for (int w = 0; w < layer.output_width; w++)
+                    for (int c = 0; c < layer.output_channel; c++) {
+                        int best = current[h * layer.stride][w * layer.stride][c];
+                        for (int kh = 0; kh < layer.size; kh++)
+                            for (int kw = 0; kw < layer.size; kw++)
+                                best = std::max(best, current[h * layer.stride + kh][w * layer.stride + kw][c]);
+                        next[h][w][c] = best;
+                    }
+        }
+        current = next;
+    }
+    output = current;
+}
+
+// values in [-3, 3] for every conv layer of a parsed network
+static std::vector<Array4D<int> > random_kernels(Network<int> &network, std::mt19937 &rng) {
+    std::vector<Array4D<int> > kernels(network.getLayer_number());
+    for (int i = 0; i < network.getLayer_number(); i++) {
+        const Conv_params &conv = network.getConv_params()[i];
+        kernels[i].resize(network.getKernel_dimension()[i], conv.size_h, conv.size_w, network.getKernel_channel()[i]);
+        for (int f = 0; f < kernels[i].Size_4d(); f++)
+            for (int kh = 0; kh < conv.size_h; kh++)
+                for (int kw = 0; kw < conv.size_w; kw++)
+                    for (int c = 0; c < kernels[i].Size_1d(); c++)
+                        kernels[i][f][kh][kw][c] = (int)(rng() % 7) - 3;
+    }
+    return kernels;
+}
+
+template <class T>
+static bool same_tensor(Array3D<T> &a, Array3D<T> &b) {
+    if (a.Size_3d() != b.Size_3d() || a.Size_2d() != b.Size_2d() || a.Size_1d() != b.Size_1d()) return false;
+    for (int h = 0; h < a.Size_3d(); h++)
+        for (int w = 0; w < a.Size_2d(); w++)
+            for (int c = 0; c < a.Size_1d(); c++)
+                if (a[h][w][c] != b[h][w][c]) return false;
+    return true;
+}
+
+static void run_forward_checks(const std::string &source_dir, const Golden_model &model) {
+    std::string prefix = source_dir + "/" + model.directory + "/" + model.name;
+    Network<int> network(prefix + ".cfg");
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << prefix << ".cfg");
+
+    const Memory_plan &plan = network.getMemory_plan();
+    CHECK(plan_is_valid(plan), model.name << " memory plan has overlapping live tensors\n" << plan.describe());
+    CHECK(plan.getArena_size() <= plan.getUnshared_size() + 64, model.name << " arena is larger than no reuse");
+
+    std::vector<Array4D<int> > kernels(model.layers);
+    for (int i = 0; i < model.layers; i++) {
+        File_utils<int> kernel_util(prefix + ".layer_" + std::to_string(i) + ".initial_kernel");
+        kernel_util.parse_file();
+        kernel_util.get_initial_kernel(kernels[i]);
+    }
+    File_utils<int> input_util(prefix + ".layer_0.initial_input");
+    input_util.parse_file();
+    Array3D<int> input;
+    int padding, step_size;
+    input_util.get_initial_input(input, padding, step_size);
+
+    Array3D<int> output, expected;
+    CHECK(network.load_weights(kernels) == 0, model.name << " load_weights failed");
+    CHECK(network.forward(input, output) == 0, model.name << " forward failed");
+    reference_forward(network, input, kernels, expected);
+
+    bool same = output.Size_3d() == expected.Size_3d() && output.Size_2d() == expected.Size_2d() &&
+                output.Size_1d() == expected.Size_1d();
+    for (int h = 0; same && h < output.Size_3d(); h++)
+        for (int w = 0; w < output.Size_2d(); w++)
+            for (int c = 0; c < output.Size_1d(); c++)
+                same = same && output[h][w][c] == expected[h][w][c];
+    CHECK(same, model.name << " forward disagrees with the conv_convert reference");
+
+    // a second run reuses the arena and must give the same answer
+    Array3D<int> again;
+    network.forward(input, again);
+    bool repeatable = again.Size_3d() == output.Size_3d();
+    for (int h = 0; repeatable && h < output.Size_3d(); h++)
+        for (int w = 0; w < output.Size_2d(); w++)
+            for (int c = 0; c < output.Size_1d(); c++)
+                repeatable = repeatable && again[h][w][c] == output[h][w][c];
+    CHECK(repeatable, model.name << " second forward differs");
+
+    Array3D<int> fused;
+    CHECK(network.forward_fused(input, fused) == 0, model.name << " forward_fused failed");
+    CHECK(same_tensor(fused, output), model.name << " forward_fused disagrees with forward");
+
+    Array3D<int> threaded;
+    network.setThread_pool(&test_pool());
+    CHECK(network.forward(input, threaded) == 0, model.name << " threaded forward failed");
+    network.setThread_pool(NULL);
+    CHECK(same_tensor(threaded, output), model.name << " threaded forward disagrees with forward");
+
+    // the same weights through the CSR kernels
+    Array3D<int> sparse;
+    network.setSparse_mode(SPARSE_ON);
+    network.load_weights(kernels);
+    CHECK(network.isSparse_layer(0) && network.forward(input, sparse) == 0 && same_tensor(sparse, output),
+          model.name << " sparse forward disagrees with forward");
+    network.setSparse_mode(SPARSE_AUTO);
+
+    // pruned to about 10% nonzeros, auto mode goes sparse and still agrees
+    // with the reference, serially, fused and threaded
+    std::mt19937 rng(7);
+    for (Array4D<int> &kernel : kernels)
+        for (int f = 0; f < kernel.Size_4d(); f++)
+            for (int h = 0; h < kernel.Size_3d(); h++)
+                for (int w = 0; w < kernel.Size_2d(); w++)
+                    for (int c = 0; c < kernel.Size_1d(); c++)
+                        if (rng() % 10 != 0) kernel[f][h][w][c] = 0;
+    network.load_weights(kernels);
+    bool all_sparse = true;
+    for (int i = 0; i < model.layers; i++)
+        all_sparse = all_sparse && network.isSparse_layer(i);
+    CHECK(all_sparse, model.name << " auto mode kept a pruned layer dense");
+
+    Array3D<int> pruned, pruned_fused, pruned_threaded, pruned_expected;
+    network.forward(input, pruned);
+    network.forward_fused(input, pruned_fused);
+    network.setThread_pool(&test_pool());
+    network.forward(input, pruned_threaded);
+    network.setThread_pool(NULL);
+    reference_forward(network, input, kernels, pruned_expected);
+    CHECK(same_tensor(pruned, pruned_expected) && same_tensor(pruned_fused, pruned_expected) &&
+          same_tensor(pruned_threaded, pruned_expected), model.name << " pruned sparse forward is wrong");
+}
+
+// largest |a - b| relative to the largest |expected|
+template <class T>
+static double relative_error(Array3D<T> &a, Array3D<int> &expected) {
+    if (a.Size_3d() != expected.Size_3d() || a.Size_2d() != expected.Size_2d() || a.Size_1d() != expected.Size_1d())
+        return 1e30;
+    double error = 0, scale = 1;
+    for (int h = 0; h < a.Size_3d(); h++)
+        for (int w = 0; w < a.Size_2d(); w++)
+            for (int c = 0; c < a.Size_1d(); c++) {
+                error = std::max(error, std::fabs((double)(float)a[h][w][c] - expected[h][w][c]));
+                scale = std::max(scale, std::fabs((double)expected[h][w][c]));
+            }
+    return error / scale;
+}
+
+// the model's files parsed straight into T and run end to end; the int
+// forward is the reference. fp16 tops out at 65504, so it only runs on
+// models whose activations stay below that
+template <class T>
+static Array3D<T> typed_forward(const std::string &prefix, const Golden_model &model, bool fused) {
+    Network<T> network(prefix + ".cfg");
+    network.obtain_parameters();
+    std::vector<Array4D<T> > kernels(model.layers);
+    for (int i = 0; i < model.layers; i++) {
+        File_utils<T> kernel_util(prefix + ".layer_" + std::to_string(i) + ".initial_kernel");
+        kernel_util.parse_file();
+        kernel_util.get_initial_kernel(kernels[i]);
+    }
+    File_utils<T> input_util(prefix + ".layer_0.initial_input");
+    input_util.parse_file();
+    Array3D<T> input, output;
+    int padding, step_size;
+    input_util.get_initial_input(input, padding, step_size);
+    network.load_weights(kernels);
+    if (fused)
+        network.forward_fused(input, output);
+    else
+        network.forward(input, output);
+    return output;
+}
+
+static void run_precision_checks(const std::string &source_dir, const Golden_model &model) {
+    std::string prefix = source_dir + "/" + model.directory + "/" + model.name;
+    Array3D<int> expected = typed_forward<int>(prefix, model, false);
+    double largest = 0;
+    for (int h = 0; h < expected.Size_3d(); h++)
+        for (int w = 0; w < expected.Size_2d(); w++)
+            for (int c = 0; c < expected.Size_1d(); c++)
+                largest = std::max(largest, std::fabs((double)expected[h][w][c]));
+
+    Array3D<float> as_float = typed_forward<float>(prefix, model, false);
+    CHECK(relative_error(as_float, expected) < 1e-6, model.name << " float forward error "
+          << relative_error(as_float, expected));
+
+    Array3D<bfloat16> as_bf16 = typed_forward<bfloat16>(prefix, model, false);
+    Array3D<bfloat16> as_bf16_fused = typed_forward<bfloat16>(prefix, model, true);
+    CHECK(relative_error(as_bf16, expected) < 0.03, model.name << " bf16 forward error "
+          << relative_error(as_bf16, expected));
+    CHECK(same_tensor(as_bf16, as_bf16_fused), model.name << " bf16 forward_fused disagrees with forward");
+
+    if (largest < 32768) {
+        Array3D<float16> as_fp16 = typed_forward<float16>(prefix, model, false);
+        CHECK(relative_error(as_fp16, expected) < 0.005, model.name << " fp16 forward error "
+              << relative_error(as_fp16, expected));
+    }
+}
+
+// the portable conversions against known encodings and against the
+// F16C / AVX-512 BF16 instructions the types use when compiled in
+static void run_numeric_type_checks(const std::string &work_dir) {
+    CHECK(float_to_half_bits(1.0f) == 0x3c00 && float_to_half_bits(-2.0f) == 0xc000 &&
+          float_to_half_bits(65504.0f) == 0x7bff && float_to_half_bits(65520.0f) == 0x7c00 &&
+          float_to_half_bits(std::ldexp(1.0f, -24)) == 0x0001 && float_to_half_bits(std::ldexp(1.0f, -25)) == 0 &&
+          float_to_half_bits(1.0f + std::ldexp(1.0f, -11)) == 0x3c00 &&
+          float_to_half_bits(1.0f + 3 * std::ldexp(1.0f, -11)) == 0x3c02, "fp16 encodings");
+    CHECK(float_to_bfloat16_bits(1.0f) == 0x3f80 && float_to_bfloat16_bits(1.0f + std::ldexp(1.0f, -8)) == 0x3f80 &&
+          float_to_bfloat16_bits(1.0f + 3 * std::ldexp(1.0f, -8)) == 0x3f82 &&
+          float_to_bfloat16_bits(-0.0f) == 0x8000, "bf16 encodings");
+
+    bool decode = true;
+    for (uint32_t bits = 0; bits < 0x10000; bits++) {
+        float soft = half_bits_to_float(bits), used = float16::to_float(bits);
+        decode = decode && (float_to_bits(soft) == float_to_bits(used) || (soft != soft && used != used));
+        // every fp16 value survives a round trip
+        if (soft == soft) decode = decode && float_to_half_bits(soft) == bits;
+    }
+    CHECK(decode, "fp16 decoding differs from the conversion in use");
+
+    std::mt19937 rng(41);
+    bool encode = true;
+    for (int i = 0; i < 200000; i++) {
+        float value = bits_to_float(rng());
+        if (value != value) continue;
+        float small = std::ldexp(value, -std::ilogb(value == 0 ? 1 : value) + (int)(rng() % 40) - 26);
+        encode = encode && float16::from_float(small) == float_to_half_bits(small) &&
+                 bfloat16::from_float(value) == float_to_bfloat16_bits(value);
+    }
+    CHECK(encode, "fp16/bf16 encoding differs from the conversion in use");
+
+    CHECK(parse_value<int>("12abc") == 12 && parse_value<int>("-7") == -7 && parse_value<int>("x") == 0 &&
+          parse_value<float>("1.5e2") == 150.0f && (float)parse_value<bfloat16>("-3.25") == -3.25f &&
+          (float)parse_value<float16>("0.5") == 0.5f, "parse_value");
+
+    // the streaming reader parses the same values as File_utils for float types
+    std::string path = work_dir + "/reader_float.txt";
+    std::ofstream(path) << "2 2 1 0 1\n1.5 -2.25\n3e-2 4\n";
+    File_utils<bfloat16> file(path);
+    file.parse_file();
+    Stream<bfloat16> expected;
+    int padding, step_size;
+    file.get_stream_initial_input(expected, padding, step_size);
+    Stream_reader<bfloat16> reader(path);
+    Stream<bfloat16> streamed;
+    reader.open(padding, step_size);
+    reader.read_into(streamed);
+    bool same = true;
+    while (!expected.empty())
+        same = same && !streamed.empty() && expected.read().bits == streamed.read().bits;
+    CHECK(same && streamed.empty(), "bf16 stream reader differs from get_stream_initial_input");
+}
+
+// forward_fused against forward on a chain that mixes padding, strides larger
+// than the window, a padded maxpool and a route that splits the fused runs
+static void run_fused_checks(const std::string &work_dir) {
+    std::string cfg = work_dir + "/fused.cfg";
+    std::ofstream file(cfg.c_str());
+    file << "[net]\nheight=19\nwidth=17\nchannels=3\n"
+            "[convolutional]\nfilters=5\nsize=3\nstride=1\npad=1\nactivation=leaky\n"
+            "[convolutional]\nfilters=4\nsize=1\nstride=1\nactivation=relu\n"
+            "[maxpool]\nsize=3\nstride=1\npadding=2\n"
+            "[convolutional]\nfilters=6\nsize=2\nstride=3\nactivation=linear\n"
+            "[route]\nlayers=-1\n"
+            "[convolutional]\nfilters=3\nsize=3\nstride=2\npad=1\nactivation=leaky\n"
+            "[maxpool]\nsize=2\nstride=2\n"
+            "[convolutional]\nfilters=2\nsize=1\nstride=1\nactivation=linear\n";
+    file.close();
+
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+
+    std::mt19937 rng(7);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    Array3D<int> input(19, 17, 3);
+    for (int h = 0; h < 19; h++)
+        for (int w = 0; w < 17; w++)
+            for (int c = 0; c < 3; c++)
+                input[h][w][c] = (int)(rng() % 11) - 5;
+
+    Array3D<int> output, fused;
+    CHECK(network.load_weights(kernels) == 0, "fused.cfg load_weights failed");
+    CHECK(network.forward(input, output) == 0, "fused.cfg forward failed");
+    CHECK(network.forward_fused(input, fused) == 0, "fused.cfg forward_fused failed");
+    CHECK(same_tensor(fused, output), "forward_fused disagrees with forward on fused.cfg");
+
+    Array3D<int> threaded;
+    network.setThread_pool(&test_pool());
+    CHECK(network.forward(input, threaded) == 0, "fused.cfg threaded forward failed");
+    network.setThread_pool(NULL);
+    CHECK(same_tensor(threaded, output), "threaded forward disagrees with forward on fused.cfg");
+}
+
+// forward, forward_fused, threaded forward and forward_batch all agree with
+// reference_forward on random kernels and inputs
+static void check_forward_paths(Network<int> &network, const std::string &name, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    const Layer_desc &first = network.getLayers()[0];
+    Array3D<int> input(first.input_height, first.input_width, first.input_channel);
+    for (int h = 0; h < first.input_height; h++)
+        for (int w = 0; w < first.input_width; w++)
+            for (int c = 0; c < first.input_channel; c++)
+                input[h][w][c] = (int)(rng() % 11) - 5;
+
+    Array3D<int> expected, output, fused, threaded;
+    reference_forward(network, input, kernels, expected);
+    CHECK(plan_is_valid(network.getMemory_plan()), name << " memory plan overlaps");
+    CHECK(network.load_weights(kernels) == 0, name << " load_weights failed");
+    CHECK(network.forward(input, output) == 0, name << " forward failed");
+    CHECK(same_tensor(output, expected), "forward disagrees with the reference on " << name);
+    CHECK(network.forward_fused(input, fused) == 0, name << " forward_fused failed");
+    CHECK(same_tensor(fused, expected), "forward_fused disagrees with the reference on " << name);
+    network.setThread_pool(&test_pool());
+    CHECK(network.forward(input, threaded) == 0, name << " threaded forward failed");
+    CHECK(same_tensor(threaded, expected), "threaded forward disagrees with the reference on " << name);
+
+    const int images = 3;
+    long long input_size = network.getNet_input_size(), output_size = network.getNet_output_size();
+    std::vector<int> inputs(images * input_size), batched(images * output_size), single(output_size);
+    for (int &value : inputs) value = (int)(rng() % 11) - 5;
+    CHECK(network.forward_batch(inputs.data(), batched.data(), images) == 0, name << " forward_batch failed");
+    network.setThread_pool(NULL);
+    for (int b = 0; b < images; b++) {
+        network.forward(inputs.data() + b * input_size, single.data());
+        CHECK(std::equal(single.begin(), single.end(), batched.begin() + b * output_size),
+              name << " forward_batch disagrees with forward on image " << b);
+    }
+}
+
+// grouped and depthwise layers, with a channel multiplier and with stride
+static void run_grouped_checks(const std::string &work_dir) {
+    std::string cfg = work_dir + "/grouped.cfg";
+    std::ofstream file(cfg.c_str());
+    file << "[net]\nheight=13\nwidth=11\nchannels=4\n"
+            "[convolutional]\nfilters=6\nsize=3\nstride=1\npad=1\ngroups=2\nactivation=leaky\n"
+            "[convolutional]\nfilters=12\nsize=3\nstride=1\npad=1\ngroups=6\nactivation=leaky\n"
+            "[maxpool]\nsize=2\nstride=1\n"
+            "[convolutional]\nfilters=12\nsize=3\nstride=2\npad=1\ngroups=12\nactivation=linear\n"
+            "[convolutional]\nfilters=5\nsize=1\nstride=1\nactivation=leaky\n";
+    file.close();
+
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+    CHECK(!network.isDepthwise_layer(0) && network.isDepthwise_layer(1) && network.isDepthwise_layer(2) &&
+          !network.isDepthwise_layer(3), "grouped.cfg depthwise layers misclassified");
+    check_forward_paths(network, "grouped.cfg", 44);
+}
+
+// non-square kernels, per-axis stride and dilation, per-side padding, and
+// pad=1 widened to the dilated window, on dense, grouped and depthwise layers, and a
+// depthwise kernel taller than run_depthwise keeps on the stack
+static void run_geometry_checks(const std::string &work_dir) {
+    std::string cfg = work_dir + "/geometry.cfg";
+    std::ofstream file(cfg.c_str());
+    file << "[net]\nheight=14\nwidth=12\nchannels=3\n"
+            "[convolutional]\nfilters=4\nsize_y=3\nsize_x=5\nstride_x=2\npadding_top=1\npadding_left=2\n"
+            "padding_right=1\nactivation=leaky\n"
+            "[convolutional]\nfilters=6\nsize=3\ndilation=2\npad=1\nactivation=leaky\n"
+            "[maxpool]\nsize=2\nstride=1\n"
+            "[convolutional]\nfilters=6\nsize=3\ndilation_y=2\nstride_x=2\npad=1\ngroups=6\nactivation=linear\n"
+            "[convolutional]\nfilters=3\nsize_y=1\nsize_x=3\npadding_left=1\ngroups=3\nactivation=leaky\n"
+            "[convolutional]\nfilters=3\nsize_y=19\nsize_x=1\npad=1\ngroups=3\nactivation=linear\n";
+    file.close();
+
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() != 5) return;
+    const std::vector<Conv_params> &convs = network.getConv_params();
+    CHECK(convs[0].size_h == 3 && convs[0].size_w == 5 && convs[0].stride_w == 2 && convs[0].pad_bottom == 0 &&
+          network.getOutput_height()[0] == 13 && network.getOutput_width()[0] == 6,
+          "geometry.cfg layer 0 parsed wrong");
+    CHECK(convs[1].pad_top == 2 && convs[1].pad_right == 2 && network.getOutput_height()[1] == 13,
+          "pad=1 ignores dilation");
+    CHECK(convs[2].pad_top == 2 && convs[2].pad_left == 1 && network.isDepthwise_layer(2),
+          "geometry.cfg layer 3 parsed wrong");
+    check_forward_paths(network, "geometry.cfg", 45);
+}
+
+// plans are shared by equal shapes and reused by later forwards and
+// conv_convert calls
+static void run_conversion_plan_checks(const std::string &work_dir) {
+    std::string cfg = work_dir + "/plans.cfg";
+    std::ofstream file(cfg.c_str());
+    file << "[net]\nheight=10\nwidth=9\nchannels=3\n"
+            "[convolutional]\nfilters=3\nsize=3\nstride=1\npad=1\nactivation=leaky\n"
+            "[convolutional]\nfilters=3\nsize=3\nstride=1\npad=1\nactivation=leaky\n"
+            "[convolutional]\nfilters=4\nsize=1\nstride=1\nactivation=linear\n";
+    file.close();
+
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() != 3) return;
+    std::mt19937 rng(46);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    Array3D<int> input(10, 9, 3), output;
+    for (int h = 0; h < 10; h++)
+        for (int w = 0; w < 9; w++)
+            for (int c = 0; c < 3; c++)
+                input[h][w][c] = (int)(rng() % 11) - 5;
+
+    CHECK(network.load_weights(kernels) == 0 && network.forward(input, output) == 0, "plans.cfg forward failed");
+    CHECK(network.getConversion_cache().size() == 2, "equal conv shapes do not share a plan: "
+                                                         << network.getConversion_cache().size() << " plans");
+    network.forward(input, output);
+    Array2D<int> input_matrix, kernel_matrix;
+    network.conv_convert(0, 1, 1, input, kernels[0], input_matrix, kernel_matrix);
+    CHECK(network.getConversion_cache().size() == 2, "conv_convert rebuilt a cached plan");
+}
+
+// the node lists split the allowed CPUs, a pinned pool reports nodes its
+// workers can be on, and its forward (with per-node weight copies when it
+// spans several nodes) matches an unpinned one
+static void run_numa_checks(const std::string &work_dir) {
+    std::vector<std::vector<int> > nodes = numa_nodes();
+    std::vector<int> flat;
+    for (const std::vector<int> &cpus : nodes)
+        flat.insert(flat.end(), cpus.begin(), cpus.end());
+    std::vector<int> sorted = flat;
+    std::sort(sorted.begin(), sorted.end());
+    CHECK(!nodes.empty() && flat == cpus_by_node() &&
+          std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end(),
+          "numa_nodes does not split the allowed CPUs");
+
+    int cpu = -1;
+    run_on_cpus(nodes[0], [&] { cpu = sched_getcpu(); });
+    CHECK(std::find(nodes[0].begin(), nodes[0].end(), cpu) != nodes[0].end(),
+          "run_on_cpus ran on CPU " << cpu << ", outside node 0");
+
+    Thread_pool pinned(4, true);
+    std::atomic<int> bad_nodes(0);
+    pinned.parallel_for(0, 64, 1, [&](long long, long long) {
+        int node = pinned.current_node();
+        if (node < 0 || node >= pinned.getNodes()) bad_nodes++;
+    });
+    CHECK(pinned.getNodes() >= 1 && pinned.getNodes() <= (int)nodes.size() && bad_nodes == 0,
+          "pinned pool reports " << pinned.getNodes() << " nodes, " << bad_nodes << " bad current_node");
+
+    std::string cfg = work_dir + "/fused.cfg";
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+    std::mt19937 rng(48);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    Array3D<int> input(19, 17, 3), output, placed;
+    for (int h = 0; h < 19; h++)
+        for (int w = 0; w < 17; w++)
+            for (int c = 0; c < 3; c++)
+                input[h][w][c] = (int)(rng() % 11) - 5;
+    CHECK(network.load_weights(kernels) == 0 && network.forward(input, output) == 0, "fused.cfg forward failed");
+    CHECK(network.getKernel_replicas() == 0, "weights replicated without a pool");
+
+    Network<int> numa(cfg);
+    numa.obtain_parameters();
+    numa.setThread_pool(&pinned);
+    CHECK(numa.load_weights(kernels) == 0 && numa.forward(input, placed) == 0, "pinned forward failed");
+    int expected = pinned.getNodes() > 1 ? pinned.getNodes() : 0;
+    CHECK(numa.getKernel_replicas() == expected,
+          numa.getKernel_replicas() << " weight copies on a " << pinned.getNodes() << "-node pool");
+    CHECK(same_tensor(placed, output), "pinned forward disagrees with forward");
+    numa.setThread_pool(NULL);
+    CHECK(numa.getKernel_replicas() == 0, "weight copies kept after the pool was removed");
+}
+
+// every huge page mode gives writable 2 MB aligned memory, falling back as
+// far as plain pages; arenas on huge pages and a forward whose arena is on
+// them give the same results; an event the machine cannot count reads -1
+static void run_huge_page_checks(const std::string &work_dir) {
+    CHECK(parse_huge_page_mode("thp") == HUGE_PAGES_TRANSPARENT && parse_huge_page_mode("explicit") ==
+              HUGE_PAGES_EXPLICIT && parse_huge_page_mode("yes") == HUGE_PAGES_OFF, "huge page mode parsing");
+    for (Huge_page_mode mode : {HUGE_PAGES_OFF, HUGE_PAGES_TRANSPARENT, HUGE_PAGES_EXPLICIT}) {
+        Huge_page_mode backing = HUGE_PAGES_EXPLICIT;
+        size_t bytes = HUGE_PAGE_SIZE + 12345;
+        char *p = static_cast<char *>(huge_page_alloc(bytes, mode, &backing));
+        memset(p, 7, huge_page_round(bytes));
+        CHECK(reinterpret_cast<uintptr_t>(p) % HUGE_PAGE_SIZE == 0 && p[bytes - 1] == 7 && backing <= mode,
+              huge_page_mode_name(mode) << " block is not an aligned, writable mapping");
+        huge_page_free(p, bytes);
+    }
+
+    Arena_allocator arena(1 << 20, HUGE_PAGES_TRANSPARENT);
+    std::vector<int *> blocks;
+    for (int i = 0; i < 40; i++) {
+        int *block = static_cast<int *>(arena.allocate(100000 * sizeof(int), alignof(int)));
+        block[0] = i;
+        block[99999] = i;
+        blocks.push_back(block);
+    }
+    bool intact = arena.getBytes_reserved() % HUGE_PAGE_SIZE == 0;
+    for (int i = 0; i < 40; i++)
+        intact = intact && blocks[i][0] == i && blocks[i][99999] == i;
+    CHECK(intact, "huge page arena chunks overlap or are not whole pages");
+    arena.reset();
+
+    std::string cfg = work_dir + "/fused.cfg";
+    Network<int> network(cfg), huge(cfg);
+    CHECK(network.obtain_parameters() == 0 && huge.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+    std::mt19937 rng(49);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    Array3D<int> input(19, 17, 3), output, huge_output, huge_batch;
+    for (int h = 0; h < 19; h++)
+        for (int w = 0; w < 17; w++)
+            for (int c = 0; c < 3; c++)
+                input[h][w][c] = (int)(rng() % 11) - 5;
+    CHECK(network.load_weights(kernels) == 0 && network.forward(input, output) == 0, "fused.cfg forward failed");
+    huge.setHuge_pages(HUGE_PAGES_EXPLICIT);
+    CHECK(huge.load_weights(kernels) == 0 && huge.forward(input, huge_output) == 0 &&
+          same_tensor(huge_output, output), "forward on a huge page arena disagrees with forward");
+    CHECK(huge.getArena_backing() <= HUGE_PAGES_EXPLICIT, "arena backing out of range");
+    // a larger batch replans and maps a new arena
+    std::vector<int> images(2 * network.getNet_input_size()), results(2 * network.getNet_output_size());
+    std::vector<int> single(network.getNet_output_size());
+    for (int &value : images)
+        value = (int)(rng() % 11) - 5;
+    CHECK(huge.forward_batch(images.data(), results.data(), 2) == 0 &&
+          network.forward(images.data() + network.getNet_input_size(), single.data()) == 0 &&
+          std::equal(single.begin(), single.end(), results.begin() + network.getNet_output_size()),
+          "forward_batch on a huge page arena disagrees with forward");
+    huge.setHuge_pages(HUGE_PAGES_OFF);
+    CHECK(huge.forward(input, huge_output) == 0 && same_tensor(huge_output, output),
+          "forward after leaving huge pages disagrees with forward");
+}
+
+// heap allocations made by body, over every thread
+template <class Body>
+static long long allocations_during(Body body) {
+    long long before = Alloc_tracker::instance().getAllocations();
+    body();
+    return Alloc_tracker::instance().getAllocations() - before;
+}
+
+// blocks allocated under phase and not yet freed
+static long long live_blocks(const char *phase) {
+    long long live = 0;
+    for (const Alloc_record &record : Alloc_tracker::instance().records())
+        if (strcmp(record.phase, phase) == 0) live += record.live_count;
+    return live;
+}
+
+// hardware counters degrade to -1 per event, and the profiler only shows
+// the events it was given
+static void run_perf_counter_checks() {
+    Perf_counter bogus(PERF_TYPE_HARDWARE, ~0ULL);
+    CHECK(!bogus.isAvailable() && bogus.read() == -1, "an invalid perf event did not degrade to -1");
+
+    const Perf_counter_set &counters = perf_counters();
+    Perf_sample start = counters.read();
+    volatile long long sink = 0;
+    for (int i = 0; i < 1000000; i++)
+        sink += i;
+    Perf_sample delta = perf_delta(start, counters.read());
+    bool any = false;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        CHECK(counters.isAvailable(i) == (start.values[i] >= 0), std::string(perf_event_name(i)) +
+              " availability and read disagree");
+        CHECK(counters.isAvailable(i) ? delta.values[i] >= 0 : delta.values[i] == -1,
+              std::string(perf_event_name(i)) + " delta is wrong");
+        any = any || counters.isAvailable(i);
+    }
+    CHECK(counters.isAvailable() == any, "counter set availability disagrees with its events");
+    if (counters.isAvailable(PERF_INSTRUCTIONS))
+        CHECK(delta.values[PERF_INSTRUCTIONS] >= 1000000, "a million-iteration loop retired too few instructions");
+
+    // software events exist even without a PMU, so the wrapper itself is exercised
+    Perf_counter task_clock(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+    if (task_clock.isAvailable()) {
+        long long before = task_clock.read();
+        for (int i = 0; i < 1000000; i++)
+            sink += i;
+        CHECK(task_clock.read() > before, "task clock did not advance over a busy loop");
+    }
+
+    Profiler &profiler = Profiler::instance();
+    profiler.reset();
+    profiler.add_time("plain", 0.001);
+    CHECK(profiler.report_table().find("cycles") == std::string::npos,
+          "profile table has event columns without any events");
+    Perf_sample partial;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        partial.values[i] = -1;
+    partial.values[PERF_CYCLES] = 200;
+    partial.values[PERF_INSTRUCTIONS] = 100;
+    profiler.add_time("counted", 0.001, &partial);
+    std::string table = profiler.report_table(), json = profiler.report_json();
+    CHECK(table.find("cycles") != std::string::npos && table.find("0.50") != std::string::npos,
+          "profile table lacks the recorded events");
+    CHECK(json.find("\"cycles\": 200") != std::string::npos && json.find("llc_misses") == std::string::npos,
+          "profile json has the wrong events");
+
+    // a stage timer reads its events and records them under a name longer
+    // than any small-string buffer without touching the heap
+    const char *stage = "a_stage_name_past_the_small_string_buffer";
+    { Scoped_timer warm_up(stage); }
+    long long count = allocations_during([&] { Scoped_timer timer(stage); });
+    CHECK(count == 0, "a scoped stage made " << count << " allocations");
+    profiler.reset();
+}
+
+// once warmed up, inference runs without touching the heap: every path of
+// forward, a threaded batch and the server's infer. The file pipeline of
+// Test frees everything it allocates.
+static void run_allocation_checks(const std::string &work_dir, const Golden_model &model) {
+    ALLOC_PHASE("allocation_checks");
+    std::string cfg = work_dir + "/fused.cfg";
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+    std::mt19937 rng(47);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    CHECK(network.load_weights(kernels) == 0, "fused.cfg load_weights failed");
+
+    const int batch = 3;
+    std::vector<int> input(batch * network.getNet_input_size()), output(batch * network.getNet_output_size());
+    for (int &value : input)
+        value = (int)(rng() % 11) - 5;
+    Array3D<int> image(19, 17, 3), result;
+    for (int h = 0; h < 19; h++)
+        for (int w = 0; w < 17; w++)
+            for (int c = 0; c < 3; c++)
+                image[h][w][c] = input[(h * 17 + w) * 3 + c];
+
+    struct Path {
+        const char *name;
+        std::function<int()> run;
+    };
+    std::vector<Path> paths = {
+        {"forward", [&] { return network.forward(input.data(), output.data()); }},
+        {"fused forward", [&] { return network.forward(input.data(), output.data(), true); }},
+        {"forward_batch", [&] { return network.forward_batch(input.data(), output.data(), batch); }},
+        {"Array3D forward", [&] { return network.forward(image, result); }},
+    };
+    for (int threaded = 0; threaded < 2; threaded++) {
+        network.setThread_pool(threaded ? &test_pool() : NULL);
+        for (const Path &path : paths) {
+            CHECK(path.run() == 0, path.name << " failed");
+            long long count = allocations_during([&] {
+                for (int i = 0; i < 3; i++)
+                    path.run();
+            });
+            CHECK(count == 0, path.name << (threaded ? " on the pool" : "") << " made " << count
+                                        << " allocations after warm-up");
+        }
+    }
+    network.setThread_pool(NULL);
+
+    // the arena was charged to its own tag, inside no layer
+    bool arena_tagged = false;
+    for (const Alloc_record &record : Alloc_tracker::instance().records())
+        if (strcmp(record.tag, "arena") == 0 && strcmp(record.phase, "allocation_checks") == 0)
+            arena_tagged = arena_tagged || (record.layer == -1 && record.allocations > 0);
+    CHECK(arena_tagged, "the forward arena is not charged to the arena tag");
+
+    std::string prefix = work_dir + "/" + model.directory + "/" + model.name;
+    Inference_server<int> server(prefix);
+    CHECK(server.load(NULL) == 0, model.name << " server did not load");
+    std::vector<int> request(server.getNetwork().getNet_input_size()), reply(server.getNetwork().getNet_output_size());
+    long long count = allocations_during([&] {
+        for (int i = 0; i < 3; i++)
+            server.infer(request.data(), reply.data(), 1);
+    });
+    CHECK(count == 0, model.name << " server infer made " << count << " allocations after warm-up");
+
+    // split, File_utils and a whole Test run leave nothing behind
+    {
+        ALLOC_PHASE("pipeline");
+        Test<int> test(prefix);
+        test.initialize();
+        test.generate_parameter_file();
+        test.generate_layer_file_paths();
+        test.generate_matrix();
+        test.generate_stream();
+        test.generate_output();
+    }
+    CHECK(live_blocks("pipeline") == 0, "the Test pipeline leaked " << live_blocks("pipeline") << " blocks");
+}
+
+// every index is visited exactly once whatever the grain, and tiles cover
+// the whole rows x cols rectangle
+static void run_thread_pool_checks() {
+    Thread_pool &pool = test_pool();
+    for (long long grain : {1LL, 3LL, 64LL, 1000LL}) {
+        std::vector<std::atomic<int> > visits(777);
+        for (auto &v : visits) v = 0;
+        pool.parallel_for(0, visits.size(), grain, [&](long long first, long long last) {
+            for (long long i = first; i < last; i++) visits[i]++;
+        });
+        bool once = true;
+        for (auto &v : visits) once = once && v == 1;
+        CHECK(once, "parallel_for with grain " << grain << " did not visit every index once");
+    }
+
+    std::vector<std::atomic<int> > cells(13 * 29);
+    for (auto &v : cells) v = 0;
+    pool.parallel_for_2d(13, 2, 29, 16, [&](long long r0, long long r1, long long c0, long long c1) {
+        for (long long r = r0; r < r1; r++)
+            for (long long c = c0; c < c1; c++) cells[r * 29 + c]++;
+    });
+    bool covered = true;
+    for (auto &v : cells) covered = covered && v == 1;
+    CHECK(covered, "parallel_for_2d did not cover every tile once");
+
+    CHECK(parse_cpu_list("0-3,8,10-11").size() == 7, "cpu list parsing");
+}
+
+static void run_cfg_parser_checks() {
+    // keys in any order, comments, and pad= after the activation
+    Cfg_parser reordered;
+    int status = reordered.parse("# comment\n[net]\nchannels=3\nwidth=10\nheight=8\n\n"
+                                 "[convolutional]\nactivation=leaky\npad=1\nsize=3\nfilters=4\nstride=2\n"
+                                 "batch_normalize=1\n\n[maxpool]\nstride=2\nsize=2\n");
+    CHECK(status == 0, "reordered cfg: " << reordered.getError());
+    if (status == 0) {
+        const std::vector<Layer_desc> &layers = reordered.getLayers();
+        CHECK(layers.size() == 2, "reordered cfg has " << layers.size() << " layers");
+        CHECK(layers[0].output_height == 4 && layers[0].output_width == 5 && layers[0].output_channel == 4,
+              "reordered conv shape");
+        CHECK(layers[0].batch_normalize && layers[0].activation == "leaky" && layers[0].padding == 1,
+              "reordered conv attributes");
+        CHECK(layers[1].output_height == 2 && layers[1].output_width == 2, "reordered maxpool shape");
+    }
+
+    // route concatenates channels, shortcut keeps the shape, upsample scales it
+    Cfg_parser branches;
+    status = branches.parse("[net]\nheight=8\nwidth=8\nchannels=3\n"
+                            "[convolutional]\nfilters=8\nsize=3\npad=1\n"
+                            "[convolutional]\nfilters=8\nsize=1\n"
+                            "[shortcut]\nfrom=-2\nactivation=linear\n"
+                            "[maxpool]\nsize=2\nstride=2\n"
+                            "[upsample]\nstride=2\n"
+                            "[route]\nlayers=-1,0\n");
+    CHECK(status == 0, "branch cfg: " << branches.getError());
+    if (status == 0) {
+        const Layer_desc &route = branches.getLayers().back();
+        CHECK(route.type == LAYER_ROUTE && route.inputs.size() == 2 && route.inputs[1] == 0, "route inputs");
+        CHECK(route.output_height == 8 && route.output_width == 8 && route.output_channel == 16, "route shape");
+    }
+
+    // errors report the offending line
+    Cfg_parser broken;
+    CHECK(broken.parse("[net]\nheight=8\nwidth=8\nchannels=3\n\n[convolutional]\nfilters=x\n") != 0 &&
+          broken.getError().find(":7:") != std::string::npos, "bad integer error: " << broken.getError());
+    CHECK(broken.parse("[net]\nheight=8\nwidth=8\nchannels=3\n[deconvolutional]\nfilters=2\n") != 0 &&
+          broken.getError().find(":5:") != std::string::npos, "unknown section error: " << broken.getError());
+    CHECK(broken.parse("[net]\nheight=2\nwidth=2\nchannels=3\n[convolutional]\nfilters=2\nsize=5\n") != 0,
+          "a kernel larger than the input must be rejected");
+    CHECK(broken.parse("[net]\nheight=8\nwidth=8\nchannels=3\n[convolutional]\nfilters=2\n[route]\nlayers=\n") != 0 &&
+          broken.getError().find(":8:") != std::string::npos, "empty route error: " << broken.getError());
+    CHECK(broken.parse("[net]\nheight=8\nwidth=8\nchannels=3\n[convolutional]\nfilters=2\n[shortcut]\nfrom=\n") != 0 &&
+          broken.getError().find(":8:") != std::string::npos, "empty shortcut error: " << broken.getError());
+    CHECK(broken.parse("[net]\nheight=8\nwidth=8\nchannels=3\n[route]\nlayers=-1\n") != 0,
+          "a route before any layer must be rejected");
+}
+
+// containers built under a pool or an arena must behave like heap ones, and a
+// pool that is reset between layers must stop growing once it has warmed up
+static void run_allocator_checks() {
+    Conv_case c;
+    c.height = 12;
+    c.width = 10;
+    c.channel = 3;
+    c.filters = 4;
+    c.groups = 1;
+    c.conv = Conv_params(3, 1, 1);
+    c.input.resize(c.height, c.width, c.channel);
+    for (int h = 0; h < c.height; h++)
+        for (int w = 0; w < c.width; w++)
+            for (int ch = 0; ch < c.channel; ch++)
+                c.input[h][w][ch] = (h * 7 + w * 3 + ch) % 11 - 5;
+    c.kernel.resize(c.filters, 3, 3, c.channel);
+    for (int f = 0; f < c.filters; f++)
+        for (int kh = 0; kh < 3; kh++)
+            for (int kw = 0; kw < 3; kw++)
+                for (int ch = 0; ch < c.channel; ch++)
+                    c.kernel[f][kh][kw][ch] = (f + kh * 2 + kw - ch) % 5;
+
+    Network<int> network("");
+    setup_network(network, c);
+
+    Pool_allocator pool(4096);
+    size_t reserved_after_warmup = 0;
+    for (int layer = 0; layer < 6; layer++) {
+        pool.reset();
+        Allocator_scope scope(&pool);
+        Array2D<int> input_matrix;
+        Array2D<int> kernel_matrix;
+        Array3D<int> input(c.input);
+        CHECK(network.conv_convert(0, c.conv, input, c.kernel, input_matrix, kernel_matrix) == 0 &&
+              reference_matches(c, input_matrix, kernel_matrix), "pool-backed conv_convert is wrong");
+
+        Stream<int> stream;
+        for (int i = 0; i < 5000; i++)
+            stream.write(i);
+        bool in_order = true;
+        for (int i = 0; i < 5000; i++)
+            in_order = in_order && stream.read() == i;
+        CHECK(in_order && stream.empty(), "pool-backed stream lost its order");
+
+        if (layer == 1) reserved_after_warmup = pool.getBytes_reserved();
+        if (layer > 1)
+            CHECK(pool.getBytes_reserved() == reserved_after_warmup,
+                  "pool grew from " << reserved_after_warmup << " to " << pool.getBytes_reserved() << " bytes");
+    }
+
+    // an over-aligned block is recycled into its size class, so it must be
+    // full class size or the next block of that class overruns its neighbour
+    {
+        Pool_allocator aligned_pool(4096);
+        char *over = static_cast<char *>(aligned_pool.allocate(40, 64));
+        char *next = static_cast<char *>(aligned_pool.allocate(64, 16));
+        CHECK(reinterpret_cast<uintptr_t>(over) % 64 == 0, "over-aligned pool block is misaligned");
+        aligned_pool.deallocate(over, 40);
+        char *reused = static_cast<char *>(aligned_pool.allocate(64, 16));
+        CHECK(reused + 64 <= next || next + 64 <= reused, "recycled over-aligned block overlaps its neighbour");
+        char *fresh = static_cast<char *>(aligned_pool.allocate(64, 128));
+        CHECK(reinterpret_cast<uintptr_t>(fresh) % 128 == 0, "over-aligned request got a free-list block");
+    }
+
+    Arena_allocator arena(256);
+    {
+        Allocator_scope scope(&arena);
+        Array4D<int> kernel(c.kernel);
+        CHECK(kernel[3][2][1][2] == c.kernel[3][2][1][2], "arena-backed copy differs");
+        CHECK(arena.getBytes_used() > 0, "arena was not used");
+    }
+    CHECK(current_allocator() == default_allocator(), "allocator scope did not restore the heap");
+    arena.reset();
+    CHECK(arena.getBytes_used() == 0, "arena reset left bytes in use");
+}
+
+// every backend writes and reads back whole files, including more requests
+// in flight than the io_uring has entries, and reports a missing file
+static void run_async_io_checks(const std::string &work_dir) {
+    std::string big(3 << 20, 'x');
+    for (size_t i = 0; i < big.size(); i += 4093)
+        big[i] = 'a' + i % 26;
+
+    for (const char *backend : {"sync", "thread", "uring"}) {
+        Async_io *io = create_async_io(backend);
+        std::string prefix = work_dir + "/async_" + backend + "_";
+
+        std::vector<Io_handle> writes;
+        for (int i = 0; i < 100; i++)
+            writes.push_back(io->write(prefix + std::to_string(i), std::to_string(i * i) + "\n"));
+        writes.push_back(io->write(prefix + "big", big));
+        writes.push_back(io->write(prefix + "empty", ""));
+        bool written = true;
+        for (Io_handle &write : writes)
+            written = written && io->wait(write) == 0;
+        CHECK(written, io->name() << " writes failed");
+
+        std::vector<Io_handle> reads;
+        for (int i = 0; i < 100; i++)
+            reads.push_back(io->read(prefix + std::to_string(i)));
+        Io_handle big_read = io->read(prefix + "big");
+        Io_handle empty_read = io->read(prefix + "empty");
+        Io_handle missing = io->read(prefix + "missing");
+        bool same = true;
+        for (int i = 0; i < 100; i++)
+            same = same && io->wait(reads[i]) == 0 && reads[i]->data == std::to_string(i * i) + "\n";
+        CHECK(same, io->name() << " small reads differ");
+        CHECK(io->wait(big_read) == 0 && big_read->data == big, io->name() << " large read differs");
+        CHECK(io->wait(empty_read) == 0 && empty_read->data.empty(), io->name() << " empty read");
+        CHECK(io->wait(missing) == -ENOENT, io->name() << " missing file gave " << missing->status);
+        delete io;
+    }
+
+    // parse_buffer on what a backend read equals parse_file
+    std::string text = "2 3 1 0 1\r\n1 2 3\n\n4 5 6\n";
+    std::ofstream(work_dir + "/buffer.txt") << text;
+    File_utils<int> from_file(work_dir + "/buffer.txt"), from_buffer(work_dir + "/buffer.txt");
+    from_file.parse_file();
+    from_buffer.parse_buffer(text);
+    CHECK(from_file.getFile_contents() == from_buffer.getFile_contents() && from_file.getFile_contents().size() == 3,
+          "parse_buffer differs from parse_file");
+}
+
+static std::vector<int> drain(Stream<int> &stream) {
+    std::vector<int> values;
+    while (!stream.empty())
+        values.push_back(stream.read());
+    return values;
+}
+
+static void run_stream_reader_checks(const std::string &work_dir) {
+    // a capacity-3 stream between two threads keeps every value in order
+    Stream<int> channel(3);
+    std::thread producer([&] {
+        for (int i = 0; i < 10000; i++)
+            channel.write(i);
+        channel.close();
+    });
+    std::vector<int> received = drain(channel);
+    producer.join();
+    bool ordered = received.size() == 10000;
+    for (size_t i = 0; ordered && i < received.size(); i++)
+        ordered = received[i] == (int)i;
+    CHECK(ordered, "bounded stream lost or reordered values (" << received.size() << " received)");
+
+    // Stream_reader yields what get_stream_initial_input does, for text
+    // (CRLF, blank lines, extra tokens, negatives) and binary files
+    std::string text_path = work_dir + "/reader.txt";
+    std::ofstream(text_path) << "3 2 2 1 1\r\n1 -2 3 4 99\r\n\n5 6 7 8\n9 10 11 12";
+    std::string binary_path = work_dir + "/reader.bin";
+    {
+        std::ofstream out(binary_path, std::ios::binary | std::ios::trunc);
+        int header[] = {5, 2, 3, 2, 0, 2};
+        int element_size = sizeof(int), dtype = binary_dtype<int>();
+        out.write(BINARY_TENSOR_MAGIC, sizeof(BINARY_TENSOR_MAGIC));
+        out.write((const char *)header, sizeof(header));
+        out.write((const char *)&element_size, sizeof(int));
+        out.write((const char *)&dtype, sizeof(int));
+        for (int i = 0; i < 2 * 3 * 2; i++)
+            out.write((const char *)&i, sizeof(int));
+    }
+
+    for (const std::string &path : {text_path, binary_path}) {
+        File_utils<int> file(path);
+        file.parse_file();
+        Stream<int> expected_stream;
+        int expected_padding = -1, expected_step = -1;
+        file.get_stream_initial_input(expected_stream, expected_padding, expected_step);
+
+        Stream_reader<int> reader(path, 4);
+        int padding = -1, step_size = -1;
+        int opened = reader.open(padding, step_size);
+        Stream<int> stream(2);
+        std::thread feeder([&] { reader.read_into(stream); });
+        std::vector<int> values = drain(stream);
+        feeder.join();
+        CHECK(opened == 0 && padding == expected_padding && step_size == expected_step &&
+              values == drain(expected_stream), "stream reader differs on " << path);
+    }
+
+    // an int file has float's size but not its dtype
+    int float_padding = -1, float_step = -1;
+    Stream_reader<float> float_reader(binary_path);
+    CHECK(float_reader.open(float_padding, float_step) != 0, "stream reader opened an int binary file as float");
+
+    Stream_reader<int> missing(work_dir + "/reader.missing");
+    int padding, step_size;
+    CHECK(missing.open(padding, step_size) == -1, "stream reader opened a missing file");
+}
+
+static void run_systolic_checks() {
+    // one full tile: the stream needs K cycles to fill it, then K to feed,
+    // R + C - 2 of skew and R to drain
+    Systolic_config config(8, 4);
+    Systolic_array<int> array(config);
+    Systolic_stats one = array.estimate(8, 27, 4);
+    CHECK(one.cycles == 27 + 27 + 8 + 4 - 2 + 8 && one.stall_cycles == 27 && one.macs == 8 * 27 * 4,
+          "single-tile estimate is " << one.cycles << " cycles");
+
+    // double buffering and a faster stream never cost cycles, and a slow
+    // stream with one buffer tile serializes loading and compute
+    Systolic_config single = config, fast = config;
+    single.input_buffer_tiles = 1;
+    fast.stream_bandwidth = 1e9;
+    Systolic_stats doubled = array.estimate(1000, 72, 40);
+    Systolic_stats serial = Systolic_array<int>(single).estimate(1000, 72, 40);
+    Systolic_stats unbounded = Systolic_array<int>(fast).estimate(1000, 72, 40);
+    CHECK(unbounded.cycles <= doubled.cycles && doubled.cycles < serial.cycles,
+          "systolic buffering: " << unbounded.cycles << " " << doubled.cycles << " " << serial.cycles);
+    CHECK(doubled.peak_input_buffer <= 2 * 8 * 72 && serial.peak_input_buffer <= 8 * 72,
+          "input buffer holds more tiles than configured");
+    CHECK(unbounded.utilization > 0.5 && unbounded.utilization <= 1.0,
+          "compute-bound utilization is " << unbounded.utilization);
+
+    // the functional model is a gemm, with partial tiles on both edges and
+    // the windows arriving over a bounded stream from another thread
+    std::mt19937 rng(40);
+    int windows = 29, depth = 13, filters = 11;
+    std::vector<int> matrix(windows * depth), kernel(depth * filters), expected(windows * filters);
+    for (int &value : matrix) value = (int)(rng() % 19) - 9;
+    for (int &value : kernel) value = (int)(rng() % 19) - 9;
+    gemm(matrix.data(), kernel.data(), expected.data(), windows, depth, filters);
+    for (Thread_pool *pool : {(Thread_pool *)NULL, &test_pool()}) {
+        Stream<int> stream(depth);
+        std::thread producer([&] {
+            for (int value : matrix)
+                stream.write(value);
+            stream.close();
+        });
+        std::vector<int> output(windows * filters);
+        Systolic_stats stats = array.run_stream(stream, kernel.data(), windows, depth, filters, output.data(), pool);
+        producer.join();
+        CHECK(output == expected && stats.macs == (long long)windows * depth * filters,
+              "systolic array output differs from gemm" << (pool ? " on the pool" : ""));
+    }
+}
+
+// forward_batch against forward image by image on every layer type, then
+// the same images from many threads through a Dynamic_batcher
+static void run_batch_checks(const std::string &work_dir) {
+    std::string cfg = work_dir + "/batch.cfg";
+    std::ofstream file(cfg.c_str());
+    file << "[net]\nheight=9\nwidth=7\nchannels=3\n"
+            "[convolutional]\nfilters=4\nsize=3\nstride=1\npad=1\nactivation=leaky\n"
+            "[convolutional]\nfilters=4\nsize=1\nstride=1\nactivation=linear\n"
+            "[shortcut]\nfrom=-2\nactivation=linear\n"
+            "[maxpool]\nsize=2\nstride=2\n"
+            "[upsample]\nstride=2\n"
+            "[convolutional]\nfilters=3\nsize=3\nstride=2\npad=1\nactivation=relu\n"
+            "[route]\nlayers=-1,-3\n"
+            "[avgpool]\n";
+    file.close();
+
+    Network<int> network(cfg);
+    CHECK(network.obtain_parameters() == 0, "cannot parse " << cfg);
+    if (network.getLayer_number() == 0) return;
+    std::mt19937 rng(43);
+    std::vector<Array4D<int> > kernels = random_kernels(network, rng);
+    CHECK(network.load_weights(kernels) == 0, "batch.cfg load_weights failed");
+
+    const int images = 40;
+    long long input_size = network.getNet_input_size(), output_size = network.getNet_output_size();
+    std::vector<int> inputs(images * input_size), expected(images * output_size);
+    for (int &value : inputs) value = (int)(rng() % 11) - 5;
+    for (int b = 0; b < images; b++)
+        network.forward(inputs.data() + b * input_size, expected.data() + b * output_size);
+
+    std::vector<int> batched(5 * output_size);
+    network.setThread_pool(&test_pool());
+    CHECK(network.forward_batch(inputs.data(), batched.data(), 5) == 0, "forward_batch failed");
+    CHECK(std::equal(batched.begin(), batched.end(), expected.begin()), "forward_batch disagrees with forward");
+
+    std::vector<int> results(images * output_size);
+    Batcher_stats stats;
+    {
+        Dynamic_batcher<int> batcher(network, Batcher_config(4, 200, 0));
+        std::vector<std::thread> clients;
+        for (int t = 0; t < 8; t++)
+            clients.emplace_back([&, t] {
+                for (int b = t; b < images; b += 8)
+                    batcher.infer(inputs.data() + b * input_size, results.data() + b * output_size);
+            });
+        for (std::thread &client : clients)
+            client.join();
+        stats = batcher.stats();
+        CHECK(batcher.predict(4) > 0, "batcher has no batch time estimate");
+    }
+    network.setThread_pool(NULL);
+    CHECK(results == expected, "batched requests differ from forward");
+    CHECK(stats.images == images && stats.batches >= images / 4 && stats.batches <= images &&
+          stats.p50_us <= stats.p99_us, "batcher stats: " << stats.images << " images in " << stats.batches);
+}
+
+template <class T>
+static std::vector<T> flatten(Array3D<T> &tensor) {
+    std::vector<T> values;
+    for (int h = 0; h < tensor.Size_3d(); h++)
+        for (int w = 0; w < tensor.Size_2d(); w++)
+            for (int c = 0; c < tensor.Size_1d(); c++)
+                values.push_back(tensor[h][w][c]);
+    return values;
+}
+
+// one framed request from the client side; the response header goes to reply
+static bool request(int fd, Frame_reader &reader, const std::string &header, const std::vector<int> &payload,
+                    std::string &reply, std::vector<int> &result) {
+    if (!write_all(fd, header.data(), header.size()) ||
+        !write_all(fd, payload.data(), payload.size() * sizeof(int)) || !reader.read_line(reply))
+        return false;
+    int batch, height, width, channel;
+    if (sscanf(reply.c_str(), "ok %d %d %d %d", &batch, &height, &width, &channel) != 4) return true;
+    result.resize((long long)batch * height * width * channel);
+    return reader.read_exact(result.data(), result.size() * sizeof(int));
+}
+
+// the server answers framed batches with the same values as forward, over a
+// socketpair and over a Unix socket, and rejects malformed requests
+static void run_server_checks(const std::string &source_dir, const std::string &work_dir, const Golden_model &model) {
+    std::string prefix = source_dir + "/" + model.directory + "/" + model.name;
+    std::vector<int> expected;
+    {
+        Array3D<int> output = typed_forward<int>(prefix, model, false);
+        expected = flatten(output);
+    }
+    File_utils<int> input_util(prefix + ".layer_0.initial_input");
+    input_util.parse_file();
+    Array3D<int> image;
+    int padding, step_size;
+    input_util.get_initial_input(image, padding, step_size);
+    std::vector<int> single = flatten(image), pair = single;
+    pair.insert(pair.end(), single.begin(), single.end());
+
+    Inference_server<int> server(prefix);
+    CHECK(server.load(&test_pool()) == 0, model.name << " server did not load");
+
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+    int served = -2;
+    std::thread serving([&] { served = server.serve(fds[1], fds[1]); });
+    Frame_reader reader(fds[0]);
+    std::string reply;
+    std::vector<int> result;
+    bool ok = request(fds[0], reader, "infer 2\n", pair, reply, result);
+    std::vector<int> doubled = expected;
+    doubled.insert(doubled.end(), expected.begin(), expected.end());
+    CHECK(ok && result == doubled, model.name << " server batch differs from forward: " << reply);
+    ok = request(fds[0], reader, "infer 1\n", single, reply, result);
+    CHECK(ok && result == expected, model.name << " server request differs from forward: " << reply);
+    ok = request(fds[0], reader, "stats\n", std::vector<int>(), reply, result);
+    CHECK(ok && reply.compare(0, 26, "stats requests=2 images=3 ") == 0, "server stats: " << reply);
+    ok = request(fds[0], reader, "infer 0\n", std::vector<int>(), reply, result);
+    CHECK(ok && reply.compare(0, 6, "error ") == 0, "server accepted an empty batch: " << reply);
+    serving.join();
+    CHECK(served == -1, "server kept a connection open after a bad request");
+    close(fds[0]);
+    close(fds[1]);
+
+    // with batching every connection has its own thread: one client stays
+    // idle while the other is served and asks for the shutdown
+    CHECK(server.enable_batching(Batcher_config(2, 500)) == 0, "enable_batching failed");
+    std::string path = work_dir + "/server.sock";
+    std::thread listening([&] { served = server.serve_socket(path); });
+    auto connect_client = [&] {
+        for (int attempt = 0; attempt < 500; attempt++) {
+            int client = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            strcpy(address.sun_path, path.c_str());
+            if (connect(client, (struct sockaddr *)&address, sizeof(address)) == 0) return client;
+            close(client);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return -1;
+    };
+    int idle = connect_client(), client = connect_client();
+    CHECK(idle >= 0 && client >= 0, "cannot connect to " << path);
+    if (idle < 0 || client < 0) {
+        // the listener never came up or is stuck in accept
+        listening.detach();
+        return;
+    }
+    Frame_reader socket_reader(client);
+    ok = request(client, socket_reader, "infer 2\n", pair, reply, result);
+    CHECK(ok && result == doubled, model.name << " batched socket request differs from forward: " << reply);
+    ok = request(client, socket_reader, "stats\n", std::vector<int>(), reply, result);
+    CHECK(ok && reply.find(" batches=") != std::string::npos, "server stats without batching: " << reply);
+    write_all(client, "shutdown\n", 9);
+    listening.join();
+    close(idle);
+    close(client);
+    CHECK(served == 0, "serve_socket returned " << served);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "usage: " << argv[0] << " <source_dir> <work_dir>" << std::endl;
+        return 1;
+    }
+    Alloc_tracker::instance().setReport_at_exit(false);
+    std::string source_dir = argv[1];
+    std::string work_dir = argv[2];
+
+    std::vector<Golden_model> models = {
+        {"e1_model/example_1", "network_1", 2},
+        {"e2_model", "network_2", 2},
+        {"e3_model", "network_3", 3},
+        {"e4_model", "network_4", 2},
+    };
+    for (const Golden_model &model : models) {
+        run_golden_model(source_dir, work_dir, model);
+        run_forward_checks(source_dir, model);
+        run_precision_checks(source_dir, model);
+    }
+    run_numeric_type_checks(work_dir);
+
+    run_cfg_parser_checks();
+    run_allocator_checks();
+    run_fused_checks(work_dir);
+    run_thread_pool_checks();
+    run_async_io_checks(work_dir);
+    run_stream_reader_checks(work_dir);
+    run_systolic_checks();
+    run_batch_checks(work_dir);
+    run_grouped_checks(work_dir);
+    run_geometry_checks(work_dir);
+    run_conversion_plan_checks(work_dir);
+    run_allocation_checks(work_dir, models[1]);
+    run_numa_checks(work_dir);
+    run_huge_page_checks(work_dir);
+    run_perf_counter_checks();
+    run_server_checks(source_dir, work_dir, models[0]);
+    run_differential(500, 2024);
+
+    std::cout << checks - failures << "/" << checks << " checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
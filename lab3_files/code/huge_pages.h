@@ -0,0 +1,84 @@
+#ifndef HUGE_PAGES_H
+#define HUGE_PAGES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <sys/mman.h>
+
+// Large buffers (the forward arena, arena chunks holding im2col rows) can be
+// backed by 2 MB pages so strided im2col and gemm reads stay within a few
+// TLB entries. EXPLICIT asks for pages from the hugetlbfs pool
+// (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages); TRANSPARENT maps 2 MB
+// aligned memory and madvise()s it for THP. Each falls back to the next:
+// explicit, then transparent, then plain 4K pages.
+enum Huge_page_mode {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+};
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// "off", "thp" or "explicit"; anything else is off
+inline Huge_page_mode parse_huge_page_mode(const std::string &text) {
+    if (text == "thp" || text == "transparent") return HUGE_PAGES_TRANSPARENT;
+    if (text == "explicit") return HUGE_PAGES_EXPLICIT;
+    return HUGE_PAGES_OFF;
+}
+
+inline const char *huge_page_mode_name(Huge_page_mode mode) {
+    if (mode == HUGE_PAGES_TRANSPARENT) return "thp";
+    if (mode == HUGE_PAGES_EXPLICIT) return "explicit";
+    return "off";
+}
+
+// MLARCH_HUGE_PAGES=off|thp|explicit
+inline Huge_page_mode huge_page_mode_from_env() {
+    const char *text = std::getenv("MLARCH_HUGE_PAGES");
+    return text ? parse_huge_page_mode(text) : HUGE_PAGES_OFF;
+}
+
+inline size_t huge_page_round(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// bytes rounded up to whole 2 MB pages, 2 MB aligned. *backing (if given)
+// is what the memory actually got; HUGE_PAGES_OFF there means plain pages.
+// Throws std::bad_alloc only when not even plain pages can be mapped.
+inline void *huge_page_alloc(size_t bytes, Huge_page_mode mode, Huge_page_mode *backing = NULL) {
+    size_t size = huge_page_round(bytes > 0 ? bytes : 1);
+#ifdef MAP_HUGETLB
+    if (mode == HUGE_PAGES_EXPLICIT) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            if (backing) *backing = HUGE_PAGES_EXPLICIT;
+            return p;
+        }
+    }
+#endif
+    // over-map by one page and trim both ends to a 2 MB boundary
+    char *raw = static_cast<char *>(
+        mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED) throw std::bad_alloc();
+    uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    char *p = reinterpret_cast<char *>(start);
+    if (p > raw) munmap(raw, p - raw);
+    if (raw + size + HUGE_PAGE_SIZE > p + size) munmap(p + size, raw + size + HUGE_PAGE_SIZE - (p + size));
+
+    Huge_page_mode got = HUGE_PAGES_OFF;
+#ifdef MADV_HUGEPAGE
+    if (mode != HUGE_PAGES_OFF && madvise(p, size, MADV_HUGEPAGE) == 0) got = HUGE_PAGES_TRANSPARENT;
+#endif
+    if (backing) *backing = got;
+    return p;
+}
+
+inline void huge_page_free(void *p, size_t bytes) {
+    if (p) munmap(p, huge_page_round(bytes > 0 ? bytes : 1));
+}
+
+#endif //HUGE_PAGES_H
@@ -0,0 +1,231 @@
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inference_server.h"
+
+// Loads a model once and serves forward passes, e.g.
+//   ./inference_server ./e2_model/network_2 --socket /tmp/mlarch.sock
+//   ./inference_server ./e2_model/network_2 < requests > responses
+//   ./inference_server ./e2_model/network_2 --bench 200 --batch 4
+//   ./inference_server ./e2_model/network_2 --socket /tmp/mlarch.sock --max-batch 8 --slo-us 2000
+//   ./inference_server ./e2_model/network_2 --bench 2000 --curve 1,4,16 --max-batch 16
+// The protocol is described in inference_server.h. Without --socket requests
+// come on stdin and responses go to stdout; the latency summary goes to stderr
+// when the server stops. --bench skips the framing and times batches of the
+// model's layer_0.initial_input in process. --max-batch, --max-delay-us and
+// --slo-us put a Dynamic_batcher in front of the network; --curve then runs
+// the bench as single-image requests from each number of client threads for
+// every power-of-two max batch up to --max-batch and prints throughput and
+// latency per point. --pin pins the pool's workers node by node; across
+// NUMA nodes each node then gets its own copy of the weights. --huge-pages
+// backs the tensor arena with 2 MB pages.
+
+static void usage(const char *program) {
+    std::cout << "usage: " << program << " <model_path> [--socket PATH] [--type int|float|bf16|fp16] [--fused]"
+              << " [--threads N] [--pin] [--huge-pages thp|explicit] [--bench REQUESTS] [--batch N] [--max-batch N] [--max-delay-us US]"
+              << " [--slo-us US] [--curve CLIENTS,...]" << std::endl;
+}
+
+// "1,4,16" -> {1, 4, 16}
+static std::vector<int> parse_sizes(const char *text) {
+    std::vector<int> sizes;
+    while (*text) {
+        char *end;
+        long size = strtol(text, &end, 10);
+        if (end == text) break;
+        if (size > 0) sizes.push_back(size);
+        text = *end == ',' ? end + 1 : end;
+    }
+    return sizes;
+}
+
+struct Server_options {
+    std::string socket_path;
+    bool fused;
+    int threads;
+    bool pin;
+    Huge_page_mode huge_pages;
+    int bench_requests;
+    int batch;
+    bool batching;
+    Batcher_config batcher;
+    std::vector<int> curve;
+};
+
+// batch copies of the model's layer_0.initial_input, flattened
+template <class T>
+static int load_images(Inference_server<T> &server, const std::string &model_path, int batch,
+                       std::vector<T> &inputs) {
+    File_utils<T> input_util(model_path + ".layer_0.initial_input");
+    input_util.parse_file();
+    Array3D<T> image;
+    int padding, step_size;
+    if (input_util.get_initial_input(image, padding, step_size) != 0) {
+        std::cout << "cannot read " << model_path << ".layer_0.initial_input" << std::endl;
+        return -1;
+    }
+
+    long long input_size = server.getNetwork().getNet_input_size();
+    if ((long long)image.Size_3d() * image.Size_2d() * image.Size_1d() != input_size) {
+        std::cout << "layer_0.initial_input does not match the cfg input" << std::endl;
+        return -1;
+    }
+    inputs.resize(batch * input_size);
+    for (int b = 0; b < batch; b++) {
+        T *to = inputs.data() + b * input_size;
+        for (int h = 0; h < image.Size_3d(); h++)
+            for (int w = 0; w < image.Size_2d(); w++)
+                for (int c = 0; c < image.Size_1d(); c++)
+                    *to++ = image[h][w][c];
+    }
+    return 0;
+}
+
+template <class T>
+static int bench(Inference_server<T> &server, const std::string &model_path, int requests, int batch) {
+    std::vector<T> inputs;
+    if (load_images(server, model_path, batch, inputs) != 0) return 1;
+    std::vector<T> outputs(batch * server.getNetwork().getNet_output_size());
+
+    Latency_recorder latency(requests);
+    auto begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < requests; r++) {
+        auto start = std::chrono::steady_clock::now();
+        if (server.infer(inputs.data(), outputs.data(), batch) != 0) return 1;
+        latency.record(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("requests=%d batch=%d p50_us=%.1f p99_us=%.1f max_us=%.1f images/s=%.1f\n", requests, batch,
+           latency.percentile(50), latency.percentile(99), latency.getMax(), requests * batch / seconds);
+    return 0;
+}
+
+// closed-loop load: each client sends single images back to back, so the
+// client count sets how many images can wait for a batch at once
+template <class T>
+static int curve(Inference_server<T> &server, const std::string &model_path, const Server_options &options) {
+    std::vector<T> image;
+    if (load_images(server, model_path, 1, image) != 0) return 1;
+    long long output_size = server.getNetwork().getNet_output_size();
+
+    printf("%9s %7s %10s %10s %10s %10s %9s\n", "max_batch", "clients", "images/s", "mean_batch", "p50_us",
+           "p99_us", "slo_miss%");
+    for (int max_batch = 1; max_batch <= options.batcher.max_batch; max_batch *= 2) {
+        for (int clients : options.curve) {
+            Batcher_config config = options.batcher;
+            config.max_batch = max_batch;
+            if (server.enable_batching(config) != 0) return 1;
+            int per_client = std::max(1, options.bench_requests / clients);
+
+            auto begin = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (int c = 0; c < clients; c++)
+                threads.emplace_back([&] {
+                    std::vector<T> output(output_size);
+                    for (int r = 0; r < per_client; r++)
+                        server.infer(image.data(), output.data(), 1);
+                });
+            for (std::thread &thread : threads)
+                thread.join();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+            Batcher_stats stats = server.getBatcher()->stats();
+            printf("%9d %7d %10.1f %10.2f %10.1f %10.1f %9.2f\n", max_batch, clients, stats.images / seconds,
+                   stats.mean_batch, stats.p50_us, stats.p99_us,
+                   stats.images ? 100.0 * stats.slo_misses / stats.images : 0);
+        }
+    }
+    return 0;
+}
+
+template <class T>
+static int run(const std::string &model_path, const Server_options &options) {
+    Thread_pool pool(options.threads, options.pin);
+    Inference_server<T> server(model_path);
+    server.getNetwork().setHuge_pages(options.huge_pages);
+    auto start = std::chrono::steady_clock::now();
+    if (server.load(&pool, options.fused) != 0) return 1;
+    fprintf(stderr, "loaded %s in %.1f ms\n", model_path.c_str(),
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+    if (options.bench_requests > 0 && !options.curve.empty())
+        return curve(server, model_path, options);
+    if (options.batching && server.enable_batching(options.batcher) != 0) return 1;
+    if (options.bench_requests > 0)
+        return bench(server, model_path, options.bench_requests, options.batch);
+
+    int status = options.socket_path.empty() ? server.serve(0, 1) : server.serve_socket(options.socket_path);
+    fprintf(stderr, "%s\n", server.stats().c_str());
+    return status < 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string model_path = argv[1];
+    std::string type = "int";
+    Server_options options;
+    options.fused = false;
+    options.threads = 0;
+    options.pin = false;
+    options.huge_pages = HUGE_PAGES_OFF;
+    options.bench_requests = 0;
+    options.batch = 1;
+    options.batching = false;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--socket" && has_value) options.socket_path = argv[++i];
+        else if (arg == "--type" && has_value) type = argv[++i];
+        else if (arg == "--fused") options.fused = true;
+        else if (arg == "--threads" && has_value) options.threads = atoi(argv[++i]);
+        else if (arg == "--pin") options.pin = true;
+        else if (arg == "--huge-pages" && has_value) options.huge_pages = parse_huge_page_mode(argv[++i]);
+        else if (arg == "--bench" && has_value) options.bench_requests = atoi(argv[++i]);
+        else if (arg == "--batch" && has_value) options.batch = atoi(argv[++i]);
+        else if (arg == "--max-batch" && has_value) {
+            options.batcher.max_batch = atoi(argv[++i]);
+            options.batching = true;
+        }
+        else if (arg == "--max-delay-us" && has_value) {
+            options.batcher.max_delay_us = atof(argv[++i]);
+            options.batching = true;
+        }
+        else if (arg == "--slo-us" && has_value) {
+            options.batcher.slo_us = atof(argv[++i]);
+            options.batching = true;
+        }
+        else if (arg == "--curve" && has_value) options.curve = parse_sizes(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.batch < 1 || options.batch > SERVER_MAX_BATCH || options.batcher.max_batch < 1 ||
+        options.batcher.max_batch > SERVER_MAX_BATCH) {
+        std::cout << "batch must be 1.." << SERVER_MAX_BATCH << std::endl;
+        return 1;
+    }
+    // a client that hangs up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (type == "int")
+        return run<int>(model_path, options);
+    if (type == "float")
+        return run<float>(model_path, options);
+    if (type == "bf16")
+        return run<bfloat16>(model_path, options);
+    if (type == "fp16")
+        return run<float16>(model_path, options);
+    std::cout << "unknown type " << type << ", expected int, float, bf16 or fp16" << std::endl;
+    return 1;
+}
@@ -0,0 +1,333 @@
+#ifndef INFERENCE_SERVER_H
+#define INFERENCE_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "file_utils.h"
+#include "network.h"
+#include "request_batcher.h"
+#include "thread_pool.h"
+
+// Buffered reads of one connection: header lines and raw payloads
+class Frame_reader {
+public:
+    Frame_reader(int fd) : fd(fd), buffer(1 << 16), begin(0), end(0) {}
+
+    // the next '\n'-terminated line without its newline; false at EOF, on
+    // error or past max_length
+    bool read_line(std::string &line, size_t max_length = 256) {
+        line.clear();
+        while (true) {
+            if (begin == end && !fill()) return false;
+            char *newline = static_cast<char *>(memchr(buffer.data() + begin, '\n', end - begin));
+            size_t take = newline ? newline - (buffer.data() + begin) : end - begin;
+            line.append(buffer.data() + begin, take);
+            begin += take;
+            if (line.size() > max_length) return false;
+            if (newline) {
+                begin++;
+                return true;
+            }
+        }
+    }
+
+    bool read_exact(void *data, size_t bytes) {
+        char *to = static_cast<char *>(data);
+        while (bytes > 0) {
+            if (begin == end) {
+                // large payloads skip the buffer
+                if (bytes >= buffer.size()) {
+                    ssize_t n = ::read(fd, to, bytes);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) return false;
+                    to += n;
+                    bytes -= n;
+                    continue;
+                }
+                if (!fill()) return false;
+            }
+            size_t take = std::min(bytes, end - begin);
+            memcpy(to, buffer.data() + begin, take);
+            begin += take;
+            to += take;
+            bytes -= take;
+        }
+        return true;
+    }
+
+private:
+    bool fill() {
+        while (true) {
+            ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            begin = 0;
+            end = n;
+            return true;
+        }
+    }
+
+    int fd;
+    std::vector<char> buffer;
+    size_t begin, end;
+};
+
+inline bool write_all(int fd, const void *data, size_t bytes) {
+    const char *from = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t n = ::write(fd, from, bytes);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        from += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// A model loaded once (cfg, packed weights, planned arena) that answers
+// inference requests on a byte stream, stdin/stdout or a Unix socket:
+//   "infer <n>\n" + n images of h*w*c raw T (native byte order, HWC)
+//       -> "ok <n> <h> <w> <c>\n" + n outputs of raw T
+//   "stats\n"    -> "stats requests=<r> images=<i> p50_us=<> p99_us=<> max_us=<>\n"
+//   "quit\n"     closes the connection; "shutdown\n" also stops serve_socket
+// A malformed request gets "error <reason>\n" and the connection is closed.
+// Latency is measured from a request's header to the end of its response.
+// Without batching the n images of a request run as one forward_batch and
+// connections are served one at a time; with enable_batching every
+// connection gets a thread and their images share a Dynamic_batcher.
+static const int SERVER_MAX_BATCH = 1024;
+
+template <class T>
+class Inference_server {
+public:
+    Inference_server(const std::string &model_path);
+
+    // parses the cfg and every initial_kernel, packs the weights and runs
+    // one forward on zeros so the arena and the im2col plans are built
+    // before the first request
+    int load(Thread_pool *pool = NULL, bool fused = false);
+    // 0 at EOF or quit, 1 after shutdown, -1 on a broken connection
+    int serve(int in_fd, int out_fd);
+    // accepts connections until a shutdown request
+    int serve_socket(const std::string &path);
+    // batch images of getNet_input_size() values each, without the framing
+    int infer(const T *input, T *output, int batch);
+    // routes every later infer through a batcher (unfused); replaces an
+    // earlier one
+    int enable_batching(const Batcher_config &config);
+
+    Network<T> &getNetwork() { return network; }
+    Dynamic_batcher<T> *getBatcher() { return batcher.get(); }
+    std::string stats() const;
+
+private:
+    int reply_error(int fd, const std::string &reason);
+
+    std::string model_path;
+    Network<T> network;
+    bool fused;
+    std::unique_ptr<Dynamic_batcher<T> > batcher;
+
+    mutable std::mutex stats_lock;
+    Latency_recorder latency;
+    long long images;
+};
+
+template <class T>
+Inference_server<T>::Inference_server(const std::string &model_path)
+    : model_path(model_path), network(model_path + ".cfg"), fused(false), images(0) {}
+
+template <class T>
+int Inference_server<T>::load(Thread_pool *pool, bool fused) {
+    ALLOC_PHASE("load");
+    this->fused = fused;
+    if (network.obtain_parameters() != 0) return -1;
+    network.setThread_pool(pool);
+
+    std::vector<Array4D<T> > kernels(network.getLayer_number());
+    for (int i = 0; i < network.getLayer_number(); i++) {
+        std::string path = model_path + ".layer_" + std::to_string(i) + ".initial_kernel";
+        File_utils<T> kernel_util(path);
+        kernel_util.parse_file();
+        if (kernel_util.get_initial_kernel(kernels[i]) != 0) {
+            fprintf(stderr, "cannot read %s\n", path.c_str());
+            return -1;
+        }
+    }
+    if (network.load_weights(kernels) != 0) return -1;
+
+    std::vector<T> input(network.getNet_input_size(), (T)0), output(network.getNet_output_size());
+    return infer(input.data(), output.data(), 1);
+}
+
+// fused runs keep no batched intermediates, so their images go one by one
+template <class T>
+int Inference_server<T>::infer(const T *input, T *output, int batch) {
+    if (batcher) return batcher->infer(input, output, batch);
+    if (!fused) return network.forward_batch(input, output, batch);
+    long long input_size = network.getNet_input_size(), output_size = network.getNet_output_size();
+    for (int b = 0; b < batch; b++)
+        if (network.forward(input + b * input_size, output + b * output_size, true) != 0) return -1;
+    return 0;
+}
+
+// the largest batch runs once up front so the arena is in place
+template <class T>
+int Inference_server<T>::enable_batching(const Batcher_config &config) {
+    batcher.reset();
+    int max_batch = std::max(1, config.max_batch);
+    std::vector<T> input(max_batch * network.getNet_input_size(), (T)0);
+    std::vector<T> output(max_batch * network.getNet_output_size());
+    if (network.forward_batch(input.data(), output.data(), max_batch) != 0) return -1;
+    batcher.reset(new Dynamic_batcher<T>(network, config));
+    return 0;
+}
+
+template <class T>
+int Inference_server<T>::reply_error(int fd, const std::string &reason) {
+    std::string reply = "error " + reason + "\n";
+    write_all(fd, reply.data(), reply.size());
+    return -1;
+}
+
+template <class T>
+int Inference_server<T>::serve(int in_fd, int out_fd) {
+    ALLOC_PHASE("serve");
+    const Layer_desc &last = network.getLayers().back();
+    long long input_size = network.getNet_input_size(), output_size = network.getNet_output_size();
+    Frame_reader reader(in_fd);
+    std::string line;
+    char header[128];
+    // grown to the largest batch seen on this connection, never shrunk
+    std::vector<T> inputs, outputs;
+
+    while (reader.read_line(line)) {
+        if (line == "quit") return 0;
+        if (line == "shutdown") return 1;
+        if (line == "stats") {
+            std::string reply = stats() + "\n";
+            if (!write_all(out_fd, reply.data(), reply.size())) return -1;
+            continue;
+        }
+
+        int batch;
+        char extra;
+        if (sscanf(line.c_str(), "infer %d %c", &batch, &extra) != 1)
+            return reply_error(out_fd, "unknown request");
+        if (batch < 1 || batch > SERVER_MAX_BATCH)
+            return reply_error(out_fd, "batch must be 1.." + std::to_string(SERVER_MAX_BATCH));
+
+        auto start = std::chrono::steady_clock::now();
+        if ((long long)inputs.size() < batch * input_size) inputs.resize(batch * input_size);
+        if ((long long)outputs.size() < batch * output_size) outputs.resize(batch * output_size);
+        if (!reader.read_exact(inputs.data(), batch * input_size * sizeof(T))) return -1;
+        if (infer(inputs.data(), outputs.data(), batch) != 0) return reply_error(out_fd, "forward failed");
+
+        int length = snprintf(header, sizeof(header), "ok %d %d %d %d\n", batch, last.output_height,
+                              last.output_width, last.output_channel);
+        if (!write_all(out_fd, header, length) ||
+            !write_all(out_fd, outputs.data(), batch * output_size * sizeof(T)))
+            return -1;
+        std::lock_guard<std::mutex> guard(stats_lock);
+        latency.record(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        images += batch;
+    }
+    return 0;
+}
+
+template <class T>
+int Inference_server<T>::serve_socket(const std::string &path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path.c_str());
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        fprintf(stderr, "cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+        close(listener);
+        return -1;
+    }
+
+    std::atomic<bool> stopping(false);
+    std::mutex connection_lock;
+    std::vector<int> connections;
+    std::vector<std::thread> workers;
+    while (!stopping) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) continue;
+            if (!stopping) fprintf(stderr, "accept: %s\n", strerror(errno));
+            break;
+        }
+        if (!batcher) {
+            if (serve(connection, connection) == 1) stopping = true;
+            close(connection);
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(connection_lock);
+        connections.push_back(connection);
+        workers.emplace_back([&, connection] {
+            if (serve(connection, connection) == 1) {
+                // wakes the accept above
+                stopping = true;
+                ::shutdown(listener, SHUT_RDWR);
+            }
+        });
+    }
+
+    // connections still open are cut off once the loop ends
+    {
+        std::lock_guard<std::mutex> guard(connection_lock);
+        for (int connection : connections)
+            ::shutdown(connection, SHUT_RDWR);
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    for (int connection : connections)
+        close(connection);
+    close(listener);
+    unlink(path.c_str());
+    return stopping ? 0 : -1;
+}
+
+template <class T>
+std::string Inference_server<T>::stats() const {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    char text[256];
+    int length = snprintf(text, sizeof(text), "stats requests=%lld images=%lld p50_us=%.1f p99_us=%.1f max_us=%.1f",
+                          latency.getCount(), images, latency.percentile(50), latency.percentile(99),
+                          latency.getMax());
+    if (batcher) {
+        Batcher_stats batched = batcher->stats();
+        snprintf(text + length, sizeof(text) - length, " batches=%lld mean_batch=%.2f slo_misses=%lld",
+                 batched.batches, batched.mean_batch, batched.slo_misses);
+    }
+    return text;
+}
+
+#endif //INFERENCE_SERVER_H
@@ -0,0 +1,260 @@
+#ifndef LAYER_KERNELS_H
+#define LAYER_KERNELS_H
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cfg_parser.h"
+#include "numeric_types.h"
+
+// Flat NHWC kernels used by Network::forward. Tensors are plain arrays laid
+// out like Array3D<T> (height, width, channel) so they can live in the
+// planned arena.
+
+// one window position (kh, kw) of an im2col row. With groups the row holds
+// each group's whole window in turn, [group][kh][kw][channel / groups], so
+// group g's part is a contiguous depth / groups slice; dst is the row plus
+// (kh * size_w + kw) * channel / groups. src is NULL for padding.
+template <class T>
+inline void im2col_position(const T *src, int channel, int groups, long long group_depth, T *dst) {
+    int group_channel = channel / groups;
+    for (int g = 0; g < groups; g++) {
+        T *to = dst + g * group_depth;
+        if (!src) {
+            for (int c = 0; c < group_channel; c++)
+                to[c] = 0;
+        } else {
+            const T *from = src + g * group_channel;
+            for (int c = 0; c < group_channel; c++)
+                to[c] = from[c];
+        }
+    }
+}
+
+// im2col rows first..last-1 (one row per output pixel, in the same order as
+// conv_convert's input_matrix), padding read as zeros instead of
+// materialising a padded copy
+template <class T>
+void im2col_rows(const T *input, int height, int width, int channel, const Conv_params &conv, int out_w,
+                 long long first, long long last, T *matrix, int groups = 1) {
+    int row_length = conv.size_h * conv.size_w * channel;
+    int group_channel = channel / groups;
+    long long group_depth = (long long)conv.size_h * conv.size_w * group_channel;
+    for (long long pixel = first; pixel < last; pixel++) {
+        int h_out = pixel / out_w, w_out = pixel % out_w;
+        T *row = matrix + pixel * row_length;
+        for (int kh = 0; kh < conv.size_h; kh++) {
+            int h_in = h_out * conv.stride_h + kh * conv.dilation_h - conv.pad_top;
+            for (int kw = 0; kw < conv.size_w; kw++) {
+                int w_in = w_out * conv.stride_w + kw * conv.dilation_w - conv.pad_left;
+                T *dst = row + (kh * conv.size_w + kw) * group_channel;
+                bool inside = h_in >= 0 && h_in < height && w_in >= 0 && w_in < width;
+                const T *src = inside ? input + ((long long)h_in * width + w_in) * channel : NULL;
+                if (groups != 1) {
+                    im2col_position(src, channel, groups, group_depth, dst);
+                } else if (!src) {
+                    for (int c = 0; c < channel; c++)
+                        dst[c] = 0;
+                } else {
+                    for (int c = 0; c < channel; c++)
+                        dst[c] = src[c];
+                }
+            }
+        }
+    }
+}
+
+template <class T>
+void im2col(const T *input, int height, int width, int channel, const Conv_params &conv, int out_h, int out_w,
+            T *matrix, int groups = 1) {
+    im2col_rows(input, height, width, channel, conv, out_w, 0, (long long)out_h * out_w, matrix, groups);
+}
+
+// output[rows][cols] = a[rows][depth] * b[depth][cols], restricted to the
+// tile [row_begin, row_end) x [col_begin, col_end). Reduced-precision T sums
+// in Accumulator<T>::type and rounds once per output. a's rows are a_stride
+// apart (0 means depth), so one group of a grouped conv's im2col matrix
+// multiplies without a copy.
+template <class T>
+void gemm_tile(const T *a, const T *b, T *output, int depth, int cols, long long row_begin, long long row_end,
+               int col_begin, int col_end, long long a_stride = 0) {
+    typedef typename Accumulator<T>::type Acc;
+    if (a_stride == 0) a_stride = depth;
+    if constexpr (std::is_same<Acc, T>::value) {
+        for (long long i = row_begin; i < row_end; i++) {
+            T *out_row = output + i * cols;
+            for (int j = col_begin; j < col_end; j++)
+                out_row[j] = 0;
+            const T *a_row = a + i * a_stride;
+            for (int k = 0; k < depth; k++) {
+                T a_value = a_row[k];
+                const T *b_row = b + (long long)k * cols;
+                for (int j = col_begin; j < col_end; j++)
+                    out_row[j] += a_value * b_row[j];
+            }
+        }
+    } else {
+        thread_local std::vector<Acc> sums;
+        sums.resize(col_end - col_begin);
+        Acc *sum = sums.data() - col_begin;
+        for (long long i = row_begin; i < row_end; i++) {
+            for (int j = col_begin; j < col_end; j++)
+                sum[j] = 0;
+            const T *a_row = a + i * a_stride;
+            for (int k = 0; k < depth; k++) {
+                Acc a_value = a_row[k];
+                const T *b_row = b + (long long)k * cols;
+                for (int j = col_begin; j < col_end; j++)
+                    sum[j] += a_value * (Acc)b_row[j];
+            }
+            T *out_row = output + i * cols;
+            for (int j = col_begin; j < col_end; j++)
+                out_row[j] = (T)sum[j];
+        }
+    }
+}
+
+template <class T>
+void gemm(const T *a, const T *b, T *output, int rows, int depth, int cols) {
+    gemm_tile(a, b, output, depth, cols, 0, rows, 0, cols);
+}
+
+// output[rows][cols] += a[rows][depth] * b[depth][cols] where a's rows are
+// a_stride apart, so overlapping windows of one image row need no copy;
+// output is Accumulator<T>::type. b's and output's rows are b_stride apart
+// (0 means cols), for one group's columns of a wider kernel_matrix.
+template <class T, class Acc>
+void gemm_accumulate(const T *a, long long a_stride, const T *b, Acc *output, int rows, int depth, int cols,
+                     long long b_stride = 0) {
+    if (b_stride == 0) b_stride = cols;
+    for (int i = 0; i < rows; i++) {
+        Acc *out_row = output + i * b_stride;
+        const T *a_row = a + i * a_stride;
+        for (int k = 0; k < depth; k++) {
+            Acc a_value = a_row[k];
+            if (a_value == 0) continue;
+            const T *b_row = b + k * b_stride;
+            for (int j = 0; j < cols; j++)
+                out_row[j] += a_value * (Acc)b_row[j];
+        }
+    }
+}
+
+// One output row of a depthwise convolution (groups == channel). Filter f
+// only reads channel f / multiplier, so each window is summed straight from
+// the input rows: no im2col matrix, and with one filter per channel the
+// inner loop runs over contiguous channels. rows[kh] is the input row under
+// kernel row kh (dilation already applied), NULL where that row is padding;
+// columns outside [0, width) are padding too, conv.pad_left of them on the
+// left. weights is the kernel_matrix, [size_h * size_w][filters].
+template <class T>
+void depthwise_row(const T *const *rows, int width, int channel, int multiplier, const Conv_params &conv,
+                   const T *weights, int out_w, T *output) {
+    typedef typename Accumulator<T>::type Acc;
+    int filters = channel * multiplier;
+    thread_local std::vector<Acc> sums;
+    sums.resize(filters);
+    Acc *sum = sums.data();
+    for (int w_out = 0; w_out < out_w; w_out++) {
+        for (int f = 0; f < filters; f++)
+            sum[f] = 0;
+        for (int kh = 0; kh < conv.size_h; kh++) {
+            if (!rows[kh]) continue;
+            for (int kw = 0; kw < conv.size_w; kw++) {
+                int w_in = w_out * conv.stride_w + kw * conv.dilation_w - conv.pad_left;
+                if (w_in < 0 || w_in >= width) continue;
+                const T *src = rows[kh] + (long long)w_in * channel;
+                const T *weight = weights + (long long)(kh * conv.size_w + kw) * filters;
+                if (multiplier == 1) {
+                    for (int c = 0; c < channel; c++)
+                        sum[c] += (Acc)src[c] * (Acc)weight[c];
+                } else {
+                    for (int f = 0; f < filters; f++)
+                        sum[f] += (Acc)src[f / multiplier] * (Acc)weight[f];
+                }
+            }
+        }
+        T *to = output + (long long)w_out * filters;
+        for (int f = 0; f < filters; f++)
+            to[f] = (T)sum[f];
+    }
+}
+
+// darknet's leaky slope is 0.1; for integer T this truncates toward zero
+template <class T>
+inline T activate(T x, const std::string &activation) {
+    if (activation == "relu") return x > 0 ? x : (T)0;
+    if (activation == "leaky") return x > 0 ? x : (T)(x * 0.1);
+    return x;
+}
+
+inline bool activation_supported(const std::string &activation) {
+    return activation == "linear" || activation == "relu" || activation == "leaky";
+}
+
+template <class T>
+void activate_array(T *data, long long count, const std::string &activation) {
+    if (activation == "linear") return;
+    for (long long i = 0; i < count; i++)
+        data[i] = activate(data[i], activation);
+}
+
+template <class T>
+void maxpool(const T *input, int height, int width, int channel, int size, int stride, int padding,
+             int out_h, int out_w, T *output) {
+    // darknet centres the window: padding is the total over both sides
+    int offset = -padding / 2;
+    for (int h_out = 0; h_out < out_h; h_out++) {
+        for (int w_out = 0; w_out < out_w; w_out++) {
+            T *dst = output + ((long long)h_out * out_w + w_out) * channel;
+            for (int c = 0; c < channel; c++) {
+                bool found = false;
+                T best = 0;
+                for (int kh = 0; kh < size; kh++) {
+                    int h_in = h_out * stride + kh + offset;
+                    if (h_in < 0 || h_in >= height) continue;
+                    for (int kw = 0; kw < size; kw++) {
+                        int w_in = w_out * stride + kw + offset;
+                        if (w_in < 0 || w_in >= width) continue;
+                        T value = input[((long long)h_in * width + w_in) * channel + c];
+                        if (!found || value > best) best = value;
+                        found = true;
+                    }
+                }
+                dst[c] = best;
+            }
+        }
+    }
+}
+
+template <class T>
+void avgpool(const T *input, int height, int width, int channel, T *output) {
+    for (int c = 0; c < channel; c++) {
+        double sum = 0;
+        for (long long i = 0; i < (long long)height * width; i++)
+            sum += input[i * channel + c];
+        output[c] = (T)(sum / (height * width));
+    }
+}
+
+template <class T>
+void upsample(const T *input, int height, int width, int channel, int stride, T *output) {
+    int out_w = width * stride;
+    for (int h = 0; h < height * stride; h++)
+        for (int w = 0; w < out_w; w++)
+            for (int c = 0; c < channel; c++)
+                output[((long long)h * out_w + w) * channel + c] =
+                    input[((long long)(h / stride) * width + w / stride) * channel + c];
+}
+
+// writes source's channels into output starting at channel_offset
+template <class T>
+void concat_channels(const T *source, long long pixels, int source_channel, T *output, int output_channel,
+                     int channel_offset) {
+    for (long long p = 0; p < pixels; p++)
+        for (int c = 0; c < source_channel; c++)
+            output[p * output_channel + channel_offset + c] = source[p * source_channel + c];
+}
+
+#endif //LAYER_KERNELS_H
@@ -0,0 +1,62 @@
+#ifndef LINE_BUFFER_H
+#define LINE_BUFFER_H
+
+#include <vector>
+
+// Holds the most recent `capacity` rows of a row-major image, each
+// row_length values long. Rows are pushed in order and addressed by their
+// logical row number; storage is a ring, so advancing never copies a row.
+template <class T>
+class Line_buffer {
+public:
+    Line_buffer(int capacity = 0, int row_length = 0);
+
+    void reset(int capacity, int row_length);
+    // slot for the next logical row; the caller fills all row_length values
+    T *next_row();
+    T *row(int logical_row) const;
+    bool contains(int logical_row) const;
+
+    int getCapacity() const { return capacity; }
+    int getRow_length() const { return row_length; }
+    // number of rows pushed so far, i.e. the logical number of the next row
+    int getRows_pushed() const { return rows_pushed; }
+
+private:
+    int capacity;
+    int row_length;
+    int rows_pushed;
+    std::vector<T> storage;
+};
+
+template <class T>
+Line_buffer<T>::Line_buffer(int capacity, int row_length) {
+    reset(capacity, row_length);
+}
+
+template <class T>
+void Line_buffer<T>::reset(int capacity, int row_length) {
+    this->capacity = capacity;
+    this->row_length = row_length;
+    rows_pushed = 0;
+    storage.assign((size_t)capacity * row_length, T());
+}
+
+template <class T>
+T *Line_buffer<T>::next_row() {
+    T *slot = row(rows_pushed);
+    rows_pushed++;
+    return slot;
+}
+
+template <class T>
+T *Line_buffer<T>::row(int logical_row) const {
+    return const_cast<T *>(storage.data()) + (size_t)(logical_row % capacity) * row_length;
+}
+
+template <class T>
+bool Line_buffer<T>::contains(int logical_row) const {
+    return logical_row >= 0 && logical_row < rows_pushed && logical_row >= rows_pushed - capacity;
+}
+
+#endif //LINE_BUFFER_H
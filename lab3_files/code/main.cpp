@@ -1,10 +1,14 @@
 #include <iostream>
+#include <memory>
 #include "file_utils.h"
+#include "numeric_types.h"
 #include "stream_utils.h"
 #include "test.h"
 
-int main(int argc, char **argv) {
-    Test<int> *test = new Test<int>("./example_2/network_2"); // set benchmark
+// mode is "", "--forward", "--forward-fused" or "--stream-direct"
+template <class T>
+static int run(const std::string &model_path, const std::string &mode) {
+    std::unique_ptr<Test<T> > test(new Test<T>(model_path));
     test->initialize();
     test->generate_parameter_file();
 
@@ -25,5 +29,41 @@ int main(int argc, char **argv) {
     test->generate_matrix();
     test->generate_stream();
 
+    // --forward also runs the whole network, --forward-fused does the same
+    // with fused conv/maxpool chains and --stream-direct convolves every
+    // layer on its streamed input
+    if (mode == "--forward")
+        test->generate_output();
+    if (mode == "--forward-fused")
+        test->generate_output(true);
+    if (mode == "--stream-direct")
+        test->generate_stream_direct();
+
     return 0;
 }
+
+// ./main <model_path> [mode] [--type int|float|bf16|fp16]; bf16 and fp16
+// store every tensor in 16 bits and accumulate in fp32
+int main(int argc, char **argv) {
+    std::string model_path = argc > 1 ? argv[1] : "./example_2/network_2"; // set benchmark
+    std::string mode;
+    std::string type = "int";
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--type" && i + 1 < argc)
+            type = argv[++i];
+        else
+            mode = arg;
+    }
+
+    if (type == "int")
+        return run<int>(model_path, mode);
+    if (type == "float")
+        return run<float>(model_path, mode);
+    if (type == "bf16")
+        return run<bfloat16>(model_path, mode);
+    if (type == "fp16")
+        return run<float16>(model_path, mode);
+    std::cout << "unknown type " << type << ", expected int, float, bf16 or fp16" << std::endl;
+    return 1;
+}
@@ -0,0 +1,190 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cfg_parser.h"
+
+enum Tensor_kind {
+    TENSOR_ACTIVATION,
+    TENSOR_SCRATCH
+};
+
+// A tensor that lives in the arena from step first_use to step last_use
+// (inclusive). Step i is layer i; the network input is produced at step -1.
+struct Planned_tensor {
+    Tensor_kind kind;
+    int layer;
+    int first_use;
+    int last_use;
+    long long bytes;
+    long long offset;
+};
+
+// Static planner for whole-network inference. Every activation and every
+// per-layer scratch buffer (the im2col matrix of a conv) gets an offset in
+// one arena; tensors whose lifetimes do not overlap may share addresses.
+// Offsets are assigned greedily, largest tensor first, each at the lowest
+// offset that does not collide with an already placed, live-overlapping one.
+// A plan for a batch holds each tensor of every image back to back.
+class Memory_plan {
+public:
+    Memory_plan();
+
+    int plan(const std::vector<Layer_desc> &layers, int input_height, int input_width, int input_channel,
+             int element_size, int alignment = 64, int batch = 1);
+
+    long long getArena_size() const;
+    long long getUnshared_size() const;
+    const std::vector<Planned_tensor> &getTensors() const;
+
+    // index into getTensors(); layer -1 is the network input
+    int activation(int layer) const;
+    int scratch(int layer) const;
+
+    std::string describe() const;
+
+private:
+    void assign_offsets(int alignment);
+
+    std::vector<Planned_tensor> tensors;
+    std::vector<int> activation_index;
+    std::vector<int> scratch_index;
+    long long arena_size;
+};
+
+inline Memory_plan::Memory_plan() {
+    arena_size = 0;
+}
+
+inline int Memory_plan::plan(const std::vector<Layer_desc> &layers, int input_height, int input_width,
+                             int input_channel, int element_size, int alignment, int batch) {
+    tensors.clear();
+    activation_index.assign(layers.size() + 1, -1);
+    scratch_index.assign(layers.size(), -1);
+    arena_size = 0;
+
+    int steps = layers.size();
+
+    Planned_tensor input;
+    input.kind = TENSOR_ACTIVATION;
+    input.layer = -1;
+    input.first_use = -1;
+    input.last_use = steps > 0 ? 0 : -1;
+    input.bytes = (long long)input_height * input_width * input_channel * element_size * batch;
+    input.offset = 0;
+    activation_index[0] = tensors.size();
+    tensors.push_back(input);
+
+    for (int i = 0; i < steps; i++) {
+        const Layer_desc &layer = layers[i];
+
+        Planned_tensor output;
+        output.kind = TENSOR_ACTIVATION;
+        output.layer = i;
+        output.first_use = i;
+        // the last layer's output is the result and stays live to the end
+        output.last_use = (i + 1 < steps) ? i + 1 : steps;
+        output.bytes = (long long)layer.output_height * layer.output_width * layer.output_channel * element_size *
+                       batch;
+        output.offset = 0;
+        activation_index[i + 1] = tensors.size();
+        tensors.push_back(output);
+
+        // route and shortcut extend the lifetime of the layers they read
+        for (int from : layer.inputs) {
+            Planned_tensor &source = tensors[activation_index[from + 1]];
+            source.last_use = std::max(source.last_use, i);
+        }
+
+        if (layer.type == LAYER_CONVOLUTIONAL) {
+            Planned_tensor im2col;
+            im2col.kind = TENSOR_SCRATCH;
+            im2col.layer = i;
+            im2col.first_use = i;
+            im2col.last_use = i;
+            // a grouped conv's rows hold every group's window; a depthwise
+            // one (a single channel per group) runs without the matrix
+            bool depthwise = layer.groups == layer.input_channel && layer.groups > 1;
+            im2col.bytes = depthwise ? 0 : (long long)layer.output_height * layer.output_width * layer.conv.size_h *
+                                               layer.conv.size_w * layer.input_channel * element_size * batch;
+            im2col.offset = 0;
+            scratch_index[i] = tensors.size();
+            tensors.push_back(im2col);
+        }
+    }
+
+    assign_offsets(alignment);
+    return 0;
+}
+
+inline void Memory_plan::assign_offsets(int alignment) {
+    std::vector<int> order(tensors.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return tensors[a].bytes > tensors[b].bytes; });
+
+    std::vector<int> placed;
+    for (int index : order) {
+        Planned_tensor &tensor = tensors[index];
+
+        // address ranges of placed tensors that are live at the same time
+        std::vector<std::pair<long long, long long> > busy;
+        for (int other_index : placed) {
+            const Planned_tensor &other = tensors[other_index];
+            if (other.first_use <= tensor.last_use && tensor.first_use <= other.last_use)
+                busy.push_back(std::make_pair(other.offset, other.offset + other.bytes));
+        }
+        std::sort(busy.begin(), busy.end());
+
+        long long offset = 0;
+        for (const auto &range : busy) {
+            if (offset + tensor.bytes <= range.first) break;
+            if (range.second > offset)
+                offset = (range.second + alignment - 1) / alignment * alignment;
+        }
+        tensor.offset = offset;
+        arena_size = std::max(arena_size, offset + tensor.bytes);
+        placed.push_back(index);
+    }
+    arena_size = (arena_size + alignment - 1) / alignment * alignment;
+}
+
+inline long long Memory_plan::getArena_size() const {
+    return arena_size;
+}
+
+inline long long Memory_plan::getUnshared_size() const {
+    long long total = 0;
+    for (const Planned_tensor &tensor : tensors)
+        total += tensor.bytes;
+    return total;
+}
+
+inline const std::vector<Planned_tensor> &Memory_plan::getTensors() const {
+    return tensors;
+}
+
+inline int Memory_plan::activation(int layer) const {
+    return activation_index[layer + 1];
+}
+
+inline int Memory_plan::scratch(int layer) const {
+    return scratch_index[layer];
+}
+
+inline std::string Memory_plan::describe() const {
+    std::string text = "arena " + std::to_string(arena_size) + " bytes (" + std::to_string(getUnshared_size()) +
+                       " without reuse)\n";
+    for (const Planned_tensor &tensor : tensors) {
+        text += (tensor.kind == TENSOR_ACTIVATION ? "activation " : "scratch    ");
+        text += "layer " + std::to_string(tensor.layer) + " steps [" + std::to_string(tensor.first_use) + ", " +
+                std::to_string(tensor.last_use) + "] offset " + std::to_string(tensor.offset) + " bytes " +
+                std::to_string(tensor.bytes) + "\n";
+    }
+    return text;
+}
+
+#endif //MEMORY_PLANNER_H
@@ -0,0 +1,265 @@
+#ifndef MODEL_GENERATOR_H
+#define MODEL_GENERATOR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_utils.h"
+#include "network.h"
+
+// One [convolutional] or [maxpool] section of a generated cfg.
+struct Generated_layer {
+    bool maxpool;
+    int filters;
+    int size;
+    int stride;
+    int pad;
+};
+
+// Writes production-sized cfgs plus matching initial_input/initial_kernel
+// files. Every row is drawn from its own generator seeded by (seed, file,
+// row), so the output is identical for any thread count.
+template <class T>
+class Model_generator {
+public:
+    Model_generator(std::string model_path, int height, int width, int channels);
+
+    void default_architecture(int conv_layers);
+    int generate(unsigned long long seed, int threads, bool binary);
+
+    const std::vector<Generated_layer> &getLayers() const;
+    void setLayers(const std::vector<Generated_layer> &layers);
+
+private:
+    std::string cfg_contents() const;
+    int write_input(int layer_id, int padding, int stride, Network<T> &network);
+    int write_kernel(int layer_id, Network<T> &network);
+    int write_tensor(const std::string &file_name, const std::vector<int> &header, long long rows,
+                     long long row_length, unsigned long long stream_id);
+
+    std::string model_path;
+    int height;
+    int width;
+    int channels;
+    std::vector<Generated_layer> layers;
+
+    unsigned long long seed;
+    int threads;
+    bool binary;
+};
+
+// splitmix64, used both to derive per-row seeds and as the row generator
+static inline uint64_t generator_next(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+template <class T>
+Model_generator<T>::Model_generator(std::string model_path, int height, int width, int channels) {
+    this->model_path = model_path;
+    this->height = height;
+    this->width = width;
+    this->channels = channels;
+    seed = 0;
+    threads = 1;
+    binary = false;
+}
+
+// darknet-reference style backbone: 3x3 convs doubling the filters with a
+// 2x2 maxpool after each while the feature map is larger than 8x8, then
+// alternating 3x3/1x1 convs at the final resolution
+template <class T>
+void Model_generator<T>::default_architecture(int conv_layers) {
+    layers.clear();
+    int current = height < width ? height : width;
+    int filters = 16;
+    for (int i = 0; i < conv_layers; i++) {
+        bool reduce = current > 8;
+        Generated_layer conv;
+        conv.maxpool = false;
+        conv.filters = filters;
+        conv.size = (reduce || i % 2 == 0) ? 3 : 1;
+        conv.stride = 1;
+        conv.pad = 1;
+        layers.push_back(conv);
+
+        if (reduce) {
+            Generated_layer pool;
+            pool.maxpool = true;
+            pool.filters = 0;
+            pool.size = 2;
+            pool.stride = 2;
+            pool.pad = 0;
+            layers.push_back(pool);
+            current /= 2;
+            if (filters < 1024) filters *= 2;
+        } else {
+            filters = (conv.size == 3) ? filters / 2 : filters * 2;
+        }
+    }
+}
+
+template <class T>
+std::string Model_generator<T>::cfg_contents() const {
+    std::string cfg = "[net]\n";
+    cfg += "height=" + std::to_string(height) + "\n";
+    cfg += "width=" + std::to_string(width) + "\n";
+    cfg += "channels=" + std::to_string(channels) + "\n";
+
+    for (const Generated_layer &layer : layers) {
+        if (layer.maxpool) {
+            cfg += "\n[maxpool]\n";
+            cfg += "size=" + std::to_string(layer.size) + "\n";
+            cfg += "stride=" + std::to_string(layer.stride) + "\n";
+        } else {
+            cfg += "\n[convolutional]\n";
+            cfg += "batch_normalize=1\n";
+            cfg += "filters=" + std::to_string(layer.filters) + "\n";
+            cfg += "size=" + std::to_string(layer.size) + "\n";
+            cfg += "stride=" + std::to_string(layer.stride) + "\n";
+            cfg += "pad=" + std::to_string(layer.pad) + "\n";
+            cfg += "activation=leaky\n";
+        }
+    }
+    return cfg;
+}
+
+template <class T>
+int Model_generator<T>::generate(unsigned long long seed, int threads, bool binary) {
+    this->seed = seed;
+    this->threads = threads > 0 ? threads : 1;
+    this->binary = binary;
+
+    std::ofstream cfg_ofstream(model_path + ".cfg", std::ofstream::trunc);
+    if (!cfg_ofstream) {
+        printf("cannot write %s.cfg\n", model_path.c_str());
+        return -1;
+    }
+    cfg_ofstream << cfg_contents();
+    cfg_ofstream.close();
+
+    // shapes come from the regular cfg parser so they always agree with it
+    Network<T> network(model_path + ".cfg");
+    network.initialize();
+    network.obtain_parameters();
+
+    int layer_id = 0;
+    for (const Generated_layer &layer : layers) {
+        if (layer.maxpool) continue;
+        int padding = (layer.pad == 1) ? layer.size / 2 : 0;
+        if (write_input(layer_id, padding, layer.stride, network) != 0) return -1;
+        if (write_kernel(layer_id, network) != 0) return -1;
+        layer_id++;
+    }
+    return 0;
+}
+
+template <class T>
+int Model_generator<T>::write_input(int layer_id, int padding, int stride, Network<T> &network) {
+    std::string file_name = model_path + ".layer_" + std::to_string(layer_id) + ".initial_input";
+    int h = network.getInput_height()[layer_id];
+    int w = network.getInput_width()[layer_id];
+    int c = network.getInput_channel()[layer_id];
+
+    std::vector<int> header = {h, w, c, padding, stride};
+    return write_tensor(file_name, header, h, (long long)w * c, 2 * layer_id);
+}
+
+template <class T>
+int Model_generator<T>::write_kernel(int layer_id, Network<T> &network) {
+    std::string file_name = model_path + ".layer_" + std::to_string(layer_id) + ".initial_kernel";
+    int dimension = network.getKernel_dimension()[layer_id];
+    const Conv_params &conv = network.getConv_params()[layer_id];
+    int c = network.getKernel_channel()[layer_id];
+
+    std::vector<int> header = {dimension, conv.size_h, conv.size_w, c};
+    return write_tensor(file_name, header, dimension, (long long)conv.size_h * conv.size_w * c, 2 * layer_id + 1);
+}
+
+// values are 0-9 like Test::generate_input_kernel; in text each one is a
+// single digit and a space, so rows are formatted straight into char buffers
+template <class T>
+int Model_generator<T>::write_tensor(const std::string &file_name, const std::vector<int> &header, long long rows,
+                                     long long row_length, unsigned long long stream_id) {
+    long long row_bytes = binary ? row_length * (long long)sizeof(T) : row_length * 2 + 1;
+    std::vector<char> body(rows * row_bytes);
+
+    int workers = threads < rows ? threads : (int)rows;
+    if (workers < 1) workers = 1;
+    long long rows_per_worker = (rows + workers - 1) / workers;
+
+    auto fill_rows = [&](long long begin, long long end) {
+        for (long long r = begin; r < end; r++) {
+            uint64_t state = seed;
+            state ^= generator_next(state) + stream_id;
+            state ^= generator_next(state) + (uint64_t)r;
+            char *out = body.data() + r * row_bytes;
+            for (long long i = 0; i < row_length; i++) {
+                int value = (int)(generator_next(state) % 10);
+                if (binary) {
+                    T typed = (T)value;
+                    memcpy(out + i * sizeof(T), &typed, sizeof(T));
+                } else {
+                    out[2 * i] = (char)('0' + value);
+                    out[2 * i + 1] = ' ';
+                }
+            }
+            if (!binary) out[row_length * 2] = '\n';
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < workers; t++) {
+        long long begin = t * rows_per_worker;
+        long long end = begin + rows_per_worker < rows ? begin + rows_per_worker : rows;
+        if (begin < end) pool.push_back(std::thread(fill_rows, begin, end));
+    }
+    fill_rows(0, rows_per_worker < rows ? rows_per_worker : rows);
+    for (std::thread &worker : pool)
+        worker.join();
+
+    std::ofstream file_ofstream(file_name, std::ofstream::trunc | std::ofstream::binary);
+    if (!file_ofstream) {
+        printf("cannot write %s\n", file_name.c_str());
+        return -1;
+    }
+
+    if (binary) {
+        int header_count = header.size();
+        int element_size = sizeof(T);
+        int dtype = binary_dtype<T>();
+        file_ofstream.write(BINARY_TENSOR_MAGIC, sizeof(BINARY_TENSOR_MAGIC));
+        file_ofstream.write(reinterpret_cast<const char *>(&header_count), sizeof(int));
+        file_ofstream.write(reinterpret_cast<const char *>(header.data()), header_count * sizeof(int));
+        file_ofstream.write(reinterpret_cast<const char *>(&element_size), sizeof(int));
+        file_ofstream.write(reinterpret_cast<const char *>(&dtype), sizeof(int));
+    } else {
+        std::string header_line;
+        for (size_t i = 0; i < header.size(); i++) {
+            header_line += std::to_string(header[i]);
+            header_line += (i + 1 < header.size()) ? " " : "\n";
+        }
+        file_ofstream << header_line;
+    }
+    file_ofstream.write(body.data(), body.size());
+    file_ofstream.close();
+    return 0;
+}
+
+template <class T>
+const std::vector<Generated_layer> &Model_generator<T>::getLayers() const {
+    return layers;
+}
+
+template <class T>
+void Model_generator<T>::setLayers(const std::vector<Generated_layer> &layers) {
+    Model_generator::layers = layers;
+}
+
+#endif //MODEL_GENERATOR_H
@@ -1,13 +1,25 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <map>
+#include <new>
 
+#include "alloc_tracker.h"
+#include "cfg_parser.h"
+#include "conversion_plan.h"
 #include "file_utils.h"
+#include "huge_pages.h"
+#include "layer_kernels.h"
+#include "line_buffer.h"
+#include "memory_planner.h"
 #include "stream_utils.h"
 #include "array4d.h"
+#include "profiler.h"
+#include "sparse_matrix.h"
+#include "thread_pool.h"
 
 template <class T>
 class Network {
@@ -16,9 +28,37 @@ public:
     ~Network();
 
     int obtain_parameters();
+    // the padding/stride overloads keep the layer's kernel shape and dilation
+    // and apply padding to all four sides and stride to both axes; the
+    // Conv_params ones take the whole geometry
     int conv_convert(int layer_id, int padding, int stride, Array3D<T>& initial_input, Array4D<T>& initial_kernel,
              Array2D<T>& input_matrix, Array2D<T>& kernel_matrix);
+    int conv_convert(int layer_id, const Conv_params& conv, Array3D<T>& initial_input, Array4D<T>& initial_kernel,
+                     Array2D<T>& input_matrix, Array2D<T>& kernel_matrix);
     int conv_convert_stream(int layer_id, int padding, int stride, Stream<T>& input, Stream<T>& output);
+    int conv_convert_stream(int layer_id, const Conv_params& conv, Stream<T>& input, Stream<T>& output);
+    // like conv_convert_stream, but each window is multiplied by the kernel in
+    // the line buffer and only the activated output (h, w, filter) is written
+    int conv_direct_stream(int layer_id, int padding, int stride, Stream<T>& input, Array4D<T>& kernel,
+                           Stream<T>& output);
+    int conv_direct_stream(int layer_id, const Conv_params& conv, Stream<T>& input, Array4D<T>& kernel,
+                           Stream<T>& output);
+    // the geometry the padding/stride overloads run layer layer_id with
+    Conv_params conv_geometry(int layer_id, int padding, int stride) const;
+
+    int load_weights(std::vector<Array4D<T> >& kernels);
+    // kernel_matrix of conv layer layer_id as packed[depth][filters]
+    int pack_kernel(int layer_id, Array4D<T>& kernel, std::vector<T>& packed);
+    int forward(Array3D<T>& input, Array3D<T>& output);
+    int forward_fused(Array3D<T>& input, Array3D<T>& output);
+    // forward on flat h x w x c buffers of getNet_input_size() and
+    // getNet_output_size() values; nothing is allocated after the first call
+    int forward(const T *input, T *output, bool fused = false);
+    // batch images back to back in input and output; each conv layer runs
+    // one gemm over the im2col rows of the whole batch
+    int forward_batch(const T *input, T *output, int batch);
+    // plans the arena for batches of up to batch images ahead of forward_batch
+    int reserve_batch(int batch);
 
     void initialize();
     std::string get_parameters();
@@ -32,6 +72,7 @@ public:
 
     const std::vector<int> &getKernel_dimension() const;
     void setKernel_dimension(const std::vector<int>& kernel_dimension);
+    // kernel height; getConv_params has the width, dilation and padding
     const std::vector<int> &getKernel_size() const;
     void setKernel_size(const std::vector<int> &kernel_size);
     const std::vector<int> &getKernel_channel() const;
@@ -47,7 +88,74 @@ public:
     int getLayer_number() const;
     void setLayer_number(int layer_number);
 
+    const std::vector<int> &getPaddings() const;
+    const std::vector<int> &getStrides() const;
+    // full geometry per conv layer; networks set up by hand without it get
+    // square, undilated kernels of getKernel_size
+    const std::vector<Conv_params> &getConv_params() const;
+    void setConv_params(const std::vector<Conv_params> &conv_params);
+    const std::vector<Layer_desc> &getLayers() const;
+    const Memory_plan &getMemory_plan() const;
+    long long getNet_input_size() const;
+    long long getNet_output_size() const;
+    // conv_convert and forward split their conv work over the pool; NULL runs serially
+    Thread_pool *getThread_pool() const;
+    // a pool pinned across NUMA nodes also gets one copy of the dense
+    // kernels per node, placed by a thread on that node
+    void setThread_pool(Thread_pool *thread_pool);
+    // copies of the packed kernels, one per node of the pool (0 without)
+    int getKernel_replicas() const { return node_kernels.size(); }
+    // 2 MB pages for the forward arena; takes effect at the next forward
+    Huge_page_mode getHuge_pages() const { return huge_pages; }
+    void setHuge_pages(Huge_page_mode huge_pages);
+    // what the current arena got: HUGE_PAGES_OFF for plain pages
+    Huge_page_mode getArena_backing() const { return arena_backing; }
+    // dense or CSR kernel_matrix per conv layer; takes effect at load_weights
+    Sparse_mode getSparse_mode() const;
+    void setSparse_mode(Sparse_mode sparse_mode);
+    bool isSparse_layer(int layer_id) const;
+    // groups == input channels: one input channel per filter, run without im2col
+    bool isDepthwise_layer(int layer_id) const;
+    // im2col gather tables, built on the first forward of each shape and
+    // cached per shape; shared by conv_convert and forward
+    Conversion_cache &getConversion_cache();
+
 private:
+    // one layer of a fused run: its last `size` input rows and the im2col
+    // matrix of a single output row
+    struct Fused_stage {
+        int layer;
+        int next_row;
+        Line_buffer<T> rows;
+        std::vector<T> matrix;
+        std::vector<const T *> window;   // depthwise: the input row of each kernel row
+    };
+    // kernel heights run_depthwise keeps its row pointers on the stack for
+    static const int DEPTHWISE_STACK_ROWS = 16;
+
+    template <class Row>
+    void stream_rows(int layer_id, const Conv_params& conv, Stream<T>& input, Row output_row);
+    const std::string &conv_activation(int layer_id) const;
+
+    void place_weights();
+    void free_arena();
+    const T *dense_kernel(int layer_id) const;
+    void conv_gemm(int layer_id, const T *matrix, T *out, int depth, int filters, long long row_begin,
+                   long long row_end, int col_begin, int col_end);
+    T *arena_tensor(int index);
+    int check_forward(int height, int width, int channel);
+    int begin_forward(Array3D<T>& input);
+    void end_forward(Array3D<T>& output);
+    int run_forward(bool fused, int batch = 1);
+    int run_layer(int i, int batch = 1);
+    void run_depthwise(int i, const T *in, T *out, int batch);
+    const Conversion_plan *layer_plan(int i);
+    bool fusable(int i) const;
+    int window_top(const Layer_desc &layer, int r) const;
+    int window_rows(const Layer_desc &layer) const;
+    void run_fused(int first, int last);
+    void fused_row(std::vector<Fused_stage> &stages, int s, const T *source, T *dst);
+
     int layer_number;
 
     std::vector<int> input_height;
@@ -62,14 +170,55 @@ private:
     std::vector<int> output_width;
     std::vector<int> output_channel;
 
+    // cfg padding and stride of each conv layer (top / vertical for
+    // asymmetric ones), its full geometry, and the full layer IR
+    std::vector<int> paddings;
+    std::vector<int> strides;
+    std::vector<Conv_params> conv_params;
+    std::vector<Layer_desc> layers;
+    std::vector<int> conv_index;            // layer -> conv number, -1 otherwise
+
+    // whole-network inference: packed kernel_matrix per conv layer and one
+    // arena laid out by memory_plan
+    int net_height, net_width, net_channel;
+    Memory_plan memory_plan;
+    int planned_batch;
+    std::vector<std::vector<T> > packed_kernels;
+    std::vector<Csr_matrix<T> > sparse_kernels;   // empty (0 rows) for dense layers
+    std::vector<std::vector<std::vector<T> > > node_kernels;   // [node][layer], see place_weights
+    Sparse_mode sparse_mode;
+    char *arena;
+    long long arena_bytes;
+    Huge_page_mode huge_pages;
+    bool arena_mapped;              // from huge_page_alloc rather than operator new
+    Huge_page_mode arena_backing;
+    Conversion_cache conversions;
+    std::vector<const Conversion_plan *> layer_plans;   // per layer, NULL until its first forward
+    // fused runs: which layers a route/shortcut reads, and each run's stages
+    // by its first layer, kept so a repeated forward_fused does not reallocate
+    std::vector<bool> referenced;
+    std::vector<std::vector<Fused_stage> > fused_stages;
+
+    Thread_pool *thread_pool;
+
     std::string cfg_file_name;
     File_utils<T> *cfg_util;
-    std::vector<std::string> network_cfg_description;
 };
 
 template <class T>
 Network<T>::Network(std::string cfg_file_name) {
     this->cfg_file_name = cfg_file_name;
+    layer_number = 0;
+    cfg_util = NULL;
+    net_height = net_width = net_channel = 0;
+    arena = NULL;
+    arena_bytes = 0;
+    huge_pages = HUGE_PAGES_OFF;
+    arena_mapped = false;
+    arena_backing = HUGE_PAGES_OFF;
+    planned_batch = 1;
+    thread_pool = NULL;
+    sparse_mode = SPARSE_AUTO;
 }
 
 template <class T>
@@ -87,6 +236,7 @@ Network<T>::~Network() {
     output_channel.clear();
 
     delete(cfg_util);
+    free_arena();
 }
 
 template <class T>
@@ -95,11 +245,17 @@ void Network<T>::initialize() {
     cfg_util->parse_file();
 }
 
+// one line per conv layer: input h w c, filters, kernel size, kernel
+// channels, output h w c. A non-square or dilated kernel writes its size as
+// "size_h size_w" and appends "dilation_h dilation_w"; square, undilated
+// layers keep the original nine fields.
 template<class T>
 std::string Network<T>::get_parameters() {
     std::string parameters = std::to_string(layer_number);
     parameters += "\n";
     for (int i = 0; i < layer_number; i++) {
+        Conv_params conv = conv_geometry(i, 0, 1);
+        bool plain = conv.size_h == conv.size_w && conv.dilation_h == 1 && conv.dilation_w == 1;
         parameters += std::to_string(input_height[i]);
         parameters += " ";
         parameters += std::to_string(input_width[i]);
@@ -109,8 +265,12 @@ std::string Network<T>::get_parameters() {
 
         parameters += std::to_string(kernel_dimension[i]);
         parameters += " ";
-        parameters += std::to_string(kernel_size[i]);
+        parameters += std::to_string(conv.size_h);
         parameters += " ";
+        if (!plain) {
+            parameters += std::to_string(conv.size_w);
+            parameters += " ";
+        }
         parameters += std::to_string(kernel_channel[i]);
         parameters += " ";
 
@@ -120,6 +280,12 @@ std::string Network<T>::get_parameters() {
         parameters += " ";
         parameters += std::to_string(output_channel[i]);
         parameters += " ";
+        if (!plain) {
+            parameters += std::to_string(conv.dilation_h);
+            parameters += " ";
+            parameters += std::to_string(conv.dilation_w);
+            parameters += " ";
+        }
         parameters += "\n";
     }
     return parameters;
@@ -226,6 +392,90 @@ void Network<T>::setLayer_number(int layer_number) {
     Network::layer_number = layer_number;
 }
 
+template<class T>
+const std::vector<int> &Network<T>::getPaddings() const {
+    return paddings;
+}
+
+template<class T>
+const std::vector<int> &Network<T>::getStrides() const {
+    return strides;
+}
+
+template<class T>
+const std::vector<Conv_params> &Network<T>::getConv_params() const {
+    return conv_params;
+}
+
+template<class T>
+void Network<T>::setConv_params(const std::vector<Conv_params> &conv_params) {
+    Network::conv_params = conv_params;
+}
+
+template<class T>
+const std::vector<Layer_desc> &Network<T>::getLayers() const {
+    return layers;
+}
+
+template<class T>
+const Memory_plan &Network<T>::getMemory_plan() const {
+    return memory_plan;
+}
+
+template<class T>
+long long Network<T>::getNet_input_size() const {
+    return (long long)net_height * net_width * net_channel;
+}
+
+template<class T>
+long long Network<T>::getNet_output_size() const {
+    if (layers.empty()) return 0;
+    const Layer_desc &last = layers.back();
+    return (long long)last.output_height * last.output_width * last.output_channel;
+}
+
+template<class T>
+Thread_pool *Network<T>::getThread_pool() const {
+    return thread_pool;
+}
+
+template<class T>
+void Network<T>::setHuge_pages(Huge_page_mode huge_pages) {
+    free_arena();
+    Network::huge_pages = huge_pages;
+}
+
+template<class T>
+void Network<T>::setThread_pool(Thread_pool *thread_pool) {
+    Network::thread_pool = thread_pool;
+    place_weights();
+}
+
+template<class T>
+Sparse_mode Network<T>::getSparse_mode() const {
+    return sparse_mode;
+}
+
+template<class T>
+void Network<T>::setSparse_mode(Sparse_mode sparse_mode) {
+    Network::sparse_mode = sparse_mode;
+}
+
+template<class T>
+bool Network<T>::isSparse_layer(int layer_id) const {
+    return layer_id < (int)sparse_kernels.size() && sparse_kernels[layer_id].getRows() > 0;
+}
+
+template<class T>
+bool Network<T>::isDepthwise_layer(int layer_id) const {
+    return kernel_channel[layer_id] == 1 && input_channel[layer_id] > 1;
+}
+
+template<class T>
+Conversion_cache &Network<T>::getConversion_cache() {
+    return conversions;
+}
+
 /***************************************************************/
 /* Do not modify the above code.
    You are allowed to use the following global variables in your
@@ -236,8 +486,8 @@ void Network<T>::setLayer_number(int layer_number) {
 
 template <class T>
 int Network<T>::obtain_parameters() {
-    network_cfg_description = cfg_util->getFile_contents();
-
+    PROFILE_SCOPE("cfg_parse");
+    ALLOC_TAG("network");
     layer_number = 0;
 
     input_height.clear();
@@ -251,142 +501,85 @@ int Network<T>::obtain_parameters() {
     output_height.clear();
     output_width.clear();
     output_channel.clear();
+
+    paddings.clear();
+    strides.clear();
+    conv_params.clear();
+    layers.clear();
+    conv_index.clear();
+    conversions.clear();
+    layer_plans.clear();
+    fused_stages.clear();
     /* Part I */
-    /* Write your code here */
 
-    //VARIABLES
-    std::string curr_layer;
-    int layertype = 0;
-    int current_height = 0;
-    int current_width = 0;
-    int current_channels = 0;
-    int filters = -1;
-    int size = -1;
-    int stride = -1;
-    int pad = -1;
-    
-    std::map<std::string, std::string> params;
-    for (const auto& str : network_cfg_description) {
-        //DEBUG print statements
-        //std::cout << str << " ";
-        //std::cout << std::endl;
-        
-        if(str == "[net]"){
-            layertype = 1;
-//            printf("\nbegin parsing [net] layer\n");
-            continue;
-        }
-        else if(str == "[convolutional]"){
-            layer_number++;
-//            printf("begin parsing [conv] layer, %d and counting\n", layer_number);
-            layertype = 2;
-            continue;
-        }
-        else if(str == "[maxpool]"){
-            layertype = 3;
-//            printf("begin parsing [pooling] layer\n");
-            continue;
-        }
-        else{
-            //printf("entering a layer\n");
-            // Parse key=value pairs
-            size_t eq_pos = str.find('=');
-            if (eq_pos != std::string::npos) {
-                std::string key = str.substr(0, eq_pos);
-                std::string value = str.substr(eq_pos + 1);
-                params[key] = value;
-                
-                if(key == "filters"){
-                    filters = std::stoi(value);
-                }
-                if(key == "size"){
-                    size = std::stoi(value);
-                }
-                if(key == "stride"){
-                    stride = std::stoi(value);
-                }
-                if(key == "pad"){
-                    pad = std::stoi(value);
-                }
+    Cfg_parser parser;
+    if (parser.parse_file(cfg_file_name) != 0) {
+        printf("%s\n", parser.getError().c_str());
+        return -1;
+    }
+    layers = parser.getLayers();
+    layer_plans.assign(layers.size(), NULL);
+    // a layer read by a later route/shortcut has to be materialised
+    referenced.assign(layers.size(), false);
+    for (const Layer_desc &layer : layers)
+        for (int from : layer.inputs)
+            if (from >= 0) referenced[from] = true;
+    fused_stages.resize(layers.size());
+    net_height = parser.getInput_height();
+    net_width = parser.getInput_width();
+    net_channel = parser.getInput_channel();
+    memory_plan.plan(layers, net_height, net_width, net_channel, sizeof(T));
+    planned_batch = 1;
+    free_arena();
+
+    // the per-layer vectors describe the convolutional layers only; pooling
+    // and the other sections just change the shape the next conv sees
+    for (const Layer_desc &layer : layers) {
+        conv_index.push_back(layer.type == LAYER_CONVOLUTIONAL ? layer_number : -1);
+        if (layer.type != LAYER_CONVOLUTIONAL) continue;
+
+        input_height.push_back(layer.input_height);
+        input_width.push_back(layer.input_width);
+        input_channel.push_back(layer.input_channel);
+        kernel_dimension.push_back(layer.filters);
+        kernel_size.push_back(layer.size);
+        kernel_channel.push_back(layer.input_channel / layer.groups);
+        output_height.push_back(layer.output_height);
+        output_width.push_back(layer.output_width);
+        output_channel.push_back(layer.output_channel);
+        paddings.push_back(layer.padding);
+        strides.push_back(layer.stride);
+        conv_params.push_back(layer.conv);
+        layer_number++;
+    }
 
-                if(layertype == 1){
-                    if (key == "height") {
-                        current_height = std::stoi(value);
-                    } else if (key == "width") {
-                        current_width = std::stoi(value);
-                    } else if (key == "channels") {
-                        current_channels = std::stoi(value);
-                    }
-                }
-            }
-            if(layertype == 2){
-                //DEBUG PRINT STATEMENTS
-                /*
-                printf("current_height = %d\n", current_height);
-                printf("current_width = %d\n", current_width);
-                printf("current_channel = %d\n", current_channels);
-                */
-//                printf("%d %d %d %d %d %d\n", filters, size, stride, pad, current_height, current_width);
-                //layer_number = layer_number +2;
-               
-                /*
-                int filters = std::stoi(params["filters"]);
-                int size = std::stoi(params["size"]);
-                int stride = std::stoi(params["stride"]);
-                int pad = std::stoi(params["pad"]);
-                */
-                if(pad > -1){
-                    int actualpad = (pad == 1) ? size/2 : 0;
-                    int outH = (current_height+2*actualpad-size)/stride+1;
-                    int outW = (current_width+2*actualpad-size)/stride+1;
-    
-                    input_height.push_back(current_height);
-                    input_width.push_back(current_width);
-                    input_channel.push_back(current_channels);
-                    kernel_dimension.push_back(filters);
-                    kernel_size.push_back(size);
-                    kernel_channel.push_back(current_channels);
-//                    printf("%d %d %d %d\n", current_height, current_width, outH, outW);
-                    output_height.push_back(outH);
-                    output_width.push_back(outW);
-                    output_channel.push_back(filters);
-                    
-                    current_height = outH;
-                    current_width = outW;
-                    current_channels = filters;
-
-                    filters = -1;
-                    size = -1;
-                    stride = -1;
-                    pad = -1;
-                }
-                else{
-//                    printf("not done parsing conv layer yet\n");
-                }
-            }
-            if(layertype == 3){
-                if(stride > -1){
-                    int actualpad = 0;
-                    int outH = (current_height+2*actualpad-size)/stride+1;
-                    int outW = (current_width+2*actualpad-size)/stride+1;
-                    //output_height.push_back(outH);
-                    //output_width.push_back(outW);
-                    current_height = outH;
-                    current_width = outW;        
-                }
-            }
-            if(layertype == 0){
-                printf("empty file/unable to parse layers\n");
-            }
-        }
+    if (layer_number == 0) {
+        printf("%s: no convolutional layers\n", cfg_file_name.c_str());
     }
-    
     return 0;
 }
 
+// the layer's kernel and dilation with the same padding on every side and
+// the same stride on both axes
+template <class T>
+Conv_params Network<T>::conv_geometry(int layer_id, int padding, int stride) const {
+    Conv_params conv =
+        layer_id < (int)conv_params.size() ? conv_params[layer_id] : Conv_params(kernel_size[layer_id]);
+    conv.set_padding(padding);
+    conv.stride_h = conv.stride_w = stride;
+    return conv;
+}
+
 template <class T>
 int Network<T>::conv_convert(int layer_id, int padding, int stride, Array3D<T>& initial_input, Array4D<T>& initial_kernel,
                               Array2D<T>& input_matrix, Array2D<T>& kernel_matrix) {
+    return conv_convert(layer_id, conv_geometry(layer_id, padding, stride), initial_input, initial_kernel,
+                        input_matrix, kernel_matrix);
+}
+
+template <class T>
+int Network<T>::conv_convert(int layer_id, const Conv_params& conv, Array3D<T>& initial_input,
+                             Array4D<T>& initial_kernel, Array2D<T>& input_matrix, Array2D<T>& kernel_matrix) {
     /* Part II */
     /*Write your code here*/
     
@@ -408,90 +601,88 @@ int Network<T>::conv_convert(int layer_id, int padding, int stride, Array3D<T>&
 
     int filters = initial_kernel.Size_4d();
     int kernel_height = initial_kernel.Size_3d();
-    int kernel_width = initial_kernel.Size_2d(); //I think it doesn't matter here which one I use since height and width is the same b/c square kernel
-    int kernel_channel = initial_kernel.Size_1d(); //should be the same as input_channel
+    int kernel_width = initial_kernel.Size_2d();
+    int kernel_channel = initial_kernel.Size_1d(); //input_channel / groups
 
-    if(kernel_channel != input_channel){
+    // a grouped conv's kernels see input_channel / groups channels each
+    if(kernel_channel <= 0 || input_channel % kernel_channel != 0 ||
+       filters % (input_channel / kernel_channel) != 0){
         printf("kernel channels does not match input channels\n");
         return -1;
     }
-    if(kernel_width != kernel_height){
-        printf("kernel is not square, not supported\n");
+    int groups = input_channel / kernel_channel;
+    if(kernel_height != conv.size_h || kernel_width != conv.size_w){
+        printf("kernel is %dx%d, the layer expects %dx%d\n", kernel_height, kernel_width, conv.size_h, conv.size_w);
         return -1;
     }
    
-    int output_width = (input_width + 2 * padding - kernel_width) / stride + 1;
-    int output_height = (input_height + 2 * padding - kernel_height) / stride + 1;
-
-    if(output_width <= 0 || output_height <= 0){
+    // the gather table for this shape, built on the first call; it already
+    // says which window positions fall in the padding, so no padded copy
+    const Conversion_plan *plan = conversions.find(Conversion_key(input_height, input_width, input_channel, groups,
+                                                                  conv));
+    if(!plan){
         printf("invalid output dimension");
         return -1;
     }
+    int output_width = plan->getOutput_width();
+    int output_height = plan->getOutput_height();
     
-    //pad the 3d input
-    int padded_ow = input_width + padding*2;
-    int padded_oh = input_height + padding*2;
-    Array3D<T> padded_ii(padded_oh, padded_ow, input_channel);
-//    printf("(%d %d) ", input_width, input_height);
-//   printf("(%d %d)\n", padded_ow, padded_oh);
-
-    //zero out the array first otherwise I get shit like -1170624351
-    //channel -> width -> height
-    for (int c = 0; c < input_channel; c++) {
-        for (int w = 0; w < padded_ow; w++) {
-            for (int h = 0; h < padded_oh; h++) {
-//                printf("(%d, %d, %d)\n", h, w, c);
-                padded_ii[h][w][c] = 0;
-            }
-        }
-    }
-
-    //copy elements over
-    //channel -> width -> height
-    for (int h = 0; h < input_height; h++) {
-        for (int w = 0; w < input_width; w++) {
-            for (int c = 0; c < input_channel; c++) {
-//                printf("(%d, %d, %d)\n", h, w, c);
-                padded_ii[h+padding][w+padding][c] = initial_input[h][w][c];
-
-            }
-        }
-    }
-    
-    //input and kernel matrix dimensions
-    int width = kernel_height * kernel_height * input_channel;
+    //input and kernel matrix dimensions; with groups each input_matrix row is
+    //the windows of every group in turn and kernel_matrix only holds one
+    //group's depth, group g's filters multiplying group g's part of the row
+    int width = kernel_height * kernel_width * input_channel;
+    int group_width = kernel_height * kernel_width * kernel_channel;
     int height = output_width * output_height;
     /*
     printf("output width: %d output height: %d\n", output_width, output_height);
-    printf("padded output width: %d padded output height: %d\n", padded_ow, padded_oh);
     printf("output matrix width: %d output matrix height: %d\n", width, height);
     printf("kernel_matrix dimensions(%d, %d)\n", width, filters);
     */
     input_matrix.resize(height, width);
     //kernel_matrix.resize(filters, width);
-    kernel_matrix.resize(width, filters);
+    kernel_matrix.resize(group_width, filters);
     
     // //Construct input_matrix
-    int col = 0;
-    for (int h_out = 0; h_out < output_height; h_out++) {
-        for (int w_out = 0; w_out < output_width; w_out++) {
-            int row = 0;
-            
-            for (int h = 0; h < kernel_height; h++) {
-                for (int w = 0; w < kernel_height; w++) {
-                    for (int c = 0; c < input_channel; c++) {
-                        int h_in = h_out * stride + h;
-                        int w_in = w_out * stride + w;
-                        input_matrix[col][row] = padded_ii[h_in][w_in][c];
-                        row++;
+    // output rows are independent, so they go to the thread pool when there is one
+    {
+    PROFILE_SCOPE("im2col");
+    auto fill_rows = [&](long long first_h, long long last_h) {
+        for (int h_out = first_h; h_out < last_h; h_out++) {
+            const int *in_rows = plan->input_row(h_out);
+            for (int w_out = 0; w_out < output_width; w_out++) {
+                const int *in_cols = plan->input_col(w_out);
+                Array1D<T> &matrix_row = input_matrix[h_out * output_width + w_out];
+                int row = 0;
+
+                for (int g = 0; g < groups; g++) {
+                    for (int h = 0; h < kernel_height; h++) {
+                        for (int w = 0; w < kernel_width; w++) {
+                            //-1 marks padding
+                            if (in_rows[h] < 0 || in_cols[w] < 0) {
+                                for (int c = 0; c < kernel_channel; c++)
+                                    matrix_row[row++] = 0;
+                                continue;
+                            }
+                            Array1D<T> &pixel = initial_input[in_rows[h]][in_cols[w]];
+                            for (int c = g * kernel_channel; c < (g + 1) * kernel_channel; c++) {
+                                matrix_row[row] = pixel[c];
+                                row++;
+                            }
+                        }
                     }
                 }
             }
-            col++;
         }
+    };
+    if (thread_pool)
+        thread_pool->parallel_for(0, output_height, 1, fill_rows);
+    else
+        fill_rows(0, output_height);
     }
 
     // Construct kernel_matrix
+    {
+    PROFILE_SCOPE("kernel_matrix");
     for (int i = 0; i < filters; i++) {
         int idx = 0;
         for (int h = 0; h < kernel_height; h++) {
@@ -504,115 +695,725 @@ int Network<T>::conv_convert(int layer_id, int padding, int stride, Array3D<T>&
             }
         }
     }
+    }
 
     return 0;
 }
 
 
+// Feeds the padded input rows through a line buffer as tall as one dilated
+// window and calls output_row(buffer, top) once per output row, top being
+// the logical index of that row's first padded input row; kernel row kr is
+// buffer row top + kr * dilation_h.
 template <class T>
-int Network<T>::conv_convert_stream(int layer_id, int padding, int stride, Stream<T> &input, Stream<T> &output) {
-    int buffer_size = (input_width[layer_id] + padding * 2) * input_channel[layer_id] * kernel_size[layer_id];
-    T buffer[buffer_size];
-    /* Part III */
-    /*Write your code here*/
-
+template <class Row>
+void Network<T>::stream_rows(int layer_id, const Conv_params &conv, Stream<T> &input, Row output_row) {
     //VARIABLES
     int input_w = input_width[layer_id];
     int input_h = input_height[layer_id];
     int input_c = input_channel[layer_id];
-    int kernel_sz = kernel_size[layer_id];
-    int padded_w = input_w + padding*2;
-    int padded_h = input_h + padding*2;
-
-    int output_w = (padded_w - kernel_sz)/stride + 1;
-    int output_h = (padded_h - kernel_sz)/stride + 1;
-    
-    //printf("%d, %d, %d, %d\n", input_w, input_h, input_c, kernel_sz);
+    int window_h = conv.extent_h();
+    int padded_w = input_w + conv.pad_left + conv.pad_right;
 
-    /*
-    printf("%d %d %d %d\n", input_w, input_h, input_c, kernel_sz);
-    printf("(%d, %d)\n", padded_w, padded_h);
-    printf("(%d, %d)\n", output_w, output_h);
-    */
+    int output_h = conv.output_height(input_h);
 
-    //init
+    // the last window_h padded rows; rows and columns outside the input are zeros
+    Line_buffer<T> buffer(window_h, padded_w * input_c);
+    long long line_buffer_shifts = 0;
     int current_padded_row = 0;
-    for (int r = 0; r < kernel_sz; r++) {
-        if (current_padded_row < padding || current_padded_row >= (padding + input_h)) {
-            for (int i = 0; i < padded_w * input_c; i++) {
-                buffer[r * padded_w * input_c + i] = 0;
-            }
+    auto load_row = [&]() {
+        T *row = buffer.next_row();
+        if (current_padded_row < conv.pad_top || current_padded_row >= (conv.pad_top + input_h)) {
+            for (int i = 0; i < padded_w * input_c; i++)
+                row[i] = 0;
         } else {
-            for (int i = 0; i < padding * input_c; i++) {
-                buffer[r * padded_w * input_c + i] = 0;
-            }
-            for (int i = 0; i < input_w * input_c; i++) {
-                if (!input.empty())
-                    buffer[r * padded_w * input_c + padding * input_c + i] = input.read();
-                    //printf("input: %d\n", buffer[r * padded_w * input_c + padding * input_c + i]);
-                else
-                    buffer[r * padded_w * input_c + padding * input_c + i] = 0;
-            }
-            for (int i = padding * input_c + input_w * input_c; i < padded_w * input_c; i++) {
-                buffer[r * padded_w * input_c + i] = 0;
-            }
+            for (int i = 0; i < conv.pad_left * input_c; i++)
+                row[i] = 0;
+            for (int i = 0; i < input_w * input_c; i++)
+                row[conv.pad_left * input_c + i] = input.empty() ? (T)0 : input.read();
+            for (int i = (conv.pad_left + input_w) * input_c; i < padded_w * input_c; i++)
+                row[i] = 0;
         }
         current_padded_row++;
-    }
+    };
+
+    //init
+    for (int r = 0; r < window_h; r++)
+        load_row();
 
-    //current window
     for (int i = 0; i < output_h; i++) {//Vertical
+        output_row(buffer, buffer.getRows_pushed() - window_h);
+        //slide down to next window
+        if (i < output_h - 1) {
+            for (int s = 0; s < conv.stride_h; s++) {
+                load_row();
+                line_buffer_shifts++;
+            }
+        }
+    }
+    PROFILE_COUNT("line_buffer_shift", line_buffer_shifts);
+    (void)line_buffer_shifts;
+}
+
+template <class T>
+int Network<T>::conv_convert_stream(int layer_id, int padding, int stride, Stream<T> &input, Stream<T> &output) {
+    return conv_convert_stream(layer_id, conv_geometry(layer_id, padding, stride), input, output);
+}
+
+template <class T>
+int Network<T>::conv_convert_stream(int layer_id, const Conv_params &conv, Stream<T> &input, Stream<T> &output) {
+    /* Part III */
+    /*Write your code here*/
+    int input_c = input_channel[layer_id];
+    int group_c = kernel_channel[layer_id];
+    int output_w = conv.output_width(input_width[layer_id]);
+
+    stream_rows(layer_id, conv, input, [&](const Line_buffer<T> &buffer, int top) {
+        //current window, group by group like conv_convert
         for (int j = 0; j < output_w; j++) {//Horizontal
-            int col_base = j * stride;
-            for (int kr = 0; kr < kernel_sz; kr++) {
-                for (int kc = 0; kc < kernel_sz; kc++) {
-                    for (int ch = 0; ch < input_c; ch++) {
-                        int index = kr * padded_w * input_c + ((col_base + kc) * input_c) + ch;
-                        T value = buffer[index];
-                        //printf("current buffer value: %d\n", buffer[index]);
-                        output.write(value);
+            int col_base = j * conv.stride_w;
+            for (int g = 0; g < input_c; g += group_c) {
+                for (int kr = 0; kr < conv.size_h; kr++) {
+                    const T *line = buffer.row(top + kr * conv.dilation_h);
+                    for (int kc = 0; kc < conv.size_w; kc++) {
+                        const T *pixel = line + (col_base + kc * conv.dilation_w) * input_c;
+                        for (int ch = g; ch < g + group_c; ch++) {
+                            output.write(pixel[ch]);
+                        }
                     }
                 }
             }
         }
-        //slide down to next window
-        if (i < output_h - 1) {
-            for (int s = 0; s < stride; s++) {
-                for (int r = 0; r < kernel_sz - 1; r++) {
-                    for (int c = 0; c < padded_w * input_c; c++) {
-                        buffer[r * padded_w * input_c + c] = buffer[(r + 1) * padded_w * input_c + c];
-                    }
-                }
-                if (current_padded_row < padded_h) {
-                    if (current_padded_row < padding || current_padded_row >= (padding + input_h)) {
-                        for (int i = 0; i < padded_w * input_c; i++) {
-                            buffer[(kernel_sz-1) * padded_w * input_c + i] = 0;
-                        }
+    });
+    return 0;
+}
+
+template <class T>
+int Network<T>::conv_direct_stream(int layer_id, int padding, int stride, Stream<T> &input, Array4D<T> &kernel,
+                                   Stream<T> &output) {
+    return conv_direct_stream(layer_id, conv_geometry(layer_id, padding, stride), input, kernel, output);
+}
+
+// Within one padded row an undilated window spans size_w * channel
+// consecutive values, so kernel row kr of a whole output row is a gemm of the
+// line buffer row (windows stride_w * channel apart) against kernel_matrix
+// rows [kr * size_w * channel, (kr + 1) * size_w * channel). Nothing is
+// expanded. Grouped or horizontally dilated convs do that per window column
+// (and group), over the group's channels only; a depthwise one sums its
+// windows with depthwise_row.
+template <class T>
+int Network<T>::conv_direct_stream(int layer_id, const Conv_params &conv, Stream<T> &input, Array4D<T> &kernel,
+                                   Stream<T> &output) {
+    if (kernel.Size_3d() != conv.size_h || kernel.Size_2d() != conv.size_w) {
+        printf("kernel is %dx%d, the layer expects %dx%d\n", kernel.Size_3d(), kernel.Size_2d(), conv.size_h,
+               conv.size_w);
+        return -1;
+    }
+    std::vector<T> packed;
+    if (pack_kernel(layer_id, kernel, packed) != 0) return -1;
+
+    int input_c = input_channel[layer_id];
+    int group_c = kernel_channel[layer_id];
+    int groups = input_c / group_c;
+    int filters = kernel_dimension[layer_id];
+    int group_filters = filters / groups;
+    int output_w = conv.output_width(input_width[layer_id]);
+    int span = conv.size_w * input_c;
+    const std::string &activation = conv_activation(layer_id);
+
+    if (isDepthwise_layer(layer_id)) {
+        // the buffer rows already hold the left and right padding
+        Conv_params padded = conv;
+        padded.pad_left = 0;
+        int padded_w = input_width[layer_id] + conv.pad_left + conv.pad_right;
+        std::vector<const T *> rows(conv.size_h);
+        std::vector<T> row_output((long long)output_w * filters);
+        stream_rows(layer_id, conv, input, [&](const Line_buffer<T> &buffer, int top) {
+            for (int kr = 0; kr < conv.size_h; kr++)
+                rows[kr] = buffer.row(top + kr * conv.dilation_h);
+            depthwise_row(rows.data(), padded_w, input_c, group_filters, padded, packed.data(), output_w,
+                          row_output.data());
+            activate_array(row_output.data(), row_output.size(), activation);
+            for (T value : row_output)
+                output.write(value);
+        });
+        return 0;
+    }
+
+    // summed in the accumulator type, rounded to T once activated
+    std::vector<typename Accumulator<T>::type> row_output((long long)output_w * filters);
+    long long window_stride = (long long)conv.stride_w * input_c;
+    stream_rows(layer_id, conv, input, [&](const Line_buffer<T> &buffer, int top) {
+        std::fill(row_output.begin(), row_output.end(), (T)0);
+        for (int kr = 0; kr < conv.size_h; kr++) {
+            const T *line = buffer.row(top + kr * conv.dilation_h);
+            if (groups == 1 && conv.dilation_w == 1) {
+                gemm_accumulate(line, window_stride, packed.data() + (long long)kr * span * filters,
+                                row_output.data(), output_w, span, filters);
+                continue;
+            }
+            for (int kc = 0; kc < conv.size_w; kc++)
+                for (int g = 0; g < groups; g++)
+                    gemm_accumulate(line + (long long)kc * conv.dilation_w * input_c + g * group_c, window_stride,
+                                    packed.data() + (long long)(kr * conv.size_w + kc) * group_c * filters +
+                                        g * group_filters,
+                                    row_output.data() + g * group_filters, output_w, group_c, group_filters,
+                                    filters);
+        }
+        activate_array(row_output.data(), row_output.size(), activation);
+        for (auto value : row_output)
+            output.write((T)value);
+    });
+    return 0;
+}
+
+// kernel_matrix layout of conv_convert: packed[(h * size_w + w) * channel + c][filter]
+template <class T>
+int Network<T>::pack_kernel(int layer_id, Array4D<T> &kernel, std::vector<T> &packed) {
+    int i = layer_id;
+    Conv_params conv = conv_geometry(i, 0, 1);
+    if (kernel.Size_4d() != kernel_dimension[i] || kernel.Size_3d() != conv.size_h ||
+        kernel.Size_2d() != conv.size_w || kernel.Size_1d() != kernel_channel[i]) {
+        printf("kernel %d does not match the cfg\n", i);
+        return -1;
+    }
+
+    int filters = kernel_dimension[i];
+    int depth = conv.size_h * conv.size_w * kernel_channel[i];
+    packed.resize((long long)depth * filters);
+    for (int f = 0; f < filters; f++) {
+        int idx = 0;
+        for (int h = 0; h < conv.size_h; h++)
+            for (int w = 0; w < conv.size_w; w++)
+                for (int c = 0; c < kernel_channel[i]; c++)
+                    packed[(long long)idx++ * filters + f] = kernel[f][h][w][c];
+    }
+    return 0;
+}
+
+// networks set up by hand have no layer IR and stay linear
+template <class T>
+const std::string &Network<T>::conv_activation(int layer_id) const {
+    static const std::string linear = "linear";
+    for (size_t l = 0; l < conv_index.size(); l++)
+        if (conv_index[l] == layer_id) return layers[l].activation;
+    return linear;
+}
+
+// kernels[i] is the initial_kernel of the i-th conv layer; each is packed
+// once into the kernel_matrix layout of conv_convert
+template <class T>
+int Network<T>::load_weights(std::vector<Array4D<T> > &kernels) {
+    if ((int)kernels.size() != layer_number) {
+        printf("expected %d kernels, got %d\n", layer_number, (int)kernels.size());
+        return -1;
+    }
+    ALLOC_TAG("weights");
+
+    packed_kernels.assign(layer_number, std::vector<T>());
+    sparse_kernels.assign(layer_number, Csr_matrix<T>());
+    for (int i = 0; i < layer_number; i++) {
+        if (pack_kernel(i, kernels[i], packed_kernels[i]) != 0) return -1;
+        // pruned layers keep only their nonzeros; grouped ones stay dense
+        double density = matrix_density(packed_kernels[i].data(), packed_kernels[i].size());
+        bool prunable = kernel_channel[i] == input_channel[i];
+        if (prunable &&
+            (sparse_mode == SPARSE_ON || (sparse_mode == SPARSE_AUTO && density < SPARSE_DENSITY_THRESHOLD))) {
+            int depth = packed_kernels[i].size() / kernel_dimension[i];
+            sparse_kernels[i].pack(packed_kernels[i].data(), depth, kernel_dimension[i]);
+            packed_kernels[i].clear();
+            packed_kernels[i].shrink_to_fit();
+        }
+        PROFILE_COUNT(isSparse_layer(i) ? "sparse_layer" : "dense_layer", 1);
+    }
+    place_weights();
+    return 0;
+}
+
+// Replicates the read-only dense kernels on every node of a multi-node
+// pool. Each copy is made by a thread pinned to its node, so first touch
+// puts its pages there and gemm reads weights from local memory.
+template <class T>
+void Network<T>::place_weights() {
+    node_kernels.clear();
+    if (!thread_pool || thread_pool->getNodes() < 2 || packed_kernels.empty()) return;
+    ALLOC_TAG("weights");
+    node_kernels.resize(thread_pool->getNodes());
+    for (int node = 0; node < thread_pool->getNodes(); node++)
+        run_on_cpus(thread_pool->getNode_cpus(node), [&] { node_kernels[node] = packed_kernels; });
+}
+
+template <class T>
+const T *Network<T>::dense_kernel(int layer_id) const {
+    if (node_kernels.empty()) return packed_kernels[layer_id].data();
+    return node_kernels[thread_pool->current_node()][layer_id].data();
+}
+
+// one tile of out = matrix * kernel_matrix with the layer's dense or CSR
+// weights; with groups, each group's filters take their own slice of the
+// matrix rows (see im2col_position)
+template <class T>
+void Network<T>::conv_gemm(int layer_id, const T *matrix, T *out, int depth, int filters, long long row_begin,
+                           long long row_end, int col_begin, int col_end) {
+    int groups = input_channel[layer_id] / kernel_channel[layer_id];
+    if (isSparse_layer(layer_id)) {
+        sparse_gemm_tile(matrix, sparse_kernels[layer_id], out, depth, filters, row_begin, row_end, col_begin,
+                         col_end);
+    } else if (groups == 1) {
+        gemm_tile(matrix, dense_kernel(layer_id), out, depth, filters, row_begin, row_end, col_begin, col_end);
+    } else {
+        int group_depth = depth / groups, group_filters = filters / groups;
+        for (int g = col_begin / group_filters; g < groups && g * group_filters < col_end; g++)
+            gemm_tile(matrix + (long long)g * group_depth, dense_kernel(layer_id), out, group_depth,
+                      filters, row_begin, row_end, std::max(col_begin, g * group_filters),
+                      std::min(col_end, (g + 1) * group_filters), depth);
+    }
+}
+
+// Runs every layer of the IR on input. All activations and im2col scratch
+// live in one arena sized by memory_plan and allocated on the first call.
+template <class T>
+int Network<T>::forward(Array3D<T> &input, Array3D<T> &output) {
+    if (begin_forward(input) != 0 || run_forward(false) != 0) return -1;
+    end_forward(output);
+    return 0;
+}
+
+// Same result as forward, but runs of conv/maxpool layers are fused: the
+// last layer of a run pulls output rows from the one before it, and each
+// layer keeps only the `size` input rows its window needs in a Line_buffer.
+// Intermediate activations of a run never reach the arena.
+template <class T>
+int Network<T>::forward_fused(Array3D<T> &input, Array3D<T> &output) {
+    if (begin_forward(input) != 0 || run_forward(true) != 0) return -1;
+    end_forward(output);
+    return 0;
+}
+
+template <class T>
+int Network<T>::forward(const T *input, T *output, bool fused) {
+    if (check_forward(net_height, net_width, net_channel) != 0) return -1;
+    std::copy(input, input + getNet_input_size(), arena_tensor(memory_plan.activation(-1)));
+    if (run_forward(fused) != 0) return -1;
+    const T *result = arena_tensor(memory_plan.activation(layers.size() - 1));
+    std::copy(result, result + getNet_output_size(), output);
+    return 0;
+}
+
+template <class T>
+int Network<T>::forward_batch(const T *input, T *output, int batch) {
+    if (batch < 1 || reserve_batch(batch) != 0 || check_forward(net_height, net_width, net_channel) != 0) return -1;
+    std::copy(input, input + batch * getNet_input_size(), arena_tensor(memory_plan.activation(-1)));
+    if (run_forward(false, batch) != 0) return -1;
+    const T *result = arena_tensor(memory_plan.activation(layers.size() - 1));
+    std::copy(result, result + batch * getNet_output_size(), output);
+    return 0;
+}
+
+// replanning frees the arena; the next forward allocates the larger one
+template <class T>
+int Network<T>::reserve_batch(int batch) {
+    if (layers.empty()) return -1;
+    if (batch <= planned_batch) return 0;
+    memory_plan.plan(layers, net_height, net_width, net_channel, sizeof(T), 64, batch);
+    planned_batch = batch;
+    free_arena();
+    return 0;
+}
+
+template <class T>
+int Network<T>::run_forward(bool fused, int batch) {
+    if (!fused) {
+        for (int i = 0; i < (int)layers.size(); i++) {
+            PROFILE_LAYER(i);
+            ALLOC_LAYER(i);
+            if (run_layer(i, batch) != 0) return -1;
+        }
+        PROFILE_LAYER(-1);
+        ALLOC_LAYER(-1);
+        return 0;
+    }
+
+    int i = 0;
+    while (i < (int)layers.size()) {
+        int last = i;
+        while (fusable(last) && !referenced[last] && last + 1 < (int)layers.size() && fusable(last + 1))
+            last++;
+        if (last == i) {
+            PROFILE_LAYER(i);
+            ALLOC_LAYER(i);
+            if (run_layer(i) != 0) return -1;
+        } else {
+            PROFILE_LAYER(last);
+            ALLOC_LAYER(last);
+            PROFILE_SCOPE("fused");
+            run_fused(i, last);
+        }
+        i = last + 1;
+    }
+    PROFILE_LAYER(-1);
+    ALLOC_LAYER(-1);
+    return 0;
+}
+
+// the arena remembers how it was made; huge_pages may have changed since
+template <class T>
+void Network<T>::free_arena() {
+    if (!arena) return;
+    if (arena_mapped)
+        huge_page_free(arena, arena_bytes);
+    else
+        operator delete[](arena, std::align_val_t(64));
+    arena = NULL;
+}
+
+template <class T>
+T *Network<T>::arena_tensor(int index) {
+    return reinterpret_cast<T *>(arena + memory_plan.getTensors()[index].offset);
+}
+
+template <class T>
+int Network<T>::check_forward(int height, int width, int channel) {
+    if (layers.empty() || (int)packed_kernels.size() != layer_number) {
+        printf("obtain_parameters and load_weights must be called before forward\n");
+        return -1;
+    }
+    if (height != net_height || width != net_width || channel != net_channel) {
+        printf("input is %dx%dx%d, the network expects %dx%dx%d\n", height, width, channel, net_height, net_width,
+               net_channel);
+        return -1;
+    }
+    for (int i = 0; i < (int)layers.size(); i++) {
+        const Layer_desc &layer = layers[i];
+        if (layer.type == LAYER_CONVOLUTIONAL && !activation_supported(layer.activation)) {
+            printf("layer %d: activation=%s not supported by forward\n", i, layer.activation.c_str());
+            return -1;
+        }
+    }
+
+    if (!arena) {
+        ALLOC_TAG("arena");
+        long long bytes = memory_plan.getArena_size() + 64;
+        arena_backing = HUGE_PAGES_OFF;
+        arena_mapped = huge_pages != HUGE_PAGES_OFF;
+        if (!arena_mapped)
+            arena = static_cast<char *>(operator new[](bytes, std::align_val_t(64)));
+        else
+            arena = static_cast<char *>(huge_page_alloc(bytes, huge_pages, &arena_backing));
+        arena_bytes = bytes;
+        PROFILE_COUNT(arena_backing == HUGE_PAGES_OFF ? "arena_4k_bytes" : "arena_huge_page_bytes", bytes);
+        // first touch by the pool spreads the pages over the nodes its
+        // workers run on instead of putting them all on the caller's
+        if (thread_pool) {
+            const long long page = 4096;
+            thread_pool->parallel_for(0, (bytes + page - 1) / page, 16, [&](long long first, long long last) {
+                memset(arena + first * page, 0, std::min(bytes, last * page) - first * page);
+            });
+        }
+    }
+    return 0;
+}
+
+template <class T>
+int Network<T>::begin_forward(Array3D<T> &input) {
+    if (check_forward(input.Size_3d(), input.Size_2d(), input.Size_1d()) != 0) return -1;
+    T *network_input = arena_tensor(memory_plan.activation(-1));
+    for (int h = 0; h < net_height; h++)
+        for (int w = 0; w < net_width; w++)
+            for (int c = 0; c < net_channel; c++)
+                network_input[((long long)h * net_width + w) * net_channel + c] = input[h][w][c];
+    return 0;
+}
+
+template <class T>
+void Network<T>::end_forward(Array3D<T> &output) {
+    const Layer_desc &last = layers.back();
+    const T *result = arena_tensor(memory_plan.activation(layers.size() - 1));
+    // a repeated forward into the same output reuses its rows
+    if (output.Size_3d() != last.output_height || output.Size_2d() != last.output_width ||
+        output.Size_1d() != last.output_channel)
+        output.resize(last.output_height, last.output_width, last.output_channel);
+    for (int h = 0; h < last.output_height; h++)
+        for (int w = 0; w < last.output_width; w++)
+            for (int c = 0; c < last.output_channel; c++)
+                output[h][w][c] = result[((long long)h * last.output_width + w) * last.output_channel + c];
+}
+
+template <class T>
+int Network<T>::run_layer(int i, int batch) {
+    const Layer_desc &layer = layers[i];
+    const T *in = arena_tensor(memory_plan.activation(i - 1));
+    T *out = arena_tensor(memory_plan.activation(i));
+    int h = layer.input_height, w = layer.input_width, c = layer.input_channel;
+    long long in_count = (long long)h * w * c;
+    long long out_count = (long long)layer.output_height * layer.output_width * layer.output_channel;
+
+    switch (layer.type) {
+    case LAYER_CONVOLUTIONAL: {
+        if (isDepthwise_layer(conv_index[i])) {
+            run_depthwise(i, in, out, batch);
+            break;
+        }
+        // the im2col rows of every image stack into one matrix, so a batch
+        // is a single gemm with batch times the rows
+        T *matrix = arena_tensor(memory_plan.scratch(i));
+        long long rows = (long long)layer.output_height * layer.output_width;
+        long long total_rows = rows * batch;
+        int depth = layer.conv.size_h * layer.conv.size_w * c;
+        int filters = layer.filters;
+        const Conversion_plan *plan = layer_plan(i);
+        if (!plan) return -1;
+        auto im2col_part = [&](long long first, long long last) {
+            for (long long b = first / rows; b * rows < last; b++)
+                plan->execute(in + b * in_count, std::max(first - b * rows, 0LL), std::min(last - b * rows, rows),
+                              matrix + b * rows * depth);
+        };
+        auto gemm_part = [&](long long row_begin, long long row_end, long long col_begin, long long col_end) {
+            conv_gemm(conv_index[i], matrix, out, depth, filters, row_begin, row_end, col_begin, col_end);
+            for (long long r = row_begin; r < row_end; r++)
+                activate_array(out + r * filters + col_begin, col_end - col_begin, layer.activation);
+        };
+        // a few tasks per thread, and output-channel groups on top of row
+        // blocks so layers with only a handful of output pixels still spread
+        long long grain = thread_pool ? std::max(1LL, total_rows / (thread_pool->getThreads() * 4LL)) : total_rows;
+        {
+            PROFILE_SCOPE("im2col");
+            if (thread_pool)
+                thread_pool->parallel_for(0, total_rows, grain, im2col_part);
+            else
+                im2col_part(0, total_rows);
+        }
+        {
+            PROFILE_SCOPE("gemm");
+            if (thread_pool)
+                thread_pool->parallel_for_2d(total_rows, grain, filters, 16, gemm_part);
+            else
+                gemm_part(0, total_rows, 0, filters);
+        }
+        break;
+    }
+    case LAYER_MAXPOOL:
+        for (int b = 0; b < batch; b++)
+            maxpool(in + b * in_count, h, w, c, layer.size, layer.stride, layer.padding, layer.output_height,
+                    layer.output_width, out + b * out_count);
+        break;
+    case LAYER_AVGPOOL:
+        for (int b = 0; b < batch; b++)
+            avgpool(in + b * in_count, h, w, c, out + b * out_count);
+        break;
+    case LAYER_UPSAMPLE:
+        for (int b = 0; b < batch; b++)
+            upsample(in + b * in_count, h, w, c, layer.stride, out + b * out_count);
+        break;
+    case LAYER_ROUTE: {
+        long long pixels = (long long)layer.output_height * layer.output_width;
+        for (int b = 0; b < batch; b++) {
+            int channel_offset = 0;
+            for (int from : layer.inputs) {
+                int from_channel = layers[from].output_channel;
+                concat_channels(arena_tensor(memory_plan.activation(from)) + b * pixels * from_channel, pixels,
+                                from_channel, out + b * out_count, layer.output_channel, channel_offset);
+                channel_offset += from_channel;
+            }
+        }
+        break;
+    }
+    case LAYER_SHORTCUT: {
+        const T *from = arena_tensor(memory_plan.activation(layer.inputs[0]));
+        for (long long j = 0; j < out_count * batch; j++)
+            out[j] = activate((T)(in[j] + from[j]), layer.activation);
+        break;
+    }
+    case LAYER_DROPOUT:
+        for (long long j = 0; j < out_count * batch; j++)
+            out[j] = in[j];
+        break;
+    default:
+        printf("layer %d: [%s] is not supported by forward\n", i, layer.section.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// built on the layer's first forward, or shared with a layer of the same shape
+template <class T>
+const Conversion_plan *Network<T>::layer_plan(int i) {
+    if (!layer_plans[i]) {
+        const Layer_desc &layer = layers[i];
+        layer_plans[i] = conversions.find(
+            Conversion_key(layer.input_height, layer.input_width, layer.input_channel, layer.groups, layer.conv));
+    }
+    return layer_plans[i];
+}
+
+// depthwise layers go straight from the input to the output, output rows
+// split over the pool
+template <class T>
+void Network<T>::run_depthwise(int i, const T *in, T *out, int batch) {
+    const Layer_desc &layer = layers[i];
+    const Conv_params &conv = layer.conv;
+    int h = layer.input_height, w = layer.input_width, c = layer.input_channel;
+    long long in_count = (long long)h * w * c;
+    long long row_length = (long long)layer.output_width * layer.filters;
+    auto rows_part = [&](long long first, long long last) {
+        // the weights of the node this part runs on
+        const T *weights = dense_kernel(conv_index[i]);
+        const T *stack_rows[DEPTHWISE_STACK_ROWS];
+        std::vector<const T *> heap_rows;
+        if (conv.size_h > DEPTHWISE_STACK_ROWS) heap_rows.resize(conv.size_h);
+        const T **rows = heap_rows.empty() ? stack_rows : heap_rows.data();
+        for (long long r = first; r < last; r++) {
+            int b = r / layer.output_height, h_out = r % layer.output_height;
+            for (int kh = 0; kh < conv.size_h; kh++) {
+                int h_in = h_out * conv.stride_h + kh * conv.dilation_h - conv.pad_top;
+                rows[kh] = h_in >= 0 && h_in < h ? in + b * in_count + (long long)h_in * w * c : NULL;
+            }
+            T *dst = out + r * row_length;
+            depthwise_row(rows, w, c, layer.filters / c, conv, weights, layer.output_width, dst);
+            activate_array(dst, row_length, layer.activation);
+        }
+    };
+    PROFILE_SCOPE("depthwise");
+    long long total_rows = (long long)layer.output_height * batch;
+    if (thread_pool)
+        thread_pool->parallel_for(0, total_rows, std::max(1LL, total_rows / (thread_pool->getThreads() * 4LL)),
+                                  rows_part);
+    else
+        rows_part(0, total_rows);
+}
+
+template <class T>
+bool Network<T>::fusable(int i) const {
+    return layers[i].type == LAYER_CONVOLUTIONAL || layers[i].type == LAYER_MAXPOOL;
+}
+
+// first input row of output row r; conv pads pad_top rows above while
+// darknet's maxpool centres its window with padding/2
+template <class T>
+int Network<T>::window_top(const Layer_desc &layer, int r) const {
+    if (layer.type == LAYER_CONVOLUTIONAL) return r * layer.conv.stride_h - layer.conv.pad_top;
+    return r * layer.stride - layer.padding / 2;
+}
+
+// input rows one output row's window spans
+template <class T>
+int Network<T>::window_rows(const Layer_desc &layer) const {
+    return layer.type == LAYER_CONVOLUTIONAL ? layer.conv.extent_h() : layer.size;
+}
+
+template <class T>
+void Network<T>::run_fused(int first, int last) {
+    std::vector<Fused_stage> &stages = fused_stages[first];
+    stages.resize(last - first + 1);
+    long long buffer_bytes = 0;
+    for (int s = 0; s < (int)stages.size(); s++) {
+        const Layer_desc &layer = layers[first + s];
+        Fused_stage &stage = stages[s];
+        stage.layer = first + s;
+        stage.next_row = 0;
+        stage.rows.reset(window_rows(layer), layer.input_width * layer.input_channel);
+        if (layer.type == LAYER_CONVOLUTIONAL && isDepthwise_layer(conv_index[first + s]))
+            stage.window.resize(layer.conv.size_h);
+        else if (layer.type == LAYER_CONVOLUTIONAL)
+            stage.matrix.resize((long long)layer.output_width * layer.conv.size_h * layer.conv.size_w *
+                                layer.input_channel);
+        buffer_bytes += (long long)window_rows(layer) * layer.input_width * layer.input_channel * sizeof(T);
+    }
+    PROFILE_COUNT("fused_buffer_bytes", buffer_bytes);
+    (void)buffer_bytes;
+
+    const T *source = arena_tensor(memory_plan.activation(first - 1));
+    T *result = arena_tensor(memory_plan.activation(last));
+    const Layer_desc &out_layer = layers[last];
+    long long row_length = (long long)out_layer.output_width * out_layer.output_channel;
+    for (int r = 0; r < out_layer.output_height; r++)
+        fused_row(stages, stages.size() - 1, source, result + r * row_length);
+}
+
+// computes the next output row of stages[s] into dst, first pulling the
+// input rows its window needs from stages[s - 1] (or from source for s == 0)
+template <class T>
+void Network<T>::fused_row(std::vector<Fused_stage> &stages, int s, const T *source, T *dst) {
+    Fused_stage &stage = stages[s];
+    const Layer_desc &layer = layers[stage.layer];
+    int h = layer.input_height, w = layer.input_width, c = layer.input_channel;
+    int r = stage.next_row++;
+    int top = window_top(layer, r);
+    int bottom = std::min(top + window_rows(layer) - 1, h - 1);
+
+    while (stage.rows.getRows_pushed() <= bottom) {
+        int row = stage.rows.getRows_pushed();
+        T *slot = stage.rows.next_row();
+        if (s == 0) {
+            const T *from = source + (long long)row * w * c;
+            for (int i = 0; i < w * c; i++)
+                slot[i] = from[i];
+        } else {
+            fused_row(stages, s - 1, source, slot);
+        }
+    }
+
+    const Conv_params &conv = layer.conv;
+    if (layer.type == LAYER_CONVOLUTIONAL && isDepthwise_layer(conv_index[stage.layer])) {
+        const T **rows = stage.window.data();
+        for (int kh = 0; kh < conv.size_h; kh++) {
+            int h_in = top + kh * conv.dilation_h;
+            rows[kh] = h_in >= 0 && h_in < h ? stage.rows.row(h_in) : NULL;
+        }
+        depthwise_row(rows, w, c, layer.filters / c, conv, dense_kernel(conv_index[stage.layer]),
+                      layer.output_width, dst);
+        activate_array(dst, (long long)layer.output_width * layer.filters, layer.activation);
+    } else if (layer.type == LAYER_CONVOLUTIONAL) {
+        int depth = conv.size_h * conv.size_w * c;
+        int group_c = c / layer.groups;
+        T *matrix = stage.matrix.data();
+        for (int w_out = 0; w_out < layer.output_width; w_out++) {
+            T *matrix_row = matrix + (long long)w_out * depth;
+            for (int kh = 0; kh < conv.size_h; kh++) {
+                int h_in = top + kh * conv.dilation_h;
+                const T *line = (h_in >= 0 && h_in < h) ? stage.rows.row(h_in) : NULL;
+                for (int kw = 0; kw < conv.size_w; kw++) {
+                    int w_in = w_out * conv.stride_w + kw * conv.dilation_w - conv.pad_left;
+                    T *to = matrix_row + (kh * conv.size_w + kw) * group_c;
+                    if (layer.groups != 1) {
+                        const T *from = !line || w_in < 0 || w_in >= w ? NULL : line + w_in * c;
+                        im2col_position(from, c, layer.groups, depth / layer.groups, to);
+                    } else if (!line || w_in < 0 || w_in >= w) {
+                        for (int ch = 0; ch < c; ch++)
+                            to[ch] = 0;
                     } else {
-                        for (int i = 0; i < padding * input_c; i++) {
-                            buffer[(kernel_sz-1) * padded_w * input_c + i] = 0;
-                        }
-                        for (int i = 0; i < input_w * input_c; i++) {
-                            if (!input.empty())
-                                buffer[(kernel_sz-1) * padded_w * input_c + padding * input_c + i] = input.read();
-                                //printf("input: %d\n", buffer[r * padded_w * input_c + padding * input_c + i]);
-                            else
-                                buffer[(kernel_sz-1) * padded_w * input_c + padding * input_c + i] = 0;
-                        }
-                        for (int i = padding * input_c + input_w * input_c; i < padded_w * input_c; i++) {
-                            buffer[(kernel_sz-1) * padded_w * input_c + i] = 0;
-                        }
+                        for (int ch = 0; ch < c; ch++)
+                            to[ch] = line[w_in * c + ch];
                     }
-                } else {  
-                    for (int c = 0; c < padded_w * input_c; c++) {
-                        buffer[(kernel_sz - 1) * padded_w * input_c + c] = 0;
+                }
+            }
+        }
+        conv_gemm(conv_index[stage.layer], matrix, dst, depth, layer.filters, 0, layer.output_width, 0,
+                  layer.filters);
+        activate_array(dst, (long long)layer.output_width * layer.filters, layer.activation);
+    } else {
+        int offset = -layer.padding / 2;
+        for (int w_out = 0; w_out < layer.output_width; w_out++) {
+            T *to = dst + (long long)w_out * c;
+            for (int ch = 0; ch < c; ch++) {
+                bool found = false;
+                T best = 0;
+                for (int kh = 0; kh < layer.size; kh++) {
+                    int h_in = top + kh;
+                    if (h_in < 0 || h_in >= h) continue;
+                    const T *line = stage.rows.row(h_in);
+                    for (int kw = 0; kw < layer.size; kw++) {
+                        int w_in = w_out * layer.stride + kw + offset;
+                        if (w_in < 0 || w_in >= w) continue;
+                        T value = line[w_in * c + ch];
+                        if (!found || value > best) best = value;
+                        found = true;
                     }
                 }
-                current_padded_row++;
+                to[ch] = best;
             }
         }
     }
-    return 0;
 }
 
 #endif //NETWORK_H
@@ -0,0 +1,149 @@
+#ifndef NUMERIC_TYPES_H
+#define NUMERIC_TYPES_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// Reduced-precision storage types. Values are kept as 16 raw bits and every
+// arithmetic expression goes through float, so the kernels templated on T
+// compile unchanged; Accumulator<T> below keeps their sums in fp32.
+
+// the portable conversions, also used to check the hardware ones
+inline float bits_to_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline uint32_t float_to_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// round to nearest even; NaNs stay (quiet) NaNs and, as VCVTNEPS2BF16 does,
+// float subnormals flush to signed zero so every build rounds alike
+inline uint16_t float_to_bfloat16_bits(float value) {
+    uint32_t bits = float_to_bits(value);
+    if ((bits & 0x7fffffffu) > 0x7f800000u) return (uint16_t)((bits >> 16) | 0x40);
+    if ((bits & 0x7f800000u) == 0) return (uint16_t)((bits >> 16) & 0x8000);
+    bits += 0x7fffu + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+inline float bfloat16_bits_to_float(uint16_t bits) {
+    return bits_to_float((uint32_t)bits << 16);
+}
+
+// IEEE binary16, round to nearest even, with subnormals, infinities and NaN
+inline uint16_t float_to_half_bits(float value) {
+    uint32_t bits = float_to_bits(value);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffffu;
+
+    if (magnitude > 0x7f800000u) return sign | 0x7e00 | ((magnitude >> 13) & 0x3ff);
+    if (magnitude >= 0x477ff000u) return sign | 0x7c00;     // rounds past 65504
+    if (magnitude < 0x38800000u) {
+        // subnormal or zero: shift the full mantissa into place and round
+        if (magnitude < 0x33000000u) return sign;
+        int exponent = magnitude >> 23;
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        int shift = 126 - exponent;                     // 14..24
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t rounded = magnitude + 0xfffu + ((magnitude >> 13) & 1);
+    return sign | (uint16_t)((rounded - 0x38000000u) >> 13);
+}
+
+inline float half_bits_to_float(uint16_t bits) {
+    uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+    uint32_t exponent = (bits >> 10) & 0x1f;
+    uint32_t mantissa = bits & 0x3ff;
+    if (exponent == 0x1f) return bits_to_float(sign | 0x7f800000u | (mantissa << 13));
+    if (exponent == 0) {
+        float value = mantissa * (1.0f / 16777216.0f);  // mantissa * 2^-24
+        return sign ? -value : value;
+    }
+    return bits_to_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+    template <class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    bfloat16(U value) : bits(from_float((float)value)) {}
+    operator float() const { return to_float(bits); }
+
+    // the scalar rounding matches VCVTNEPS2BF16 bit for bit and compiles to a
+    // few integer ops; _mm_cvtness_sbh goes through an uninitialised vector
+    static uint16_t from_float(float value) { return float_to_bfloat16_bits(value); }
+    static float to_float(uint16_t bits) { return bfloat16_bits_to_float(bits); }
+};
+
+struct float16 {
+    uint16_t bits;
+
+    float16() = default;
+    template <class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    float16(U value) : bits(from_float((float)value)) {}
+    operator float() const { return to_float(bits); }
+
+    static uint16_t from_float(float value) {
+#ifdef __F16C__
+        return _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+        return float_to_half_bits(value);
+#endif
+    }
+    static float to_float(uint16_t bits) {
+#ifdef __F16C__
+        return _cvtsh_ss(bits);
+#else
+        return half_bits_to_float(bits);
+#endif
+    }
+};
+
+// the type GEMM sums are kept in
+template <class T>
+struct Accumulator {
+    typedef T type;
+};
+
+template <>
+struct Accumulator<bfloat16> {
+    typedef float type;
+};
+
+template <>
+struct Accumulator<float16> {
+    typedef float type;
+};
+
+// one text token as a T; like stoi, integers take the leading digits and
+// anything unparsable is 0
+template <class T>
+inline T parse_value(const char *text) {
+    if (std::is_integral<T>::value)
+        return (T)strtol(text, NULL, 10);
+    return (T)strtof(text, NULL);
+}
+
+template <class T>
+inline T parse_value(const std::string &text) {
+    return parse_value<T>(text.c_str());
+}
+
+#endif //NUMERIC_TYPES_H
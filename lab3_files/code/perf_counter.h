@@ -0,0 +1,126 @@
+#ifndef PERF_COUNTER_H
+#define PERF_COUNTER_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// One hardware event of the calling thread through perf_event_open, user
+// space only, counting from construction. Where the event cannot be opened
+// (no PMU in a VM, perf_event_paranoid, seccomp) isAvailable is false and
+// read returns -1, so callers simply record nothing.
+class Perf_counter {
+public:
+    Perf_counter(uint32_t type, uint64_t config);
+    ~Perf_counter();
+    Perf_counter(const Perf_counter &) = delete;
+    Perf_counter &operator=(const Perf_counter &) = delete;
+
+    bool isAvailable() const { return fd >= 0; }
+    long long read() const;
+
+private:
+    int fd;
+};
+
+// config of a PERF_TYPE_HW_CACHE event
+inline uint64_t perf_cache_event(uint64_t cache, uint64_t op, uint64_t result) {
+    return cache | (op << 8) | (result << 16);
+}
+
+inline Perf_counter::Perf_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+inline Perf_counter::~Perf_counter() {
+    if (fd >= 0) close(fd);
+}
+
+inline long long Perf_counter::read() const {
+    uint64_t value;
+    if (fd < 0 || ::read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
+
+// The events attached to every profiled stage and benchmark: cycles and
+// instructions tell front-end from memory stalls, LLC and dTLB load misses
+// say which level the memory stalls come from.
+enum Perf_event {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_EVENT_COUNT
+};
+
+inline const char *perf_event_name(int event) {
+    static const char *names[PERF_EVENT_COUNT] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+    return event >= 0 && event < PERF_EVENT_COUNT ? names[event] : "unknown";
+}
+
+// one reading of every event; -1 where the event is unavailable
+struct Perf_sample {
+    long long values[PERF_EVENT_COUNT];
+};
+
+// end - start per event, -1 where either side is missing
+inline Perf_sample perf_delta(const Perf_sample &start, const Perf_sample &end) {
+    Perf_sample delta;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        delta.values[i] = start.values[i] >= 0 && end.values[i] >= 0 ? end.values[i] - start.values[i] : -1;
+    return delta;
+}
+
+// The events of the calling thread. Each is opened on its own rather than
+// as a group, so a VM that exposes only some of them still reports those.
+// Work handed to pool workers is not counted by the caller's set.
+class Perf_counter_set {
+public:
+    Perf_counter_set();
+
+    // true if at least one event could be opened
+    bool isAvailable() const;
+    bool isAvailable(int event) const { return counters[event].isAvailable(); }
+    Perf_sample read() const;
+
+private:
+    Perf_counter counters[PERF_EVENT_COUNT];
+};
+
+inline Perf_counter_set::Perf_counter_set()
+    : counters{{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+               {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+               {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+               {PERF_TYPE_HW_CACHE, perf_cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                                                     PERF_COUNT_HW_CACHE_RESULT_MISS)}} {}
+
+inline bool Perf_counter_set::isAvailable() const {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        if (counters[i].isAvailable()) return true;
+    return false;
+}
+
+inline Perf_sample Perf_counter_set::read() const {
+    Perf_sample sample;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+        sample.values[i] = counters[i].read();
+    return sample;
+}
+
+// the calling thread's set, opened on first use
+inline const Perf_counter_set &perf_counters() {
+    thread_local Perf_counter_set counters;
+    return counters;
+}
+
+#endif //PERF_COUNTER_H
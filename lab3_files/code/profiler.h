@@ -0,0 +1,275 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "perf_counter.h"
+
+// Per-layer stage timers and counters. Everything is compiled out unless
+// MLARCH_PROFILE is defined; the report is printed at exit, as a table by
+// default or as JSON when MLARCH_PROFILE_FORMAT=json. MLARCH_PROFILE_OUTPUT
+// redirects it to a file instead of stderr. Each stage also records the
+// hardware events of the timing thread (perf_counter.h); the event columns
+// are left out when the machine exposes none of them. Stage and counter
+// names must be string literals: they are the map keys, so recording never
+// builds a string and allocates only the first time a name is seen.
+class Profiler {
+public:
+    static Profiler &instance();
+
+    // events (if given) is the stage's Perf_sample delta; -1 entries are skipped
+    void add_time(const char *stage, double seconds, const Perf_sample *events = NULL);
+    void add_count(const char *counter, long long n);
+    void reset();
+
+    std::string report_table() const;
+    std::string report_json() const;
+    void report() const;
+
+    int getCurrent_layer() const;
+    void setCurrent_layer(int current_layer);
+
+private:
+    Profiler();
+
+    struct Stage_record {
+        double seconds;
+        long long calls;
+        long long events[PERF_EVENT_COUNT];
+        bool measured[PERF_EVENT_COUNT];
+    };
+
+    struct Name_less {
+        bool operator()(const char *a, const char *b) const { return a != b && strcmp(a, b) < 0; }
+    };
+
+    bool any_events() const;
+
+    // layer -1 collects whatever is not attributable to a single layer
+    int current_layer;
+    std::map<int, std::map<const char *, Stage_record, Name_less> > timers;
+    std::map<int, std::map<const char *, long long, Name_less> > counters;
+    mutable std::mutex lock;
+};
+
+class Scoped_timer {
+public:
+    Scoped_timer(const char *stage);
+    ~Scoped_timer();
+private:
+    const char *stage;
+    Perf_sample start_events;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline Profiler &Profiler::instance() {
+    // never destroyed, so the atexit report and late destructors can still use it
+    static Profiler *profiler = new Profiler();
+    return *profiler;
+}
+
+inline Profiler::Profiler() {
+    current_layer = -1;
+    std::atexit([]() { Profiler::instance().report(); });
+}
+
+inline void Profiler::add_time(const char *stage, double seconds, const Perf_sample *events) {
+    std::lock_guard<std::mutex> guard(lock);
+    Stage_record &record = timers[current_layer][stage];
+    record.seconds += seconds;
+    record.calls++;
+    if (!events) return;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        if (events->values[i] < 0) continue;
+        record.events[i] += events->values[i];
+        record.measured[i] = true;
+    }
+}
+
+inline void Profiler::add_count(const char *counter, long long n) {
+    std::lock_guard<std::mutex> guard(lock);
+    counters[current_layer][counter] += n;
+}
+
+inline void Profiler::reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    timers.clear();
+    counters.clear();
+    current_layer = -1;
+}
+
+// caller holds the lock
+inline bool Profiler::any_events() const {
+    for (const auto &layer : timers)
+        for (const auto &stage : layer.second)
+            for (int i = 0; i < PERF_EVENT_COUNT; i++)
+                if (stage.second.measured[i]) return true;
+    return false;
+}
+
+inline std::string Profiler::report_table() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string table;
+    char line[256];
+    bool events = any_events();
+
+    snprintf(line, sizeof(line), "%-6s %-24s %14s %10s", "layer", "stage", "time(ms)", "calls");
+    table += line;
+    if (events) {
+        for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+            snprintf(line, sizeof(line), " %14s", perf_event_name(i));
+            table += line;
+        }
+        table += "    ipc";
+    }
+    table += "\n";
+    for (const auto &layer : timers) {
+        std::string layer_name = layer.first < 0 ? "net" : std::to_string(layer.first);
+        for (const auto &stage : layer.second) {
+            const Stage_record &record = stage.second;
+            snprintf(line, sizeof(line), "%-6s %-24s %14.3f %10lld", layer_name.c_str(), stage.first,
+                     record.seconds * 1e3, record.calls);
+            table += line;
+            if (events) {
+                for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+                    if (record.measured[i])
+                        snprintf(line, sizeof(line), " %14lld", record.events[i]);
+                    else
+                        snprintf(line, sizeof(line), " %14s", "-");
+                    table += line;
+                }
+                if (record.measured[PERF_CYCLES] && record.measured[PERF_INSTRUCTIONS] &&
+                    record.events[PERF_CYCLES] > 0)
+                    snprintf(line, sizeof(line), " %6.2f",
+                             (double)record.events[PERF_INSTRUCTIONS] / record.events[PERF_CYCLES]);
+                else
+                    snprintf(line, sizeof(line), " %6s", "-");
+                table += line;
+            }
+            table += "\n";
+        }
+    }
+
+    snprintf(line, sizeof(line), "\n%-6s %-24s %14s\n", "layer", "counter", "value");
+    table += line;
+    for (const auto &layer : counters) {
+        std::string layer_name = layer.first < 0 ? "net" : std::to_string(layer.first);
+        for (const auto &counter : layer.second) {
+            snprintf(line, sizeof(line), "%-6s %-24s %14lld\n", layer_name.c_str(), counter.first,
+                     counter.second);
+            table += line;
+        }
+    }
+    return table;
+}
+
+inline std::string Profiler::report_json() const {
+    std::lock_guard<std::mutex> guard(lock);
+
+    // merge both maps so every layer appears once
+    std::map<int, int> layers;
+    for (const auto &layer : timers)
+        layers[layer.first] = 0;
+    for (const auto &layer : counters)
+        layers[layer.first] = 0;
+
+    std::string json = "{\"layers\": [";
+    char value[64];
+    bool first_layer = true;
+    for (const auto &layer : layers) {
+        json += first_layer ? "\n  " : ",\n  ";
+        first_layer = false;
+        json += "{\"layer\": " + std::to_string(layer.first) + ", \"timers\": {";
+
+        bool first = true;
+        auto t = timers.find(layer.first);
+        if (t != timers.end()) {
+            for (const auto &stage : t->second) {
+                snprintf(value, sizeof(value), "%.6f", stage.second.seconds * 1e3);
+                json += first ? "" : ", ";
+                json += std::string("\"") + stage.first + "\": {\"ms\": " + value +
+                        ", \"calls\": " + std::to_string(stage.second.calls);
+                for (int i = 0; i < PERF_EVENT_COUNT; i++)
+                    if (stage.second.measured[i])
+                        json += std::string(", \"") + perf_event_name(i) +
+                                "\": " + std::to_string(stage.second.events[i]);
+                json += "}";
+                first = false;
+            }
+        }
+
+        json += "}, \"counters\": {";
+        first = true;
+        auto c = counters.find(layer.first);
+        if (c != counters.end()) {
+            for (const auto &counter : c->second) {
+                json += first ? "" : ", ";
+                json += std::string("\"") + counter.first + "\": " + std::to_string(counter.second);
+                first = false;
+            }
+        }
+        json += "}}";
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+inline void Profiler::report() const {
+    if (timers.empty() && counters.empty()) return;
+
+    const char *format = std::getenv("MLARCH_PROFILE_FORMAT");
+    std::string text = (format && std::string(format) == "json") ? report_json() : report_table();
+
+    const char *output = std::getenv("MLARCH_PROFILE_OUTPUT");
+    FILE *out = output ? fopen(output, "w") : stderr;
+    if (!out) {
+        printf("cannot open profile output %s\n", output);
+        out = stderr;
+    }
+    fputs(text.c_str(), out);
+    if (out != stderr) fclose(out);
+}
+
+inline int Profiler::getCurrent_layer() const {
+    return current_layer;
+}
+
+inline void Profiler::setCurrent_layer(int current_layer) {
+    std::lock_guard<std::mutex> guard(lock);
+    Profiler::current_layer = current_layer;
+}
+
+// the counters are read inside the timed interval's edges so the clock
+// calls are not charged to the stage's events
+inline Scoped_timer::Scoped_timer(const char *stage) {
+    this->stage = stage;
+    start = std::chrono::steady_clock::now();
+    start_events = perf_counters().read();
+}
+
+inline Scoped_timer::~Scoped_timer() {
+    Perf_sample events = perf_delta(start_events, perf_counters().read());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    Profiler::instance().add_time(stage, elapsed.count(), &events);
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#ifdef MLARCH_PROFILE
+#define PROFILE_SCOPE(stage) Scoped_timer PROFILE_CONCAT(profile_scope_, __LINE__)(stage)
+#define PROFILE_COUNT(counter, n) Profiler::instance().add_count(counter, n)
+#define PROFILE_LAYER(layer_id) Profiler::instance().setCurrent_layer(layer_id)
+#else
+#define PROFILE_SCOPE(stage) ((void)0)
+#define PROFILE_COUNT(counter, n) ((void)0)
+#define PROFILE_LAYER(layer_id) ((void)0)
+#endif
+
+#endif //PROFILER_H
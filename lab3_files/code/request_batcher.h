@@ -0,0 +1,261 @@
+#ifndef REQUEST_BATCHER_H
+#define REQUEST_BATCHER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "network.h"
+
+// Latencies of the last `window` requests, in microseconds. The window is
+// allocated up front so recording never allocates.
+class Latency_recorder {
+public:
+    Latency_recorder(size_t window = 1 << 16) : samples(window), next(0), count(0), max_latency(0) {}
+
+    void record(double microseconds) {
+        samples[next] = microseconds;
+        next = (next + 1) % samples.size();
+        count++;
+        max_latency = std::max(max_latency, microseconds);
+    }
+
+    long long getCount() const { return count; }
+    double getMax() const { return max_latency; }
+
+    // p in [0, 100] over the window; 0 before the first request
+    double percentile(double p) const {
+        size_t size = std::min<long long>(count, samples.size());
+        if (size == 0) return 0;
+        sorted.assign(samples.begin(), samples.begin() + size);
+        size_t rank = std::min(size - 1, (size_t)(p / 100 * size));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+private:
+    std::vector<double> samples;
+    size_t next;
+    long long count;
+    double max_latency;
+    mutable std::vector<double> sorted;
+};
+
+struct Batcher_config {
+    int max_batch;          // dispatch as soon as this many images wait
+    double max_delay_us;    // or once the oldest has waited this long
+    double slo_us;          // latency target, 0 for none: dispatch early when waiting
+                            // longer would make the oldest request miss it
+
+    Batcher_config(int max_batch = 8, double max_delay_us = 1000, double slo_us = 0)
+        : max_batch(max_batch), max_delay_us(max_delay_us), slo_us(slo_us) {}
+};
+
+struct Batcher_stats {
+    long long images;
+    long long batches;
+    long long slo_misses;   // images slower than slo_us
+    double mean_batch;
+    double p50_us, p99_us, max_us;
+};
+
+// Queues single images from any number of threads and runs them through
+// Network::forward_batch, so small layers see the rows of a whole batch in
+// one gemm. A batch leaves when it is full or at the oldest image's
+// deadline: max_delay_us after it arrived, or earlier if the batch time
+// predicted from the batches so far would otherwise push it past slo_us.
+// While a batcher exists only its dispatcher thread may use the network.
+template <class T>
+class Dynamic_batcher {
+public:
+    Dynamic_batcher(Network<T> &network, const Batcher_config &config);
+    // finishes what is queued, then stops the dispatcher
+    ~Dynamic_batcher();
+
+    // queues count images of getNet_input_size() values and blocks until
+    // their outputs are written
+    int infer(const T *input, T *output, int count = 1);
+    Batcher_stats stats() const;
+    // microseconds a batch of n images is expected to take
+    double predict(int n) const;
+    const Batcher_config &getConfig() const { return config; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending {
+        const T *input;
+        T *output;
+        Clock::time_point arrival;
+        bool done;
+        int status;
+    };
+
+    void dispatch_loop();
+    Clock::time_point deadline() const;
+
+    Network<T> &network;
+    Batcher_config config;
+    long long input_size, output_size;
+
+    mutable std::mutex lock;
+    std::condition_variable arrived, finished;
+    std::deque<Pending *> queue;
+    bool stopping;
+
+    // dispatcher-only buffers for max_batch images
+    std::vector<Pending *> batch;
+    std::vector<T> inputs, outputs;
+
+    std::vector<double> batch_us;     // moving average per batch size, 0 until seen
+    Latency_recorder latency;
+    long long images, batches, slo_misses;
+
+    std::thread dispatcher;
+};
+
+template <class T>
+Dynamic_batcher<T>::Dynamic_batcher(Network<T> &network, const Batcher_config &config)
+    : network(network), config(config), stopping(false), images(0), batches(0), slo_misses(0) {
+    if (this->config.max_batch < 1) this->config.max_batch = 1;
+    int max_batch = this->config.max_batch;
+    input_size = network.getNet_input_size();
+    output_size = network.getNet_output_size();
+    network.reserve_batch(max_batch);
+    batch.reserve(max_batch);
+    inputs.resize(max_batch * input_size);
+    outputs.resize(max_batch * output_size);
+    batch_us.assign(max_batch + 1, 0);
+    dispatcher = std::thread(&Dynamic_batcher<T>::dispatch_loop, this);
+}
+
+template <class T>
+Dynamic_batcher<T>::~Dynamic_batcher() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    arrived.notify_all();
+    dispatcher.join();
+}
+
+template <class T>
+int Dynamic_batcher<T>::infer(const T *input, T *output, int count) {
+    // one image, the usual request, stays on the stack
+    Pending single;
+    std::vector<Pending> several(count > 1 ? count : 0);
+    Pending *pending = count > 1 ? several.data() : &single;
+
+    Clock::time_point now = Clock::now();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping) return -1;
+        for (int i = 0; i < count; i++) {
+            pending[i].input = input + i * input_size;
+            pending[i].output = output + i * output_size;
+            pending[i].arrival = now;
+            pending[i].done = false;
+            pending[i].status = 0;
+            queue.push_back(&pending[i]);
+        }
+    }
+    arrived.notify_one();
+
+    std::unique_lock<std::mutex> guard(lock);
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        finished.wait(guard, [&] { return pending[i].done; });
+        if (pending[i].status != 0) status = -1;
+    }
+    return status;
+}
+
+// nearest measured batch size scaled linearly until n itself has run
+template <class T>
+double Dynamic_batcher<T>::predict(int n) const {
+    n = std::max(1, std::min(n, config.max_batch));
+    if (batch_us[n] > 0) return batch_us[n];
+    for (int distance = 1; distance <= config.max_batch; distance++) {
+        if (n - distance >= 1 && batch_us[n - distance] > 0) return batch_us[n - distance] * n / (n - distance);
+        if (n + distance <= config.max_batch && batch_us[n + distance] > 0)
+            return batch_us[n + distance] * n / (n + distance);
+    }
+    return 0;
+}
+
+template <class T>
+typename Dynamic_batcher<T>::Clock::time_point Dynamic_batcher<T>::deadline() const {
+    double wait_us = config.max_delay_us;
+    if (config.slo_us > 0) {
+        int next = std::min<int>(queue.size() + 1, config.max_batch);
+        wait_us = std::min(wait_us, config.slo_us - predict(next));
+    }
+    return queue.front()->arrival + std::chrono::microseconds((long long)std::max(0.0, wait_us));
+}
+
+template <class T>
+void Dynamic_batcher<T>::dispatch_loop() {
+    ALLOC_TAG("batcher");
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        arrived.wait(guard, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+        while (!stopping && (int)queue.size() < config.max_batch) {
+            Clock::time_point until = deadline();
+            if (Clock::now() >= until) break;
+            arrived.wait_until(guard, until);
+        }
+
+        batch.clear();
+        while (!queue.empty() && (int)batch.size() < config.max_batch) {
+            batch.push_back(queue.front());
+            queue.pop_front();
+        }
+        int n = batch.size();
+        guard.unlock();
+
+        Clock::time_point start = Clock::now();
+        for (int b = 0; b < n; b++)
+            std::copy(batch[b]->input, batch[b]->input + input_size, inputs.data() + b * input_size);
+        int status = network.forward_batch(inputs.data(), outputs.data(), n);
+        if (status == 0)
+            for (int b = 0; b < n; b++)
+                std::copy(outputs.data() + b * output_size, outputs.data() + (b + 1) * output_size,
+                          batch[b]->output);
+        Clock::time_point end = Clock::now();
+
+        guard.lock();
+        double elapsed = std::chrono::duration<double, std::micro>(end - start).count();
+        batch_us[n] = batch_us[n] > 0 ? 0.8 * batch_us[n] + 0.2 * elapsed : elapsed;
+        batches++;
+        images += n;
+        for (Pending *pending : batch) {
+            double waited = std::chrono::duration<double, std::micro>(end - pending->arrival).count();
+            latency.record(waited);
+            if (config.slo_us > 0 && waited > config.slo_us) slo_misses++;
+            pending->status = status;
+            pending->done = true;
+        }
+        finished.notify_all();
+    }
+}
+
+template <class T>
+Batcher_stats Dynamic_batcher<T>::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    Batcher_stats result;
+    result.images = images;
+    result.batches = batches;
+    result.slo_misses = slo_misses;
+    result.mean_batch = batches ? (double)images / batches : 0;
+    result.p50_us = latency.percentile(50);
+    result.p99_us = latency.percentile(99);
+    result.max_us = latency.getMax();
+    return result;
+}
+
+#endif //REQUEST_BATCHER_H
@@ -0,0 +1,127 @@
+#ifndef SPARSE_MATRIX_H
+#define SPARSE_MATRIX_H
+
+#include <algorithm>
+#include <vector>
+
+#include "numeric_types.h"
+
+// how load_weights stores a conv layer's kernel_matrix
+enum Sparse_mode {
+    SPARSE_AUTO,    // CSR when the layer's density is below the threshold
+    SPARSE_OFF,     // always dense
+    SPARSE_ON,      // always CSR
+};
+
+// Below this fraction of nonzero weights the CSR kernel beats the dense gemm
+// (BM_conv_gemm in bench.cpp crosses over at about 20% for int and 30% for
+// float): it skips the zeros, but each nonzero costs an index load and the
+// im2col rows have to be transposed into panels first.
+static const double SPARSE_DENSITY_THRESHOLD = 0.25;
+
+// A kernel_matrix[depth][filters] compressed filter by filter: row f of the
+// CSR holds the nonzero weights of filter f and the depth index of each.
+template <class T>
+class Csr_matrix {
+public:
+    Csr_matrix() : rows(0), cols(0) {}
+
+    // dense is kernel_matrix laid out [depth][filters]
+    void pack(const T *dense, int depth, int filters) {
+        rows = filters;
+        cols = depth;
+        row_offsets.assign(1, 0);
+        col_indices.clear();
+        values.clear();
+        for (int f = 0; f < filters; f++) {
+            for (int k = 0; k < depth; k++) {
+                T value = dense[(long long)k * filters + f];
+                if (value == 0) continue;
+                col_indices.push_back(k);
+                values.push_back(value);
+            }
+            row_offsets.push_back(values.size());
+        }
+    }
+
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    long long getNonzeros() const { return values.size(); }
+    double density() const { return rows > 0 && cols > 0 ? (double)values.size() / ((double)rows * cols) : 0; }
+
+    const std::vector<int> &getRow_offsets() const { return row_offsets; }
+    const std::vector<int> &getCol_indices() const { return col_indices; }
+    const std::vector<T> &getValues() const { return values; }
+
+private:
+    int rows, cols;
+    std::vector<int> row_offsets;
+    std::vector<int> col_indices;
+    std::vector<T> values;
+};
+
+// fraction of nonzeros in a dense kernel_matrix
+template <class T>
+double matrix_density(const T *dense, long long count) {
+    long long nonzeros = 0;
+    for (long long i = 0; i < count; i++)
+        nonzeros += dense[i] != 0;
+    return count ? (double)nonzeros / count : 0;
+}
+
+// The sparse counterpart of gemm_tile: output[rows][cols] = a[rows][depth] *
+// kernel, where kernel is kernel_matrix in CSR form, restricted to the tile
+// [row_begin, row_end) x [col_begin, col_end). The im2col rows go through in
+// panels of SPARSE_PANEL, transposed so each nonzero weight updates the whole
+// panel with one contiguous (vectorizable) multiply-add.
+// gcc would otherwise vectorize the nonzero loop with gathers instead of the
+// panel update, which is several times slower.
+static const int SPARSE_PANEL = 8;
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define SPARSE_NO_LOOP_VECTORIZE __attribute__((optimize("no-tree-loop-vectorize")))
+#else
+#define SPARSE_NO_LOOP_VECTORIZE
+#endif
+
+template <class T>
+SPARSE_NO_LOOP_VECTORIZE
+void sparse_gemm_tile(const T *a, const Csr_matrix<T> &kernel, T *output, int depth, int cols, long long row_begin,
+                      long long row_end, int col_begin, int col_end) {
+    typedef typename Accumulator<T>::type Acc;
+    const int *offsets = kernel.getRow_offsets().data();
+    const int *indices = kernel.getCol_indices().data();
+    const T *values = kernel.getValues().data();
+
+    // reused across calls so steady-state inference does not allocate; the
+    // panel is converted to the accumulator type once, not once per filter
+    thread_local std::vector<Acc> panel;
+    if ((long long)panel.size() < (long long)depth * SPARSE_PANEL)
+        panel.resize((long long)depth * SPARSE_PANEL);
+    Acc *transposed = panel.data();
+
+    for (long long i = row_begin; i < row_end; i += SPARSE_PANEL) {
+        int panel_rows = (int)std::min<long long>(SPARSE_PANEL, row_end - i);
+        for (int k = 0; k < depth; k++) {
+            Acc *to = transposed + (long long)k * SPARSE_PANEL;
+            for (int r = 0; r < panel_rows; r++)
+                to[r] = a[(i + r) * depth + k];
+            for (int r = panel_rows; r < SPARSE_PANEL; r++)
+                to[r] = 0;
+        }
+
+        for (int f = col_begin; f < col_end; f++) {
+            Acc sum[SPARSE_PANEL] = {};
+            for (int n = offsets[f]; n < offsets[f + 1]; n++) {
+                const Acc *column = transposed + (long long)indices[n] * SPARSE_PANEL;
+                Acc w = values[n];
+                for (int r = 0; r < SPARSE_PANEL; r++)
+                    sum[r] += column[r] * w;
+            }
+            for (int r = 0; r < panel_rows; r++)
+                output[(i + r) * cols + f] = (T)sum[r];
+        }
+    }
+}
+
+#endif //SPARSE_MATRIX_H
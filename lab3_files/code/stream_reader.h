@@ -0,0 +1,205 @@
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_utils.h"
+#include "stream_utils.h"
+
+// Reads an initial_input file (text or binary) a chunk at a time and pushes
+// its values into a Stream as they are parsed, so a bounded stream holds the
+// whole pipeline to a few rows. Values are read like get_stream_initial_input
+// does: width * channel per text line, each token through parse_value<T>.
+template <class T>
+class Stream_reader {
+public:
+    Stream_reader(std::string file_name, int chunk_size = 1 << 16);
+    ~Stream_reader();
+
+    // reads the header; -1 if the file cannot be opened or is malformed
+    int open(int &padding, int &step_size);
+    // pushes every value into output, then closes it
+    int read_into(Stream<T> &output);
+
+    int getHeight() const { return height; }
+    int getWidth() const { return width; }
+    int getChannel() const { return channel; }
+    bool isBinary() const { return binary; }
+
+private:
+    bool fill();
+    int next_char();
+    int read_bytes(char *to, int count);
+    int read_text_header(std::vector<long long> &values);
+
+    std::string file_name;
+    int fd;
+    std::vector<char> buffer;
+    int position, filled;
+
+    bool binary;
+    int height, width, channel;
+};
+
+template <class T>
+Stream_reader<T>::Stream_reader(std::string file_name, int chunk_size) {
+    this->file_name = file_name;
+    fd = -1;
+    buffer.resize(chunk_size);
+    position = filled = 0;
+    binary = false;
+    height = width = channel = 0;
+}
+
+template <class T>
+Stream_reader<T>::~Stream_reader() {
+    if (fd >= 0) close(fd);
+}
+
+// refills the chunk once it is used up; false at end of file
+template <class T>
+bool Stream_reader<T>::fill() {
+    if (position < filled) return true;
+    ssize_t n;
+    do {
+        n = ::read(fd, buffer.data(), buffer.size());
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+    position = 0;
+    filled = n;
+    return true;
+}
+
+template <class T>
+int Stream_reader<T>::next_char() {
+    if (!fill()) return -1;
+    return (unsigned char)buffer[position++];
+}
+
+template <class T>
+int Stream_reader<T>::read_bytes(char *to, int count) {
+    int done = 0;
+    while (done < count && fill()) {
+        int n = std::min(count - done, filled - position);
+        memcpy(to + done, buffer.data() + position, n);
+        position += n;
+        done += n;
+    }
+    return done;
+}
+
+// first non-empty line as integers
+template <class T>
+int Stream_reader<T>::read_text_header(std::vector<long long> &values) {
+    std::string line;
+    int c;
+    while ((c = next_char()) >= 0) {
+        if (c == '\n') {
+            if (line.find_first_not_of(" \t\r") != std::string::npos) break;
+            line.clear();
+            continue;
+        }
+        line += (char)c;
+    }
+    const char *at = line.c_str();
+    while (true) {
+        char *end;
+        long long value = strtoll(at, &end, 10);
+        if (end == at) break;
+        values.push_back(value);
+        at = end;
+    }
+    return values.size() >= 5 ? 0 : -1;
+}
+
+template <class T>
+int Stream_reader<T>::open(int &padding, int &step_size) {
+    fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char magic[sizeof(BINARY_TENSOR_MAGIC)];
+    int got = read_bytes(magic, sizeof(magic));
+    if (got == (int)sizeof(magic) && memcmp(magic, BINARY_TENSOR_MAGIC, sizeof(magic)) == 0) {
+        binary = true;
+        int header_count = 0, element_size = 0, dtype = DTYPE_UNKNOWN;
+        if (read_bytes((char *)&header_count, sizeof(int)) != sizeof(int) || header_count < 5 || header_count > 16)
+            return -1;
+        std::vector<int> header(header_count);
+        if (read_bytes((char *)header.data(), header_count * sizeof(int)) != header_count * (int)sizeof(int))
+            return -1;
+        if (read_bytes((char *)&element_size, sizeof(int)) != sizeof(int) || element_size != (int)sizeof(T))
+            return -1;
+        if (read_bytes((char *)&dtype, sizeof(int)) != sizeof(int) || dtype != binary_dtype<T>())
+            return -1;
+        height = header[0];
+        width = header[1];
+        channel = header[2];
+        padding = header[3];
+        step_size = header[4];
+        return 0;
+    }
+
+    // text: start over and parse the header line
+    if (lseek(fd, 0, SEEK_SET) != 0) return -1;
+    position = filled = 0;
+    std::vector<long long> header;
+    if (read_text_header(header) != 0) return -1;
+    height = header[0];
+    width = header[1];
+    channel = header[2];
+    padding = header[3];
+    step_size = header[4];
+    return 0;
+}
+
+template <class T>
+int Stream_reader<T>::read_into(Stream<T> &output) {
+    long long count = (long long)height * width * channel;
+    long long pushed = 0;
+
+    if (binary) {
+        T value;
+        while (pushed < count && read_bytes((char *)&value, sizeof(T)) == (int)sizeof(T)) {
+            output.write(value);
+            pushed++;
+        }
+    } else {
+        // a token runs to the next whitespace and is converted like
+        // get_stream_initial_input does; values past width * channel on a
+        // line are ignored
+        int per_line = width * channel;
+        int column = 0;
+        std::string token;
+        int c;
+        do {
+            c = next_char();
+            bool space = c < 0 || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+            if (!space) {
+                token += (char)c;
+                continue;
+            }
+            if (!token.empty()) {
+                if (column < per_line && pushed < count) {
+                    output.write(parse_value<T>(token));
+                    pushed++;
+                }
+                column++;
+                token.clear();
+            }
+            if (c == '\n') column = 0;
+        } while (c >= 0 && pushed < count);
+    }
+
+    output.close();
+    return pushed == count ? 0 : -1;
+}
+
+#endif //STREAM_READER_H
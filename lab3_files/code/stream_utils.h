@@ -1,44 +1,136 @@
 #ifndef STREAM_UTILS_H
 #define STREAM_UTILS_H
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <queue>
+#include "allocator.h"
+#include "profiler.h"
 
+// capacity 0 is the original unbounded, single-threaded FIFO. With a
+// capacity the stream is a bounded channel between two threads: write blocks
+// while it is full, and empty()/read() wait for data until the writer calls
+// close(), so empty() means "drained and closed".
 template <class T>
 class Stream {
 public:
-    Stream();
-    ~Stream() { delete(mQueue); }
+    Stream(size_t capacity = 0);
+    ~Stream();
     void write(T data);
-    int empty() { return mQueue->empty(); }
+    int empty();
     T read();
     void clear();
+    void close();
+    size_t getCapacity() const { return capacity; }
 private:
-    std::queue<T> *mQueue;
+    typedef std::queue<T, std::deque<T, Std_allocator<T> > > Queue;
+    Queue *mQueue;
+    size_t capacity;
+    bool closed;
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+#ifdef MLARCH_PROFILE
+    long long push_count;
+    long long pop_count;
+#endif
 };
 
 template <class T>
-Stream<T>::Stream() {
-    mQueue = new std::queue<T>();
-    while (!mQueue->empty())
-        mQueue->pop();
+Stream<T>::Stream(size_t capacity) {
+    // the deque's blocks come from the allocator current at construction;
+    // a bounded stream is shared by two threads, so it stays on the heap
+    Allocator *allocator = capacity > 0 ? default_allocator() : current_allocator();
+    mQueue = new Queue(std::deque<T, Std_allocator<T> >(Std_allocator<T>(allocator)));
+    this->capacity = capacity;
+    closed = false;
+#ifdef MLARCH_PROFILE
+    push_count = 0;
+    pop_count = 0;
+#endif
+}
+
+template <class T>
+Stream<T>::~Stream() {
+#ifdef MLARCH_PROFILE
+    PROFILE_COUNT("stream_push", push_count);
+    PROFILE_COUNT("stream_pop", pop_count);
+#endif
+    delete(mQueue);
 }
 
 template <class T>
 void Stream<T>::write(T data) {
+    if (capacity == 0) {
+#ifdef MLARCH_PROFILE
+        push_count++;
+#endif
+        mQueue->push(data);
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    not_full.wait(guard, [this] { return mQueue->size() < capacity || closed; });
+#ifdef MLARCH_PROFILE
+    push_count++;
+#endif
     mQueue->push(data);
+    guard.unlock();
+    not_empty.notify_one();
+}
+
+template <class T>
+int Stream<T>::empty() {
+    if (capacity == 0) return mQueue->empty();
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this] { return !mQueue->empty() || closed; });
+    return mQueue->empty();
 }
 
 template <class T>
 T Stream<T>::read() {
+    if (capacity == 0) {
+#ifdef MLARCH_PROFILE
+        pop_count++;
+#endif
+        T value = mQueue->front();
+        mQueue->pop();
+        return value;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this] { return !mQueue->empty() || closed; });
+    if (mQueue->empty()) return T();
+#ifdef MLARCH_PROFILE
+    pop_count++;
+#endif
     T value = mQueue->front();
     mQueue->pop();
+    guard.unlock();
+    not_full.notify_one();
     return value;
 }
 
 template <class T>
 void Stream<T>::clear() {
+    std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+    if (capacity > 0) guard.lock();
     while (!mQueue->empty())
         mQueue->pop();
+    if (capacity > 0) {
+        guard.unlock();
+        not_full.notify_all();
+    }
+}
+
+// no more writes; readers drain what is left and then see empty()
+template <class T>
+void Stream<T>::close() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+    }
+    not_empty.notify_all();
+    not_full.notify_all();
 }
 
 #endif //STREAM_UTILS_H
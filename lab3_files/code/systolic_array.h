@@ -0,0 +1,180 @@
+#ifndef SYSTOLIC_ARRAY_H
+#define SYSTOLIC_ARRAY_H
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#include "layer_kernels.h"
+#include "stream_utils.h"
+#include "thread_pool.h"
+
+// An R x C output-stationary array: PE (r, c) accumulates one output, window
+// r of the current row tile times filter c of the current filter tile.
+// Windows (input_matrix rows) enter from the left and kernel_matrix columns
+// from the top, both skewed by one cycle per PE.
+struct Systolic_config {
+    int rows;
+    int cols;
+    double stream_bandwidth;    // values per cycle the stream delivers to the input buffer
+    int input_buffer_tiles;     // row tiles of `rows` windows the input buffer holds (2 = double buffered)
+    long long weight_buffer;    // values; 0 means the whole kernel_matrix stays on chip
+    int value_bytes;
+
+    Systolic_config(int rows = 16, int cols = 16)
+        : rows(rows), cols(cols), stream_bandwidth(rows), input_buffer_tiles(2), weight_buffer(0),
+          value_bytes(4) {}
+};
+
+struct Systolic_stats {
+    long long windows, depth, filters;  // the layer's M x K times K x N
+    long long cycles;
+    long long stall_cycles;             // array idle waiting for the stream
+    long long macs;
+    double utilization;                 // macs / (cycles * rows * cols)
+    long long peak_input_buffer;        // values
+    long long weight_buffer;            // values resident at once
+    long long input_bytes, weight_bytes, output_bytes;
+    double bandwidth;                   // off-chip bytes per cycle
+
+    Systolic_stats()
+        : windows(0), depth(0), filters(0), cycles(0), stall_cycles(0), macs(0), utilization(0),
+          peak_input_buffer(0), weight_buffer(0), input_bytes(0), weight_bytes(0), output_bytes(0),
+          bandwidth(0) {}
+
+    // totals over layers run one after another
+    void add(const Systolic_stats &layer, int rows, int cols) {
+        windows += layer.windows;
+        cycles += layer.cycles;
+        stall_cycles += layer.stall_cycles;
+        macs += layer.macs;
+        peak_input_buffer = std::max(peak_input_buffer, layer.peak_input_buffer);
+        weight_buffer = std::max(weight_buffer, layer.weight_buffer);
+        input_bytes += layer.input_bytes;
+        weight_bytes += layer.weight_bytes;
+        output_bytes += layer.output_bytes;
+        utilization = cycles ? (double)macs / ((double)cycles * rows * cols) : 0;
+        bandwidth = cycles ? (double)(input_bytes + weight_bytes + output_bytes) / cycles : 0;
+    }
+};
+
+// Cycle-approximate timing works on whole tiles. A row tile may start once
+// all its windows are in the input buffer; its filter tiles then issue back
+// to back, K cycles apart, since each PE hands its finished sum to a shadow
+// register while the next tile streams in. The last tile finishes
+// K + rows + cols - 2 cycles after it issues and then drains down the columns.
+// The stream stalls while the input buffer is full and a row tile leaves the
+// buffer once its last filter tile has issued. This costs O(row tiles), so a
+// whole network sweeps over many array sizes in milliseconds.
+template <class T>
+class Systolic_array {
+public:
+    Systolic_array(const Systolic_config &config);
+
+    Systolic_stats estimate(long long windows, int depth, int filters) const;
+    // consumes `windows` rows of `depth` values from the stream, R at a time,
+    // and writes output[windows][filters] = windows * kernel ([depth][filters]);
+    // the filter tiles of a row tile run on the pool when there is one
+    Systolic_stats run_stream(Stream<T> &input_matrix, const T *kernel, long long windows, int depth, int filters,
+                              T *output, Thread_pool *pool = NULL);
+
+    const Systolic_config &getConfig() const { return config; }
+
+private:
+    Systolic_config config;
+};
+
+template <class T>
+Systolic_array<T>::Systolic_array(const Systolic_config &config) {
+    this->config = config;
+    if (this->config.rows < 1) this->config.rows = 1;
+    if (this->config.cols < 1) this->config.cols = 1;
+    if (this->config.input_buffer_tiles < 1) this->config.input_buffer_tiles = 1;
+    if (this->config.stream_bandwidth <= 0) this->config.stream_bandwidth = this->config.rows;
+}
+
+template <class T>
+Systolic_stats Systolic_array<T>::estimate(long long windows, int depth, int filters) const {
+    Systolic_stats stats;
+    int R = config.rows, C = config.cols;
+    stats.windows = windows;
+    stats.depth = depth;
+    stats.filters = filters;
+    stats.macs = windows * depth * filters;
+    if (windows <= 0 || depth <= 0 || filters <= 0) return stats;
+
+    long long row_tiles = (windows + R - 1) / R;
+    long long col_tiles = (filters + C - 1) / C;
+    int last_cols = filters - (col_tiles - 1) * C;
+    long long kernel_values = (long long)depth * filters;
+    bool weights_fit = config.weight_buffer == 0 || config.weight_buffer >= kernel_values;
+
+    // (retire cycle, values) of the row tiles still in the input buffer
+    std::deque<std::pair<long long, long long> > resident;
+    long long arrived = 0, issue = 0, finish = 0, last_rows = R;
+    for (long long i = 0; i < row_tiles; i++) {
+        long long rows = std::min<long long>(R, windows - i * R);
+        long long values = rows * depth;
+
+        // the stream fills the tile once a slot is free
+        long long load_start = arrived;
+        if ((int)resident.size() >= config.input_buffer_tiles) {
+            load_start = std::max(load_start, resident.front().first);
+            resident.pop_front();
+        }
+        while (!resident.empty() && resident.front().first <= load_start)
+            resident.pop_front();
+        arrived = load_start + (long long)std::ceil(values / config.stream_bandwidth);
+
+        long long occupancy = values;
+        for (const std::pair<long long, long long> &tile : resident)
+            occupancy += tile.second;
+        stats.peak_input_buffer = std::max(stats.peak_input_buffer, occupancy);
+
+        long long start = std::max(issue, arrived);
+        stats.stall_cycles += start - issue;
+        issue = start + col_tiles * depth;
+        // the last filter tile issued at issue - depth
+        finish = issue + rows + last_cols - 2;
+        resident.push_back(std::make_pair(issue, values));
+        last_rows = rows;
+    }
+
+    stats.cycles = finish + last_rows;
+    stats.utilization = (double)stats.macs / ((double)stats.cycles * R * C);
+    stats.weight_buffer = weights_fit ? kernel_values : (long long)depth * C;
+    stats.input_bytes = windows * depth * config.value_bytes;
+    stats.weight_bytes = kernel_values * config.value_bytes * (weights_fit ? 1 : row_tiles);
+    stats.output_bytes = windows * filters * config.value_bytes;
+    stats.bandwidth = (double)(stats.input_bytes + stats.weight_bytes + stats.output_bytes) / stats.cycles;
+    return stats;
+}
+
+template <class T>
+Systolic_stats Systolic_array<T>::run_stream(Stream<T> &input_matrix, const T *kernel, long long windows, int depth,
+                                             int filters, T *output, Thread_pool *pool) {
+    int R = config.rows, C = config.cols;
+    long long col_tiles = (filters + C - 1) / C;
+    std::vector<T> tile((long long)R * depth);
+
+    for (long long first = 0; first < windows; first += R) {
+        long long rows = std::min<long long>(R, windows - first);
+        for (long long i = 0; i < rows * depth; i++)
+            tile[i] = input_matrix.empty() ? (T)0 : input_matrix.read();
+
+        T *out = output + first * filters;
+        auto filter_tiles = [&](long long begin, long long end) {
+            for (long long c = begin; c < end; c++)
+                gemm_tile(tile.data(), kernel, out, depth, filters, 0, rows, c * C,
+                          std::min<long long>(filters, (c + 1) * C));
+        };
+        if (pool)
+            pool->parallel_for(0, col_tiles, 1, filter_tiles);
+        else
+            filter_tiles(0, col_tiles);
+    }
+    return estimate(windows, depth, filters);
+}
+
+#endif //SYSTOLIC_ARRAY_H
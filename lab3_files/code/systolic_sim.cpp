@@ -0,0 +1,199 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "network.h"
+#include "stream_reader.h"
+#include "systolic_array.h"
+#include "thread_pool.h"
+
+// Output-stationary systolic array model for a network's conv layers, e.g.
+//   ./systolic_sim ./e2_model/network_2 --rows 16 --cols 16
+//   ./systolic_sim ./e2_model/network_2 --sweep 4,8,16,32,64 --bandwidth 8
+// --functional streams each layer's initial_input through conv_convert_stream
+// into the array and uses the file's padding and stride instead of the cfg's.
+
+static void usage(const char *program) {
+    std::cout << "usage: " << program << " <model_path> [--rows R] [--cols C] [--sweep N,N,...]"
+              << " [--bandwidth V] [--buffer-tiles N] [--weight-buffer V] [--functional] [--threads N]"
+              << std::endl;
+}
+
+// "8,16,32" -> {8, 16, 32}
+static std::vector<int> parse_sizes(const char *text) {
+    std::vector<int> sizes;
+    while (*text) {
+        char *end;
+        long size = strtol(text, &end, 10);
+        if (end == text) break;
+        if (size > 0) sizes.push_back(size);
+        text = *end == ',' ? end + 1 : end;
+    }
+    return sizes;
+}
+
+// M x K times K x N of one conv layer
+struct Conv_shape {
+    long long windows;
+    int depth;
+    int filters;
+};
+
+static void print_header() {
+    printf("%-8s %8s %6s %6s %12s %7s %10s %12s %12s %9s\n", "layer", "M", "K", "N", "cycles", "util%",
+           "stalls", "in_buffer", "w_buffer", "B/cycle");
+}
+
+// totals have no single K and N
+static void print_stats(const std::string &name, const Systolic_stats &stats) {
+    std::string depth = stats.depth ? std::to_string(stats.depth) : "-";
+    std::string filters = stats.filters ? std::to_string(stats.filters) : "-";
+    printf("%-8s %8lld %6s %6s %12lld %7.2f %10lld %12lld %12lld %9.2f\n", name.c_str(), stats.windows,
+           depth.c_str(), filters.c_str(), stats.cycles, stats.utilization * 100, stats.stall_cycles,
+           stats.peak_input_buffer, stats.weight_buffer, stats.bandwidth);
+}
+
+// streams layer i's initial_input through conv_convert_stream into the array
+static int run_functional(Network<int> &network, const std::string &model_path, int i, Systolic_array<int> &array,
+                          Thread_pool *pool, Systolic_stats &stats) {
+    std::string layer_path = model_path + ".layer_" + std::to_string(i);
+    // the array multiplies whole windows by one dense kernel_matrix
+    if (network.getKernel_channel()[i] != network.getInput_channel()[i]) {
+        std::cout << "layer " << i << " is grouped, --functional needs dense convolutions" << std::endl;
+        return -1;
+    }
+    File_utils<int> kernel_util(layer_path + ".initial_kernel");
+    kernel_util.parse_file();
+    Array4D<int> kernel;
+    std::vector<int> packed;
+    if (kernel_util.get_initial_kernel(kernel) != 0 || network.pack_kernel(i, kernel, packed) != 0) {
+        std::cout << "cannot read " << layer_path << ".initial_kernel" << std::endl;
+        return -1;
+    }
+
+    int padding, stride;
+    Stream_reader<int> reader(layer_path + ".initial_input");
+    if (reader.open(padding, stride) != 0) {
+        std::cout << "cannot read " << layer_path << ".initial_input" << std::endl;
+        return -1;
+    }
+    // the file's padding and stride with the cfg's kernel shape and dilation
+    Conv_params conv = network.getConv_params()[i];
+    conv.set_padding(padding);
+    conv.stride_h = conv.stride_w = stride;
+    long long out_h = conv.output_height(reader.getHeight());
+    long long out_w = conv.output_width(reader.getWidth());
+    int depth = conv.size_h * conv.size_w * network.getInput_channel()[i];
+    int filters = network.getKernel_dimension()[i];
+
+    Stream<int> input(2 * network.getInput_width()[i] * network.getInput_channel()[i]);
+    Stream<int> windows((size_t)array.getConfig().rows * depth);
+    std::thread producer([&] { reader.read_into(input); });
+    std::thread converter([&] {
+        network.conv_convert_stream(i, conv, input, windows);
+        windows.close();
+        while (!input.empty())
+            input.read();
+    });
+
+    std::vector<int> output(out_h * out_w * filters);
+    stats = array.run_stream(windows, packed.data(), out_h * out_w, depth, filters, output.data(), pool);
+    while (!windows.empty())
+        windows.read();
+    producer.join();
+    converter.join();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string model_path = argv[1];
+    Systolic_config config;
+    std::vector<int> sweep;
+    bool bandwidth_set = false, functional = false;
+    int threads = 0;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--rows" && has_value) config.rows = atoi(argv[++i]);
+        else if (arg == "--cols" && has_value) config.cols = atoi(argv[++i]);
+        else if (arg == "--sweep" && has_value) sweep = parse_sizes(argv[++i]);
+        else if (arg == "--bandwidth" && has_value) {
+            config.stream_bandwidth = atof(argv[++i]);
+            bandwidth_set = true;
+        }
+        else if (arg == "--buffer-tiles" && has_value) config.input_buffer_tiles = atoi(argv[++i]);
+        else if (arg == "--weight-buffer" && has_value) config.weight_buffer = atoll(argv[++i]);
+        else if (arg == "--functional") functional = true;
+        else if (arg == "--threads" && has_value) threads = atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.rows <= 0 || config.cols <= 0) {
+        std::cout << "array dimensions must be positive" << std::endl;
+        return 1;
+    }
+    if (!bandwidth_set) config.stream_bandwidth = config.rows;
+
+    Network<int> network(model_path + ".cfg");
+    if (network.obtain_parameters() != 0)
+        return 1;
+    std::vector<Conv_shape> shapes;
+    for (int i = 0; i < network.getLayer_number(); i++) {
+        Conv_shape shape;
+        shape.windows = (long long)network.getOutput_height()[i] * network.getOutput_width()[i];
+        const Conv_params &conv = network.getConv_params()[i];
+        shape.depth = conv.size_h * conv.size_w * network.getKernel_channel()[i];
+        shape.filters = network.getKernel_dimension()[i];
+        shapes.push_back(shape);
+    }
+    Thread_pool pool(threads);
+
+    if (!sweep.empty()) {
+        // one square array size per task; without --bandwidth the stream keeps up with the array
+        std::vector<Systolic_stats> totals(sweep.size());
+        pool.parallel_for(0, sweep.size(), 1, [&](long long first, long long last) {
+            for (long long s = first; s < last; s++) {
+                Systolic_config sized = config;
+                sized.rows = sized.cols = sweep[s];
+                if (!bandwidth_set) sized.stream_bandwidth = sweep[s];
+                Systolic_array<int> array(sized);
+                for (const Conv_shape &shape : shapes)
+                    totals[s].add(array.estimate(shape.windows, shape.depth, shape.filters), sweep[s], sweep[s]);
+            }
+        });
+        print_header();
+        for (size_t s = 0; s < sweep.size(); s++)
+            print_stats(std::to_string(sweep[s]) + "x" + std::to_string(sweep[s]), totals[s]);
+        return 0;
+    }
+
+    Systolic_array<int> array(config);
+    Systolic_stats total;
+    printf("%dx%d array, %.2f values/cycle stream, %d input buffer tiles\n", config.rows, config.cols,
+           config.stream_bandwidth, config.input_buffer_tiles);
+    print_header();
+    for (int i = 0; i < (int)shapes.size(); i++) {
+        Systolic_stats stats;
+        if (functional) {
+            if (run_functional(network, model_path, i, array, &pool, stats) != 0)
+                return 1;
+        } else {
+            stats = array.estimate(shapes[i].windows, shapes[i].depth, shapes[i].filters);
+        }
+        print_stats(std::to_string(i), stats);
+        total.add(stats, config.rows, config.cols);
+    }
+    print_stats("total", total);
+    return 0;
+}
@@ -1,25 +1,42 @@
 #ifndef TEST_H
 #define TEST_H
 
+#include "alloc_tracker.h"
+#include "allocator.h"
+#include "async_io.h"
 #include "network.h"
+#include "profiler.h"
+#include "stream_reader.h"
+#include <deque>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 template <class T>
 class Test {
 public:
     Test(std::string model_path);
+    ~Test();
     void initialize();
     void generate_layer_file_paths();
     void generate_parameter_file();
     void generate_input_kernel();
 
     void generate_matrix();
+    std::string format_matrix(Array2D<T> &matrix);
     void input_matrix_tofile(int layer_id, Array2D<T> &input_matrix);
     void kernel_matrix_tofile(int layer_id, Array2D<T> &kernel_matrix);
 
     void generate_stream();
+    std::string format_stream(int layer_id, Stream<T> &stream_input_matrix);
+    void write_stream(int layer_id, Stream<T> &stream_input_matrix, std::ostream &out);
+    void write_rows(Stream<T> &stream, int row_width, std::ostream &out);
     void stream_tofile(int layer_id, Stream<T> &stream_input_matrix);
+    void generate_stream_direct();
+
+    void generate_output(bool fused = false);
+    void output_tofile(Array3D<T> &output);
 
     const std::vector<int> &getPaddings() const;
     void setPaddings(const std::vector<int> &paddings);
@@ -28,6 +45,9 @@ public:
     Network<T> *getNetwork() const;
 
 private:
+    const std::string &wait_read(Io_handle &request);
+    void wait_write(Io_handle &request);
+
     std::string model_path;
     std::string model_cfg_file_path;
     std::string model_parameter_file_path;
@@ -39,11 +59,14 @@ private:
     std::vector<std::string> input_matrix_file_paths;
 
     std::vector<std::string> stream_input_matrix_file_paths;
+    std::vector<std::string> stream_output_file_paths;
 
     std::vector<int> paddings;
     std::vector<int> strides;
 
     Network<T> *network;
+    Thread_pool *thread_pool;
+    Async_io *io;
 };
 
 template <class T>
@@ -59,18 +82,55 @@ Test<T>::Test(std::string model_path) {
     input_matrix_file_paths.clear();
 
     stream_input_matrix_file_paths.clear();
+    network = NULL;
+    thread_pool = NULL;
+    io = NULL;
+}
+
+template <class T>
+Test<T>::~Test() {
+    // the network holds a pointer to the pool, so it goes first
+    delete network;
+    delete thread_pool;
+    delete io;
 }
 
+// MLARCH_THREADS=<n> splits each conv over n threads (0 = one per CPU);
+// MLARCH_PIN=1 pins the workers, node by node. MLARCH_IO picks the layer
+// file I/O backend (see create_async_io). MLARCH_SPARSE=dense|sparse forces
+// the kernel format of --forward, otherwise it is chosen by density.
+// MLARCH_HUGE_PAGES=thp|explicit backs the forward arena and the layer
+// matrices of generate_matrix with 2 MB pages
 template <class T>
 void Test<T>::initialize() {
     network = new Network<T>(model_cfg_file_path);
     network->initialize();
+    io = create_async_io();
+
+    const char *threads = std::getenv("MLARCH_THREADS");
+    if (threads && atoi(threads) != 1) {
+        const char *pin = std::getenv("MLARCH_PIN");
+        thread_pool = new Thread_pool(atoi(threads), pin && atoi(pin) != 0);
+        network->setThread_pool(thread_pool);
+    }
+
+    const char *sparse = std::getenv("MLARCH_SPARSE");
+    if (sparse && std::string(sparse) == "dense")
+        network->setSparse_mode(SPARSE_OFF);
+    else if (sparse && std::string(sparse) == "sparse")
+        network->setSparse_mode(SPARSE_ON);
+    network->setHuge_pages(huge_page_mode_from_env());
 }
 
 template <class T>
 void Test<T>::generate_parameter_file() {
-    network->obtain_parameters();
+    ALLOC_PHASE("parameters");
+    PROFILE_LAYER(-1);
+    ALLOC_LAYER(-1);
+    if (network->obtain_parameters() != 0)
+        exit(1);
 
+    PROFILE_SCOPE("write");
     std::ofstream parameter_ofstream(model_parameter_file_path, std::ofstream::trunc);
     parameter_ofstream << network->get_parameters();
     parameter_ofstream.close();
@@ -85,6 +145,7 @@ void Test<T>::generate_layer_file_paths() {
     input_matrix_file_paths.clear();
 
     stream_input_matrix_file_paths.clear();
+    stream_output_file_paths.clear();
 
     for (int i = 0; i < network->getLayer_number(); i++) {
         std::string initial_kernel_file_path = model_path + ".layer_" + std::to_string(i) + ".initial_kernel";
@@ -101,6 +162,7 @@ void Test<T>::generate_layer_file_paths() {
         kernel_matrix_file_paths.push_back(kernel_matrix_file_path);
         input_matrix_file_paths.push_back(input_matrix_file_path);
         stream_input_matrix_file_paths.push_back(stream_input_matrix_file_path);
+        stream_output_file_paths.push_back(model_path + ".layer_" + std::to_string(i) + ".output.stream");
     }
 
 }
@@ -152,8 +214,9 @@ void Test<T>::generate_input_kernel() {
         std::string kernel_contents = "";
 
         int dimension = network->getKernel_dimension()[s];
-        int height = network->getKernel_size()[s];
-        int width = network->getKernel_size()[s];
+        Conv_params conv = network->conv_geometry(s, 0, 1);
+        int height = conv.size_h;
+        int width = conv.size_w;
         int channel = network->getKernel_channel()[s];
 
         kernel_contents += std::to_string(dimension);
@@ -184,112 +247,327 @@ void Test<T>::generate_input_kernel() {
 
 template <class T>
 void Test<T>::generate_matrix() {
-    for (int i = 0; i < network->getLayer_number(); i++) {
-        File_utils<T> *input_util = new File_utils<T>(initial_input_file_paths[i]);
-        input_util->parse_file();
-
-        File_utils<T> *kernel_util = new File_utils<T>(initial_kernel_file_paths[i]);
-        kernel_util->parse_file();
+    // layer i+1's files are read and layer i-1's matrices written while
+    // layer i computes; at most two layers of writes are in flight
+    ALLOC_PHASE("matrix");
+    int layers = network->getLayer_number();
+    std::vector<Io_handle> input_reads(layers), kernel_reads(layers);
+    std::deque<Io_handle> writes;
+    if (layers > 0) {
+        input_reads[0] = io->read(initial_input_file_paths[0]);
+        kernel_reads[0] = io->read(initial_kernel_file_paths[0]);
+    }
 
+    // every container of a layer draws from this pool; nothing outlives the
+    // iteration, so it is rewound before the next layer instead of freed
+    Pool_allocator layer_pool(1 << 20, network->getHuge_pages());
+    for (int i = 0; i < layers; i++) {
+        PROFILE_LAYER(i);
+        ALLOC_LAYER(i);
+        if (i + 1 < layers) {
+            input_reads[i + 1] = io->read(initial_input_file_paths[i + 1]);
+            kernel_reads[i + 1] = io->read(initial_kernel_file_paths[i + 1]);
+        }
+        layer_pool.reset();
+        Allocator_scope scope(&layer_pool);
         Array3D<T> initial_input;
-        int padding, step_size;
-        input_util->get_initial_input(initial_input, padding, step_size);
-
         Array4D<T> initial_kernel;
-        kernel_util->get_initial_kernel(initial_kernel);
+        int padding, step_size;
+        {
+            PROFILE_SCOPE("parse");
+            File_utils<T> input_util(initial_input_file_paths[i]);
+            input_util.parse_buffer(wait_read(input_reads[i]));
+
+            File_utils<T> kernel_util(initial_kernel_file_paths[i]);
+            kernel_util.parse_buffer(wait_read(kernel_reads[i]));
+            input_reads[i].reset();
+            kernel_reads[i].reset();
+
+            input_util.get_initial_input(initial_input, padding, step_size);
+            kernel_util.get_initial_kernel(initial_kernel);
+        }
 
         Array2D<T> input_matrix;
         Array2D<T> kernel_matrix;
 
         network->conv_convert(i, padding, step_size, initial_input, initial_kernel, input_matrix, kernel_matrix);
 
-        input_matrix_tofile(i, input_matrix);
-        kernel_matrix_tofile(i, kernel_matrix);
+        PROFILE_SCOPE("write");
+        while (writes.size() > 2) {
+            wait_write(writes.front());
+            writes.pop_front();
+        }
+        writes.push_back(io->write(input_matrix_file_paths[i], format_matrix(input_matrix) + "\n"));
+        writes.push_back(io->write(kernel_matrix_file_paths[i], format_matrix(kernel_matrix) + "\n"));
     }
+    for (Io_handle &write : writes)
+        wait_write(write);
+    PROFILE_LAYER(-1);
+    ALLOC_LAYER(-1);
 }
 
 template <class T>
 void Test<T>::generate_stream(){
+    // each layer is a three-stage pipeline over bounded streams: a reader
+    // thread parses initial_input as it reads it, this thread converts, and
+    // a writer thread formats the windows into the output file. Memory stays
+    // at a few rows end to end instead of whole files.
+    ALLOC_PHASE("stream");
     for (int i = 0; i < network->getLayer_number(); i++) {
-        File_utils<T> *stream_input_util = new File_utils<T>(initial_input_file_paths[i]);
-        stream_input_util->parse_file();
+        PROFILE_LAYER(i);
+        ALLOC_LAYER(i);
+        int padding, step_size;
+        Stream_reader<T> reader(initial_input_file_paths[i]);
+        if (reader.open(padding, step_size) != 0) {
+            std::cout << "cannot open file!" << std::endl;
+            exit(1);
+        }
+
+        // the file's padding and stride with the cfg's kernel shape and dilation
+        Conv_params conv = network->conv_geometry(i, padding, step_size);
+        int row_length = network->getInput_width()[i] * network->getInput_channel()[i];
+        int window_length = conv.size_h * conv.size_w * network->getInput_channel()[i];
+        Stream<T> initial_input_stream(2 * row_length);
+        Stream<T> input_matrix_stream((size_t)window_length * conv.output_width(reader.getWidth()));
+
+        int read_status = 0;
+        std::thread producer([&] { read_status = reader.read_into(initial_input_stream); });
+        std::ofstream input_matrix_ofstream(stream_input_matrix_file_paths[i], std::ofstream::trunc);
+        std::thread writer([&] {
+            write_stream(i, input_matrix_stream, input_matrix_ofstream);
+            input_matrix_ofstream << std::endl;
+        });
+
+        {
+            PROFILE_SCOPE("stream_convert");
+            network->conv_convert_stream(i, conv, initial_input_stream, input_matrix_stream);
+        }
+        input_matrix_stream.close();
+        // rows below the last window are never read by the converter
+        while (!initial_input_stream.empty())
+            initial_input_stream.read();
+
+        PROFILE_SCOPE("stream_write");
+        producer.join();
+        writer.join();
+        input_matrix_ofstream.close();
+        // a short file closes the stream early and the windows fill with zeros
+        if (read_status != 0) {
+            std::cout << initial_input_file_paths[i] << ": fewer values than its header says" << std::endl;
+            exit(1);
+        }
+    }
+    PROFILE_LAYER(-1);
+    ALLOC_LAYER(-1);
+}
+
+// the streaming pipeline of generate_stream with the convolution done on
+// the line buffer: each layer's activations go to layer_<i>.output.stream in
+// the .output format, one output row per line
+template <class T>
+void Test<T>::generate_stream_direct() {
+    ALLOC_PHASE("stream_direct");
+    for (int i = 0; i < network->getLayer_number(); i++) {
+        PROFILE_LAYER(i);
+        ALLOC_LAYER(i);
+        Array4D<T> kernel;
+        {
+            PROFILE_SCOPE("parse");
+            File_utils<T> kernel_util(initial_kernel_file_paths[i]);
+            kernel_util.parse_file();
+            kernel_util.get_initial_kernel(kernel);
+        }
 
-        Stream<T> initial_input_stream;
         int padding, step_size;
-        stream_input_util->get_stream_initial_input(initial_input_stream, padding, step_size);
+        Stream_reader<T> reader(initial_input_file_paths[i]);
+        if (reader.open(padding, step_size) != 0) {
+            std::cout << "cannot open file!" << std::endl;
+            exit(1);
+        }
 
-        Stream<T> input_matrix_stream;
+        Conv_params conv = network->conv_geometry(i, padding, step_size);
+        int output_h = conv.output_height(reader.getHeight());
+        int output_w = conv.output_width(reader.getWidth());
+        int row_width = output_w * network->getKernel_dimension()[i];
+        Stream<T> initial_input_stream(2 * network->getInput_width()[i] * network->getInput_channel()[i]);
+        Stream<T> output_stream(row_width);
+
+        int read_status = 0;
+        std::thread producer([&] { read_status = reader.read_into(initial_input_stream); });
+        std::ofstream output_ofstream(stream_output_file_paths[i], std::ofstream::trunc);
+        output_ofstream << output_h << " " << output_w << " " << network->getKernel_dimension()[i] << "\n";
+        std::thread writer([&] { write_rows(output_stream, row_width, output_ofstream); });
+
+        int status;
+        {
+            PROFILE_SCOPE("stream_conv");
+            status = network->conv_direct_stream(i, conv, initial_input_stream, kernel, output_stream);
+        }
+        output_stream.close();
+        while (!initial_input_stream.empty())
+            initial_input_stream.read();
+
+        PROFILE_SCOPE("stream_write");
+        producer.join();
+        writer.join();
+        output_ofstream.close();
+        if (read_status != 0) {
+            std::cout << initial_input_file_paths[i] << ": fewer values than its header says" << std::endl;
+            exit(1);
+        }
+        if (status != 0)
+            exit(1);
+    }
+    PROFILE_LAYER(-1);
+    ALLOC_LAYER(-1);
+}
 
-        network->conv_convert_stream(i, padding, step_size, initial_input_stream, input_matrix_stream);
+template <class T>
+const std::string &Test<T>::wait_read(Io_handle &request) {
+    PROFILE_SCOPE("io_wait");
+    if (io->wait(request) != 0) {
+        std::cout << "cannot open file!" << std::endl;
+        exit(1);
+    }
+    return request->data;
+}
 
-        stream_tofile(i, input_matrix_stream);
+template <class T>
+void Test<T>::wait_write(Io_handle &request) {
+    PROFILE_SCOPE("io_wait");
+    if (io->wait(request) != 0) {
+        std::cout << "cannot write " << request->path << ": " << strerror(-request->status) << std::endl;
+        exit(1);
     }
 }
 
+// whole-network inference from layer 0's initial_input using every layer's
+// initial_kernel; the result goes to <model>.output. fused runs conv/maxpool
+// chains through forward_fused instead of layer by layer
 template <class T>
-void Test<T>::input_matrix_tofile(int layer_id, Array2D<T> &input_matrix) {
+void Test<T>::generate_output(bool fused) {
+    ALLOC_PHASE("output");
+    std::vector<Array4D<T> > kernels(network->getLayer_number());
+    Array3D<T> input;
+    {
+        PROFILE_SCOPE("parse");
+        for (int i = 0; i < network->getLayer_number(); i++) {
+            File_utils<T> kernel_util(initial_kernel_file_paths[i]);
+            kernel_util.parse_file();
+            kernel_util.get_initial_kernel(kernels[i]);
+        }
 
-    std::string input_matrix_str = "";
+        File_utils<T> input_util(initial_input_file_paths[0]);
+        input_util.parse_file();
+        int padding, step_size;
+        input_util.get_initial_input(input, padding, step_size);
+    }
+
+    Array3D<T> output;
+    if (network->load_weights(kernels) != 0)
+        exit(1);
+    int status = fused ? network->forward_fused(input, output) : network->forward(input, output);
+    if (status != 0)
+        exit(1);
+
+    PROFILE_SCOPE("write");
+    output_tofile(output);
+}
 
-    for (int i = 0; i < input_matrix.Size_2d(); i++) {
-        for (int j = 0; j < input_matrix.Size_1d(); j++) {
-            input_matrix_str += std::to_string(input_matrix[i][j]);
-            if (j != input_matrix.Size_1d() - 1)
-                input_matrix_str += " ";
+template <class T>
+void Test<T>::output_tofile(Array3D<T> &output) {
+    std::string output_str = std::to_string(output.Size_3d()) + " " + std::to_string(output.Size_2d()) + " " +
+                             std::to_string(output.Size_1d()) + "\n";
+
+    for (int i = 0; i < output.Size_3d(); i++) {
+        for (int j = 0; j < output.Size_2d(); j++) {
+            for (int m = 0; m < output.Size_1d(); m++) {
+                output_str += std::to_string(output[i][j][m]);
+                output_str += " ";
+            }
+        }
+        output_str += "\n";
+    }
+
+    std::ofstream output_ofstream(model_path + ".output", std::ofstream::trunc);
+    output_ofstream << output_str;
+    output_ofstream.close();
+}
+
+template <class T>
+std::string Test<T>::format_matrix(Array2D<T> &matrix) {
+    std::string matrix_str = "";
+
+    for (int i = 0; i < matrix.Size_2d(); i++) {
+        for (int j = 0; j < matrix.Size_1d(); j++) {
+            matrix_str += std::to_string(matrix[i][j]);
+            if (j != matrix.Size_1d() - 1)
+                matrix_str += " ";
             else
-                input_matrix_str += "\n";
+                matrix_str += "\n";
         }
     }
+    return matrix_str;
+}
 
+template <class T>
+void Test<T>::input_matrix_tofile(int layer_id, Array2D<T> &input_matrix) {
     std::ofstream input_matrix_ofstream(input_matrix_file_paths[layer_id], std::ofstream::trunc);
-    input_matrix_ofstream << input_matrix_str;
+    input_matrix_ofstream << format_matrix(input_matrix);
     input_matrix_ofstream << std::endl;
     input_matrix_ofstream.close();
 }
 
 template <class T>
 void Test<T>::kernel_matrix_tofile(int layer_id, Array2D<T> &kernel_matrix) {
-    std::string kernel_matrix_str = "";
-
-    for (int i = 0; i < kernel_matrix.Size_2d(); i++) {
-        for (int j = 0; j < kernel_matrix.Size_1d(); j++) {
-            kernel_matrix_str += std::to_string(kernel_matrix[i][j]);
-            if (j != kernel_matrix.Size_1d() - 1)
-                kernel_matrix_str += " ";
-            else
-                kernel_matrix_str += "\n";
-        }
-    }
-
     std::ofstream input_matrix_ofstream(kernel_matrix_file_paths[layer_id], std::ofstream::trunc);
-    input_matrix_ofstream << kernel_matrix_str;
+    input_matrix_ofstream << format_matrix(kernel_matrix);
     input_matrix_ofstream << std::endl;
     input_matrix_ofstream.close();
 }
 
+// windows of matrix_width values per line, written out in chunks as they
+// arrive so a bounded stream can feed it from another thread
+template <class T>
+void Test<T>::write_stream(int layer_id, Stream<T> &stream_input_matrix, std::ostream &out) {
+    Conv_params conv = network->conv_geometry(layer_id, 0, 1);
+    int matrix_width = conv.size_h * conv.size_w * network->getInput_channel()[layer_id];
+    write_rows(stream_input_matrix, matrix_width, out);
+    out << "\n";
+}
 
 template <class T>
-void Test<T>::stream_tofile(int layer_id, Stream<T> &stream_input_matrix) {
-    std::string stream_input_matrix_str = "";
+void Test<T>::write_rows(Stream<T> &stream, int row_width, std::ostream &out) {
+    std::string rows_str = "";
     int i = 0;
-    int matrix_width = network->getKernel_size()[layer_id] *
-            network->getKernel_size()[layer_id] *
-            network->getInput_channel()[layer_id];
 
-    while (!stream_input_matrix.empty()) {
+    while (!stream.empty()) {
         i++;
-        stream_input_matrix_str += std::to_string(stream_input_matrix.read());
-        stream_input_matrix_str += " ";
-        if (i == matrix_width) {
+        rows_str += std::to_string(stream.read());
+        rows_str += " ";
+        if (i == row_width) {
             i = 0;
-            stream_input_matrix_str += "\n";
+            rows_str += "\n";
+            if (rows_str.size() >= (1 << 16)) {
+                out << rows_str;
+                rows_str.clear();
+            }
         }
     }
+    out << rows_str;
+}
 
-    stream_input_matrix_str += "\n";
+template <class T>
+std::string Test<T>::format_stream(int layer_id, Stream<T> &stream_input_matrix) {
+    std::ostringstream out;
+    write_stream(layer_id, stream_input_matrix, out);
+    return out.str();
+}
 
+template <class T>
+void Test<T>::stream_tofile(int layer_id, Stream<T> &stream_input_matrix) {
     std::ofstream input_matrix_ofstream(stream_input_matrix_file_paths[layer_id], std::ofstream::trunc);
-    input_matrix_ofstream << stream_input_matrix_str;
+    input_matrix_ofstream << format_stream(layer_id, stream_input_matrix);
     input_matrix_ofstream << std::endl;
     input_matrix_ofstream.close();
 }
@@ -0,0 +1,388 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "alloc_tracker.h"
+#include "allocator.h"
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+inline std::vector<int> parse_cpu_list(const std::string &text) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == std::string::npos) comma = text.size();
+        std::string item = text.substr(pos, comma - pos);
+        size_t dash = item.find('-');
+        try {
+            if (dash == std::string::npos) {
+                cpus.push_back(std::stoi(item));
+            } else {
+                int first = std::stoi(item.substr(0, dash));
+                int last = std::stoi(item.substr(dash + 1));
+                for (int cpu = first; cpu <= last; cpu++)
+                    cpus.push_back(cpu);
+            }
+        } catch (...) {
+        }
+        pos = comma + 1;
+    }
+    return cpus;
+}
+
+// the CPUs this process may run on, one list per NUMA node (from
+// /sys/devices/system/node) that has any; a single list when the machine
+// reports no nodes
+inline std::vector<std::vector<int> > numa_nodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return std::vector<std::vector<int> >();
+
+    std::vector<std::vector<int> > node_cpus;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        std::vector<int> nodes;
+        while (struct dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") == 0 && name.size() > 4 && isdigit((unsigned char)name[4]))
+                nodes.push_back(atoi(name.c_str() + 4));
+        }
+        closedir(dir);
+        std::sort(nodes.begin(), nodes.end());
+        for (int node : nodes) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpu_list(list))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+            if (!cpus.empty()) node_cpus.push_back(cpus);
+        }
+    }
+    if (node_cpus.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        node_cpus.push_back(cpus);
+    }
+    return node_cpus;
+}
+
+// the same CPUs in node order, so consecutive workers share a node
+inline std::vector<int> cpus_by_node() {
+    std::vector<int> order;
+    for (const std::vector<int> &cpus : numa_nodes())
+        order.insert(order.end(), cpus.begin(), cpus.end());
+    return order;
+}
+
+// runs body on a thread allowed only on cpus and waits for it, so memory it
+// first touches is placed on their node
+inline void run_on_cpus(const std::vector<int> &cpus, const std::function<void()> &body) {
+    std::thread thread([&] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+            if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        body();
+    });
+    thread.join();
+}
+
+// Non-owning reference to a callable. Unlike std::function, binding a
+// lambda with many captures never allocates; it is only valid while the
+// callable lives, which a blocking parallel_for guarantees.
+template <class Signature>
+class Function_ref;
+
+template <class R, class... Args>
+class Function_ref<R(Args...)> {
+public:
+    template <class F, class = typename std::enable_if<
+                           !std::is_same<typename std::decay<F>::type, Function_ref>::value>::type>
+    Function_ref(F &&function)
+        : object((const void *)std::addressof(function)), call([](const void *object, Args... args) -> R {
+              return (*(typename std::remove_reference<F>::type *)object)(std::forward<Args>(args)...);
+          }) {}
+
+    R operator()(Args... args) const { return call(object, std::forward<Args>(args)...); }
+
+private:
+    const void *object;
+    R (*call)(const void *, Args...);
+};
+
+// Work-stealing pool. Every worker owns a deque: it pops its own newest task
+// and, when empty, steals the oldest task of another worker. parallel_for
+// submits one task for the whole range; a task larger than the grain splits
+// off its upper half onto the running thread's deque before working on the
+// lower half, so idle workers always find big pieces to steal and small
+// layers still spread across every thread. The calling thread works too.
+class Thread_pool {
+public:
+    // threads counts the caller; threads <= 0 means one per allowed CPU
+    Thread_pool(int threads = 0, bool pin = false);
+    ~Thread_pool();
+
+    int getThreads() const { return workers.size() + 1; }
+    long long getSteals() const { return steals.load(); }
+
+    // NUMA nodes the pinned workers run on (indices into numa_nodes()); an
+    // unpinned pool counts as one node. current_node is the calling
+    // thread's: its worker's node, or for other threads the node of the CPU
+    // it is on right now.
+    int getNodes() const { return node_count; }
+    int current_node() const;
+    const std::vector<int> &getNode_cpus(int node) const { return node_cpus[node]; }
+
+    void parallel_for(long long begin, long long end, long long grain, Function_ref<void(long long, long long)> body);
+    // rows x cols split into row_grain x col_grain tiles
+    void parallel_for_2d(long long rows, long long row_grain, long long cols, long long col_grain,
+                         Function_ref<void(long long, long long, long long, long long)> body);
+
+private:
+    struct Task {
+        const Function_ref<void(long long, long long)> *body;
+        long long begin, end, grain;
+        std::atomic<long long> *pending;
+    };
+    // deque blocks go back to the queue's pool, so once warmed up pushing
+    // and popping tasks stays off the heap
+    struct Worker_queue {
+        std::mutex lock;
+        Pool_allocator pool;
+        std::deque<Task, Std_allocator<Task> > tasks;
+        Worker_queue() : pool(1 << 12), tasks(Std_allocator<Task>(&pool)) {}
+    };
+
+    int own_queue() const;
+    void push(int queue, const Task &task);
+    bool pop(int queue, Task &task);
+    bool steal(int thief, Task &task);
+    void run(Task task);
+    void worker_loop(int id);
+
+    std::vector<Worker_queue *> queues;  // one per worker, the last one for callers
+    std::vector<std::thread> workers;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<long long> queued;
+    std::atomic<long long> steals;
+    bool stopping;
+
+    int node_count;
+    std::vector<int> worker_nodes;              // per worker, when pinned
+    std::vector<std::vector<int> > node_cpus;   // the nodes workers are pinned to
+    std::vector<int> cpu_nodes;                 // by CPU number, -1 off those nodes
+};
+
+// which pool, and which of its workers, the calling thread is
+struct Thread_pool_worker {
+    const Thread_pool *pool;
+    int id;
+};
+
+inline Thread_pool_worker &thread_pool_worker() {
+    thread_local Thread_pool_worker worker = {NULL, -1};
+    return worker;
+}
+
+inline Thread_pool::Thread_pool(int threads, bool pin) : queued(0), steals(0) {
+    std::vector<std::vector<int> > nodes = numa_nodes();
+    std::vector<int> cpus, nodes_of_cpus;
+    for (int node = 0; node < (int)nodes.size(); node++) {
+        cpus.insert(cpus.end(), nodes[node].begin(), nodes[node].end());
+        nodes_of_cpus.insert(nodes_of_cpus.end(), nodes[node].size(), node);
+    }
+    if (threads <= 0) threads = cpus.empty() ? (int)std::thread::hardware_concurrency() : (int)cpus.size();
+    if (threads <= 0) threads = 1;
+    stopping = false;
+    node_count = 1;
+
+    for (int i = 0; i < threads; i++)
+        queues.push_back(new Worker_queue());
+    for (int i = 0; i < threads - 1; i++) {
+        workers.push_back(std::thread(&Thread_pool::worker_loop, this, i));
+        // the caller usually sits on the first CPU, so workers start at the second
+        if (pin && !cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[(i + 1) % cpus.size()], &set);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+        }
+    }
+
+    // renumber the nodes that got a worker (or hold the caller's first CPU)
+    // densely, in node order
+    if (pin && !cpus.empty()) {
+        std::vector<int> dense(nodes.size(), -1);
+        for (int i = 0; i < threads; i++) {
+            int node = nodes_of_cpus[i % cpus.size()];
+            if (dense[node] < 0) {
+                dense[node] = node_cpus.size();
+                node_cpus.push_back(nodes[node]);
+            }
+        }
+        for (int i = 0; i < (int)workers.size(); i++)
+            worker_nodes.push_back(dense[nodes_of_cpus[(i + 1) % cpus.size()]]);
+        for (int i = 0; i < (int)cpus.size(); i++) {
+            if (cpus[i] >= (int)cpu_nodes.size()) cpu_nodes.resize(cpus[i] + 1, -1);
+            cpu_nodes[cpus[i]] = dense[nodes_of_cpus[i]];
+        }
+        node_count = node_cpus.size();
+    }
+}
+
+inline int Thread_pool::current_node() const {
+    if (node_count == 1) return 0;
+    const Thread_pool_worker &worker = thread_pool_worker();
+    if (worker.pool == this && worker.id < (int)worker_nodes.size()) return worker_nodes[worker.id];
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < (int)cpu_nodes.size() && cpu_nodes[cpu] >= 0 ? cpu_nodes[cpu] : 0;
+}
+
+inline Thread_pool::~Thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+    for (Worker_queue *queue : queues)
+        delete queue;
+}
+
+inline int Thread_pool::own_queue() const {
+    const Thread_pool_worker &worker = thread_pool_worker();
+    return worker.pool == this ? worker.id : (int)queues.size() - 1;
+}
+
+inline void Thread_pool::push(int queue, const Task &task) {
+    {
+        std::lock_guard<std::mutex> guard(queues[queue]->lock);
+        queues[queue]->tasks.push_back(task);
+    }
+    queued++;
+    if (!workers.empty()) {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        wake.notify_one();
+    }
+}
+
+inline bool Thread_pool::pop(int queue, Task &task) {
+    std::lock_guard<std::mutex> guard(queues[queue]->lock);
+    if (queues[queue]->tasks.empty()) return false;
+    task = queues[queue]->tasks.back();
+    queues[queue]->tasks.pop_back();
+    queued--;
+    return true;
+}
+
+inline bool Thread_pool::steal(int thief, Task &task) {
+    int count = queues.size();
+    for (int k = 1; k < count; k++) {
+        Worker_queue *victim = queues[(thief + k) % count];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (victim->tasks.empty()) continue;
+        task = victim->tasks.front();
+        victim->tasks.pop_front();
+        queued--;
+        steals++;
+        return true;
+    }
+    return false;
+}
+
+inline void Thread_pool::run(Task task) {
+    int queue = own_queue();
+    while (task.end - task.begin > task.grain) {
+        long long middle = task.begin + (task.end - task.begin) / 2;
+        Task upper = task;
+        upper.begin = middle;
+        push(queue, upper);
+        task.end = middle;
+    }
+    (*task.body)(task.begin, task.end);
+    task.pending->fetch_sub(task.end - task.begin);
+}
+
+inline void Thread_pool::worker_loop(int id) {
+    thread_pool_worker().pool = this;
+    thread_pool_worker().id = id;
+    ALLOC_TAG("thread_pool");
+    while (true) {
+        Task task;
+        if (pop(id, task) || steal(id, task)) {
+            run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+        if (stopping) return;
+    }
+}
+
+inline void Thread_pool::parallel_for(long long begin, long long end, long long grain,
+                                      Function_ref<void(long long, long long)> body) {
+    if (end <= begin) return;
+    if (grain < 1) grain = 1;
+    if (workers.empty() || end - begin <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    std::atomic<long long> pending(end - begin);
+    Task task;
+    task.body = &body;
+    task.begin = begin;
+    task.end = end;
+    task.grain = grain;
+    task.pending = &pending;
+    run(task);
+
+    // help with whatever is left, ours or anyone else's, until our range is done
+    int queue = own_queue();
+    while (pending.load() > 0) {
+        Task other;
+        if (pop(queue, other) || steal(queue, other))
+            run(other);
+        else
+            std::this_thread::yield();
+    }
+}
+
+inline void Thread_pool::parallel_for_2d(long long rows, long long row_grain, long long cols, long long col_grain,
+                                         Function_ref<void(long long, long long, long long, long long)> body) {
+    if (row_grain < 1) row_grain = 1;
+    if (col_grain < 1) col_grain = 1;
+    long long row_tiles = (rows + row_grain - 1) / row_grain;
+    long long col_tiles = (cols + col_grain - 1) / col_grain;
+    parallel_for(0, row_tiles * col_tiles, 1, [&](long long first, long long last) {
+        for (long long tile = first; tile < last; tile++) {
+            long long r = tile / col_tiles, c = tile % col_tiles;
+            body(r * row_grain, std::min(rows, (r + 1) * row_grain), c * col_grain,
+                 std::min(cols, (c + 1) * col_grain));
+        }
+    });
+}
+
+#endif //THREAD_POOL_H